@@ -0,0 +1,25 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <QObject>
+#include <QElapsedTimer>
+
+class Socket;
+
+//  Takes the messages SockEvent hands over, one per readyRead, and ends
+//  the reactor after the last one
+class EventSink : public QObject
+{
+    Q_OBJECT
+public:
+    explicit EventSink(int count) : expected(count), received(0) {}
+
+    int expected;               //  Messages to take
+    int received;               //  Messages taken so far
+    QElapsedTimer watch;        //  Started on first message
+
+public slots:
+    void readHappend(Socket* socket, int* rc);
+};
+
+#endif // BENCH_H
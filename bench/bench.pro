@@ -0,0 +1,44 @@
+#-------------------------------------------------
+#
+# qmq benchmarks, see main.cpp for usage
+#
+#-------------------------------------------------
+
+QT       += core
+QT       -= gui
+
+TARGET = bench
+CONFIG   += console
+CONFIG   -= app_bundle
+
+DESTDIR = ../lib
+OBJECTS_DIR = tmp
+MOC_DIR = tmp
+
+TEMPLATE = app
+
+
+SOURCES += main.cpp
+
+HEADERS += bench.h
+
+INCLUDEPATH += ../include
+
+CONFIG += debug_and_release
+
+# raw libzmq is the baseline layer
+unix: LIBS += -L/usr/local/lib -lzmq
+win32: LIBS += -lzmq
+
+LIBS += -L../lib
+CONFIG(debug, debug|release) {
+    mac: LIBS += -lqmq_debug
+    win32: LIBS += qmqd.lib
+    unix: LIBS += -lqmqd
+}
+
+CONFIG(release, debug|release) {
+    mac: { LIBS += -lqmq }
+    win32: { LIBS += qmq.lib }
+    unix: { LIBS += -lqmq }
+}
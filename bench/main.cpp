@@ -0,0 +1,750 @@
+#include <QCoreApplication>
+#include "../qmq/qmq.h"
+#include "bench.h"
+#include <QThread>
+#include <QStringList>
+#include <QVector>
+#include <QFile>
+#include <QHash>
+#include <QDateTime>
+
+#undef min
+#undef max
+
+#include <algorithm>
+
+//  qmq benchmarks, after the libzmq perf tools: throughput and latency of
+//  each qmq layer over inproc, ipc and tcp, with raw libzmq as baseline.
+//
+//      bench [-c count] [-s size,...] [-p port] [-o file] [-b file] [layer ...]
+//          runs the given layers, or all of them, on every transport and
+//          writes one JSON document, to stdout without -o. Without -s the
+//          mdp layer sweeps 1 KB, 64 KB and 10 MB payloads
+//      bench local_thr|remote_thr|local_lat|remote_lat endpoint size count [layer]
+//          one side of a two process run, as local_thr and friends; the
+//          local side binds, the measuring side prints its JSON result
+//
+//  -b takes the JSON of an earlier run as baseline, each result that is
+//  in both gets the baseline value and overhead_pct, the extra time per
+//  message in percent (msgs_per_sec for throughput, p50 for latency).
+//  The "stats" field tells how the library was built: "frame" of a
+//  "compiled" run against a CONFIG+=qmq_nostats ("none") baseline is the
+//  cost of disabled stats.
+//
+//  Layers: zmq (raw zmq_msg), frame, messages, picture (send/recv),
+//  binary (bsend/brecv), stats (frame with socket stats enabled, against
+//  frame it is the instrumentation cost), proxy (qproxy), sevent
+//  (SockEvent), mdp (broker round trips), gossip (GossipFrame codec, one
+//  PUBLISH per message, then BENCH_BATCH tuples per BATCH message, the
+//  payload is the value). Throughput counts from the first message, as local_thr.
+//  Latencies are round trips, in usecs.
+
+#define BENCH_COUNT     100000  //  Throughput messages, latency takes 1/10
+#define BENCH_SIZE      64
+#define BENCH_PORT      5755    //  First tcp port
+#define BENCH_WINDOW    16      //  MDP requests in flight for throughput
+#define BENCH_BATCH     64      //  Gossip tuples per BATCH message
+
+//  Payloads of the mdp sweep; count is scaled so every size moves about
+//  as many bytes as count messages of 1 KB
+static const int s_mdp_sizes [] = { 1024, 64 * 1024, 10 * 1024 * 1024, 0 };
+
+enum {
+    LAYER_ZMQ, LAYER_FRAME, LAYER_MESSAGES, LAYER_PICTURE, LAYER_BINARY,
+    LAYER_STATS, LAYER_PROXY, LAYER_SEVENT, LAYER_MDP, LAYER_GOSSIP
+};
+
+static const char *s_layers [] = {
+    "zmq", "frame", "messages", "picture", "binary",
+    "stats", "proxy", "sevent", "mdp", "gossip", NULL
+};
+
+static int s_layer(const QString &name)
+{
+    for (int index = 0; s_layers [index]; index++)
+        if (name == s_layers [index])
+            return index;
+    return -1;
+}
+
+//  One run of one layer, filled in by the measuring side
+
+class Job {
+public:
+    Job() : layer(LAYER_FRAME), size(BENCH_SIZE), count(BENCH_COUNT), elapsed(0) {}
+
+    int layer;
+    QString endpoint;
+    QString backend;            //  Proxy output
+    int size;
+    int count;
+    QByteArray payload;
+    qint64 elapsed;             //  Throughput time, nsecs
+    QVector<qint64> samples;    //  Round trips, nsecs
+};
+
+//  Send and receive one message through a socket layer; receive returns
+//  the payload size, -1 on error
+
+static int s_send(Socket *socket, int layer, const QByteArray &payload)
+{
+    if (layer == LAYER_ZMQ)
+        return zmq_send(socket->resolve(), payload.constData(), payload.size(), 0) == -1 ? -1 : 0;
+
+    if (layer == LAYER_MESSAGES) {
+        Messages msg;
+        msg.append(QString("BENCH"));
+        msg.appendmem(payload.constData(), payload.size());
+        return msg.send(*socket);
+    }
+    if (layer == LAYER_PICTURE)
+        return socket->send("sb", "BENCH", payload.constData(), (size_t) payload.size());
+
+    if (layer == LAYER_BINARY)
+        return socket->bsend("4c", (uint32_t) payload.size(), const_cast<QByteArray *>(&payload));
+
+    Frame frame(payload.constData(), payload.size());
+    return frame.send(*socket, 0);
+}
+
+static int s_recv(Socket *socket, int layer)
+{
+    if (layer == LAYER_ZMQ) {
+        zmq_msg_t msg;
+        zmq_msg_init (&msg);
+        int rc = zmq_msg_recv (&msg, socket->resolve(), 0);
+        zmq_msg_close (&msg);
+        return rc;
+    }
+    if (layer == LAYER_MESSAGES) {
+        Messages msg;
+        if (!msg.recv(*socket) || msg.size() != 2)
+            return -1;
+        return msg.last()->size();
+    }
+    if (layer == LAYER_PICTURE) {
+        QString name;
+        byte *data;
+        size_t size;
+        if (socket->recv("sb", &name, &data, &size) == -1)
+            return -1;
+        free (data);
+        return int(size);
+    }
+    if (layer == LAYER_BINARY) {
+        uint32_t size;
+        QByteArray *chunk;
+        if (socket->brecv("4c", &size, &chunk) == -1)
+            return -1;
+        int rc = chunk->size();
+        delete chunk;
+        return rc;
+    }
+
+    Frame frame;
+    if (!frame.recv(*socket))
+        return -1;
+    return frame.size();
+}
+
+static Socket *s_socket(int type, const QString &endpoint, bool serverish,
+                        int layer = LAYER_FRAME)
+{
+    Socket *socket = srnet->createSocket(type);
+    socket->setStatsEnabled(layer == LAYER_STATS);
+    int rc = serverish
+            ? socket->bind("%s", endpoint.toLatin1().constData())
+            : socket->connect("%s", endpoint.toLatin1().constData());
+    if (rc == -1) {
+        qWarning("bench: can't %s '%s'", serverish ? "bind" : "connect",
+                 endpoint.toLatin1().constData());
+        delete socket;
+        return NULL;
+    }
+    return socket;
+}
+
+//  The two sides of each test. Local ones take a bound socket, so the
+//  remote side never connects before there is something to connect to.
+
+static void s_local_thr(Job &job, Socket *socket)
+{
+    QElapsedTimer watch;
+    for (int index = 0; index < job.count; index++) {
+        if (s_recv(socket, job.layer) != job.size) {
+            qWarning("bench: bad message");
+            return;
+        }
+        if (index == 0)
+            watch.start();
+    }
+    job.elapsed = watch.nsecsElapsed();
+}
+
+static void s_remote_thr(Job &job)
+{
+    Socket *socket = s_socket(ZMQ_PUSH, job.endpoint, false, job.layer);
+    if (!socket)
+        return;
+    //  Close waits until the last message is out
+    socket->setLinger(-1);
+    for (int index = 0; index < job.count; index++)
+        s_send(socket, job.layer, job.payload);
+    delete socket;
+}
+
+static void s_local_lat(Job &job, Socket *socket)
+{
+    for (int index = 0; index < job.count; index++) {
+        if (s_recv(socket, job.layer) != job.size
+        ||  s_send(socket, job.layer, job.payload) != 0) {
+            qWarning("bench: bad message");
+            return;
+        }
+    }
+}
+
+static void s_remote_lat(Job &job)
+{
+    Socket *socket = s_socket(ZMQ_REQ, job.endpoint, false, job.layer);
+    if (!socket)
+        return;
+    job.samples.reserve(job.count);
+    QElapsedTimer watch;
+    for (int index = 0; index < job.count; index++) {
+        watch.start();
+        s_send(socket, job.layer, job.payload);
+        if (s_recv(socket, job.layer) != job.size)
+            break;
+        job.samples.append(watch.nsecsElapsed());
+    }
+    delete socket;
+}
+
+//  Remote side in its own thread, for single process runs
+
+class Peer : public QThread {
+public:
+    Peer(Job *j, void (*f)(Job&)) : job(j), function(f) {}
+    void run() { function(*job); }
+
+    Job *job;
+    void (*function)(Job&);
+};
+
+void EventSink::readHappend(Socket *socket, int *rc)
+{
+    Frame frame;
+    frame.recv(*socket);
+    if (received++ == 0)
+        watch.start();
+    if (received == expected)
+        *rc = -1;
+}
+
+//  Runs of the layers that are not a plain socket pair
+
+static void s_proxy_thr(Job &job)
+{
+    ActorSocket proxy(qproxy, NULL);
+    proxy.sendx("FRONTEND", "PULL", job.endpoint.toLatin1().constData(), NULL);
+    proxy.wait();
+    proxy.sendx("BACKEND", "PUSH", job.backend.toLatin1().constData(), NULL);
+    proxy.wait();
+
+    Socket *sink = s_socket(ZMQ_PULL, job.backend, false);
+    if (!sink)
+        return;
+    job.layer = LAYER_FRAME;
+    Peer peer(&job, s_remote_thr);
+    peer.start();
+    s_local_thr(job, sink);
+    peer.wait();
+    job.layer = LAYER_PROXY;
+    delete sink;
+}
+
+static void s_sevent_thr(Job &job)
+{
+    Socket *input = s_socket(ZMQ_PULL, job.endpoint, true);
+    if (!input)
+        return;
+
+    SockEvent node;
+    EventSink sink(job.count);
+    node.appendReader(input);
+    QObject::connect(&node, SIGNAL(readyRead(Socket*,int*)),
+                     &sink, SLOT(readHappend(Socket*,int*)), Qt::DirectConnection);
+
+    job.layer = LAYER_FRAME;
+    Peer peer(&job, s_remote_thr);
+    node.start();
+    peer.start();
+    peer.wait();
+    node.wait();
+    job.layer = LAYER_SEVENT;
+    job.elapsed = sink.watch.nsecsElapsed();
+    delete input;
+}
+
+//  Round trips through a broker, with a raw worker that echoes; window 1
+//  gives latencies, a larger one throughput
+
+static void s_mdp(Job &job, int window)
+{
+    MdpBroker broker(srnet);
+    if (broker.bind(job.endpoint.toLatin1().constData()) == -1)
+        return;
+    broker.start();
+
+    Socket *worker = s_socket(ZMQ_DEALER, job.endpoint, false);
+    Socket *client = s_socket(ZMQ_DEALER, job.endpoint, false);
+    if (!worker || !client) {
+        delete worker;
+        delete client;
+        broker.stop();
+        return;
+    }
+    worker->sendmem("", 0, QFRAME_MORE);
+    worker->sendx(QMDPW, MDPW_READY, "bench", QByteArray::number(window).constData(), NULL);
+
+    QVector<qint64> sent_at(job.count);
+    QElapsedTimer watch;
+    watch.start();
+    int sent = 0, received = 0;
+    while (received < job.count) {
+        while (sent < job.count && sent - received < window) {
+            Messages request;
+            request.appendmem(NULL, 0);
+            request.append(QString(QMDPC));
+            request.append(QString("bench"));
+            request.appendmem(job.payload.constData(), job.payload.size());
+            sent_at [sent++] = watch.nsecsElapsed();
+            request.send(*client);
+        }
+        zmq_pollitem_t items [] = {
+            { worker->resolve(), 0, ZMQ_POLLIN, 0 },
+            { client->resolve(), 0, ZMQ_POLLIN, 0 } };
+        if (zmq_poll (items, 2, -1) == -1)
+            break;
+        if (items [0].revents & ZMQ_POLLIN) {
+            //  Header and command are replaced, envelope and body go
+            //  back as they came
+            Messages msgs;
+            msgs.recv(*worker);
+            delete msgs.pop();
+            delete msgs.pop();
+            Frame *command = msgs.pop();
+            if (command && command->size() == 1
+            &&  *(const char *) command->constData() == MDPW_REQUEST [0]) {
+                msgs.push(MDPW_REPORT, 1);
+                msgs.push(QMDPW, 7);
+                msgs.push("", 0);
+                msgs.send(*worker);
+            }
+            delete command;
+        }
+        if (items [1].revents & ZMQ_POLLIN) {
+            Messages reply;
+            reply.recv(*client);
+            //  Replies come back in order with one worker
+            if (window == 1)
+                job.samples.append(watch.nsecsElapsed() - sent_at [received]);
+            received++;
+        }
+    }
+    job.elapsed = watch.nsecsElapsed();
+
+    delete client;
+    delete worker;
+    broker.stop();
+}
+
+//  GossipFrame encode and decode, sent and received in one thread; with
+//  batch, count is the number of tuples
+
+static void s_gossip(Job &job, bool batch)
+{
+    Socket *output = s_socket(ZMQ_DEALER, job.endpoint, true);
+    Socket *input = output ? s_socket(ZMQ_ROUTER, job.endpoint, false) : NULL;
+    if (!input) {
+        delete output;
+        return;
+    }
+
+    GossipFrame sender, receiver;
+    if (batch) {
+        sender.setId(GOSSIP_MSG_BATCH);
+        for (int index = 0; index < BENCH_BATCH; index++)
+            sender.appendTuple("service/endpoint/node-0001", job.payload, 30000);
+    }
+    else {
+        sender.setId(GOSSIP_MSG_PUBLISH);
+        sender.setKey("service/endpoint/node-0001");
+        sender.setValueData(job.payload);
+        sender.setTimeToLive(30000);
+    }
+
+    QElapsedTimer watch;
+    watch.start();
+    int tuples = 0;
+    while (tuples < job.count) {
+        if (sender.send(*output) != 0 || !receiver.recv(*input))
+            break;
+        if (batch) {
+            int decoded = tuples;
+            while (receiver.nextTuple())
+                tuples++;
+            if (tuples == decoded)
+                break;          //  Batch didn't decode
+        }
+        else
+            tuples++;
+    }
+    if (tuples >= job.count)
+        job.elapsed = watch.nsecsElapsed();
+    job.count = tuples;
+
+    delete input;
+    delete output;
+}
+
+//  Results, one JSON object each
+
+static QString s_percentile(QVector<qint64> &samples, double rank)
+{
+    int index = qMin(int(samples.size() * rank), samples.size() - 1);
+    return QString::number(samples [index] / 1000.0, 'f', 2);
+}
+
+static QString s_result(const char *test, const Job &job, const QString &transport)
+{
+    QString json = QString("{ \"test\": \"%1\", \"layer\": \"%2\", \"transport\": \"%3\", "
+                           "\"size\": %4, \"count\": %5")
+            .arg(test).arg(s_layers [job.layer]).arg(transport).arg(job.size).arg(job.count);
+
+    if (job.samples.size()) {
+        QVector<qint64> samples = job.samples;
+        std::sort(samples.begin(), samples.end());
+        json += QString(", \"latency_usec\": { \"p50\": %1, \"p90\": %2, \"p99\": %3, "
+                        "\"p999\": %4, \"max\": %5 }")
+                .arg(s_percentile(samples, 0.5)).arg(s_percentile(samples, 0.9))
+                .arg(s_percentile(samples, 0.99)).arg(s_percentile(samples, 0.999))
+                .arg(s_percentile(samples, 1.0));
+    }
+    else
+    if (job.elapsed > 0) {
+        double seconds = job.elapsed / 1e9;
+        double rate = job.count / seconds;
+        json += QString(", \"msgs_per_sec\": %1, \"mbit_per_sec\": %2")
+                .arg(qint64(rate))
+                .arg(QString::number(rate * job.size * 8 / 1e6, 'f', 3));
+    }
+    else
+        json += ", \"error\": true";
+    return json + " }";
+}
+
+//  Baseline comparison. Results are one per line, keyed by the text
+//  before count, so test, layer, transport and size have to match.
+
+static QString s_key(const QString &result)
+{
+    return result.left(result.indexOf(", \"count\""));
+}
+
+//  Time per message, smaller is better; 0 if the result has none
+static double s_cost(const QString &result)
+{
+    int start = result.indexOf("\"msgs_per_sec\": ");
+    if (start >= 0) {
+        start += 16;
+        double rate = result.mid(start, result.indexOf(',', start) - start).toDouble();
+        return rate > 0 ? 1 / rate : 0;
+    }
+    start = result.indexOf("\"p50\": ");
+    if (start >= 0) {
+        start += 7;
+        return result.mid(start, result.indexOf(',', start) - start).toDouble();
+    }
+    return 0;
+}
+
+static QString s_metric(const QString &result)
+{
+    double cost = s_cost(result);
+    if (result.contains("\"msgs_per_sec\""))
+        return QString::number(qint64(1 / cost));
+    return QString::number(cost, 'f', 2);
+}
+
+static bool s_baseline(const QString &path, QHash<QString, QString> &baseline)
+{
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly))
+        return false;
+    while (!file.atEnd()) {
+        QString line = QString::fromLatin1(file.readLine()).trimmed();
+        if (line.endsWith(','))
+            line.chop(1);
+        if (line.startsWith("{ \"test\"") && s_cost(line) > 0)
+            baseline [s_key(line)] = line;
+    }
+    return true;
+}
+
+static QString s_compare(const QString &result, const QHash<QString, QString> &baseline)
+{
+    QString base = baseline.value(s_key(result));
+    double cost = s_cost(result);
+    if (base.isEmpty() || cost <= 0)
+        return result;
+    double overhead = (cost / s_cost(base) - 1) * 100;
+    QString extra = QString(", \"baseline\": %1, \"overhead_pct\": %2 }")
+            .arg(s_metric(base)).arg(QString::number(overhead, 'f', 2));
+    return result.left(result.lastIndexOf(" }")) + extra;
+}
+
+//  "compiled" unless the library was built with QMQ_NO_STATS
+static const char *s_stats_build()
+{
+    Socket *socket = srnet->createSocket(ZMQ_PAIR);
+    socket->setStatsEnabled(true);
+    bool compiled = socket->statsEnabled();
+    delete socket;
+    return compiled ? "compiled" : "none";
+}
+
+//  Single process run of one layer on one transport
+
+static QStringList s_run(int layer, const QString &transport, int size, int count, int &port)
+{
+    QStringList results;
+    Job job;
+    job.layer = layer;
+    job.size = size;
+    job.count = count;
+    job.payload = QByteArray(size, 'x');
+
+    QString endpoints [2];
+    for (int index = 0; index < 2; index++) {
+        if (transport == "tcp")
+            endpoints [index] = QString("tcp://127.0.0.1:%1").arg(port++);
+        else
+        if (transport == "ipc")
+            endpoints [index] = QString("ipc:///tmp/qmq-bench-%1").arg(port++);
+        else
+            endpoints [index] = QString("inproc://qmq-bench-%1").arg(port++);
+    }
+    job.endpoint = endpoints [0];
+    job.backend = endpoints [1];
+
+    if (layer == LAYER_PROXY) {
+        s_proxy_thr(job);
+        results << s_result("thr", job, transport);
+        return results;
+    }
+    if (layer == LAYER_SEVENT) {
+        s_sevent_thr(job);
+        results << s_result("thr", job, transport);
+        return results;
+    }
+    if (layer == LAYER_MDP) {
+        s_mdp(job, BENCH_WINDOW);
+        results << s_result("thr", job, transport);
+        job.count = qMax(count / 10, 1);
+        job.endpoint = job.backend;
+        s_mdp(job, 1);
+        results << s_result("lat", job, transport);
+        return results;
+    }
+    if (layer == LAYER_GOSSIP) {
+        s_gossip(job, false);
+        results << s_result("thr", job, transport);
+        job.count = count;
+        job.elapsed = 0;
+        job.endpoint = job.backend;
+        s_gossip(job, true);
+        results << s_result("batch", job, transport);
+        return results;
+    }
+
+    Socket *socket = s_socket(ZMQ_PULL, job.endpoint, true, layer);
+    if (socket) {
+        Peer peer(&job, s_remote_thr);
+        peer.start();
+        s_local_thr(job, socket);
+        peer.wait();
+        delete socket;
+    }
+    results << s_result("thr", job, transport);
+
+    job.count = qMax(count / 10, 1);
+    job.endpoint = job.backend;
+    socket = s_socket(ZMQ_REP, job.endpoint, true, layer);
+    if (socket) {
+        Peer peer(&job, s_remote_lat);
+        peer.start();
+        s_local_lat(job, socket);
+        peer.wait();
+        delete socket;
+    }
+    results << s_result("lat", job, transport);
+    return results;
+}
+
+//  Two process mode, one side per process
+
+static int s_split(const QStringList &args)
+{
+    if (args.size() < 5)
+        return -1;
+
+    Job job;
+    job.endpoint = args [2];
+    job.size = args [3].toInt();
+    job.count = args [4].toInt();
+    job.layer = args.size() > 5 ? s_layer(args [5]) : LAYER_FRAME;
+    if (job.layer < 0 || job.layer > LAYER_STATS || job.size < 0 || job.count <= 0)
+        return -1;
+    job.payload = QByteArray(job.size, 'x');
+
+    QString transport = job.endpoint.left(job.endpoint.indexOf(':'));
+    QString mode = args [1];
+    if (mode == "local_thr" || mode == "local_lat") {
+        Socket *socket = s_socket(mode == "local_thr" ? ZMQ_PULL : ZMQ_REP, job.endpoint, true,
+                                   job.layer);
+        if (!socket)
+            return 1;
+        if (mode == "local_thr") {
+            s_local_thr(job, socket);
+            printf ("%s\n", s_result("thr", job, transport).toLatin1().constData());
+        }
+        else
+            s_local_lat(job, socket);
+        delete socket;
+    }
+    else
+    if (mode == "remote_thr")
+        s_remote_thr(job);
+    else
+    if (mode == "remote_lat") {
+        s_remote_lat(job);
+        printf ("%s\n", s_result("lat", job, transport).toLatin1().constData());
+    }
+    else
+        return -1;
+    return 0;
+}
+
+static void s_usage()
+{
+    fprintf (stderr,
+        "usage: bench [-c count] [-s size,...] [-p port] [-o file] [-b file] [layer ...]\n"
+        "       bench local_thr|remote_thr|local_lat|remote_lat endpoint size count [layer]\n"
+        "layers: zmq frame messages picture binary stats proxy sevent mdp gossip\n");
+}
+
+int main (int argc, char *argv [])
+{
+    QCoreApplication a(argc, argv);
+    QStringList args = a.arguments();
+
+    if (args.size() > 1 && args [1].contains('_')) {
+        int rc = s_split(args);
+        if (rc == -1)
+            s_usage();
+        return rc == 0 ? 0 : 1;
+    }
+
+    int count = BENCH_COUNT;
+    int port = BENCH_PORT;
+    QList<int> sizes;
+    QList<int> layers;
+    QString output;
+    QHash<QString, QString> baseline;
+    for (int index = 1; index < args.size(); index++) {
+        QString arg = args [index];
+        if ((arg == "-c" || arg == "-s" || arg == "-p" || arg == "-o" || arg == "-b")
+        &&  index + 1 < args.size()) {
+            QString value = args [++index];
+            if (arg == "-c")
+                count = qMax(value.toInt(), 10);
+            else
+            if (arg == "-p")
+                port = value.toInt();
+            else
+            if (arg == "-o")
+                output = value;
+            else
+            if (arg == "-b") {
+                if (!s_baseline(value, baseline)) {
+                    qWarning("bench: can't read '%s'", value.toLocal8Bit().constData());
+                    return 1;
+                }
+            }
+            else
+                foreach (QString size, value.split(','))
+                    sizes << size.toInt();
+        }
+        else
+        if (s_layer(arg) >= 0)
+            layers << s_layer(arg);
+        else {
+            s_usage();
+            return 1;
+        }
+    }
+    if (layers.isEmpty())
+        for (int layer = LAYER_ZMQ; layer <= LAYER_GOSSIP; layer++)
+            layers << layer;
+
+    QStringList transports;
+    transports << "inproc";
+#ifndef Q_OS_WIN
+    transports << "ipc";
+#endif
+    transports << "tcp";
+
+    QStringList results;
+    foreach (int layer, layers) {
+        QList<int> layer_sizes = sizes;
+        bool sweep = layer_sizes.isEmpty() && layer == LAYER_MDP;
+        if (sweep)
+            for (int index = 0; s_mdp_sizes [index]; index++)
+                layer_sizes << s_mdp_sizes [index];
+        else
+        if (layer_sizes.isEmpty())
+            layer_sizes << BENCH_SIZE;
+
+        foreach (int size, layer_sizes)
+            foreach (QString transport, transports) {
+                int runs = sweep ? qMax(int(qint64(count) * 1024 / size), 10) : count;
+                fprintf (stderr, " * bench: %s %s %d\n", s_layers [layer],
+                         transport.toLatin1().constData(), size);
+                foreach (QString result, s_run(layer, transport, size, runs, port))
+                    results << s_compare(result, baseline);
+            }
+    }
+
+    int major, minor, patch;
+    zmq_version (&major, &minor, &patch);
+    QString json = QString("{\n  \"zmq\": \"%1.%2.%3\",\n  \"date\": \"%4\",\n"
+                           "  \"stats\": \"%5\",\n  \"results\": [\n    %6\n  ]\n}\n")
+            .arg(major).arg(minor).arg(patch)
+            .arg(QDateTime::currentDateTime().toString(Qt::ISODate))
+            .arg(s_stats_build())
+            .arg(results.join(",\n    "));
+
+    if (output.isEmpty())
+        printf ("%s", json.toLatin1().constData());
+    else {
+        QFile file(output);
+        if (!file.open(QFile::WriteOnly)) {
+            qWarning("bench: can't write '%s'", output.toLocal8Bit().constData());
+            return 1;
+        }
+        file.write(json.toLatin1());
+    }
+    return 0;
+}
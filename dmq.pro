@@ -2,4 +2,5 @@ TEMPLATE = subdirs
 
 SUBDIRS += \
     qmq \
-    test
+    test \
+    bench
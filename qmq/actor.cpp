@@ -1,5 +1,6 @@
 #include "helper.h"
 #include "socket_p.hpp"
+#include <QMap>
 #include <QThread>
 #include <QDebug>
 
@@ -134,36 +135,91 @@ void ActorSocket::test()
 
 // Monitor implementation
 // a monitor has different class of pollings
+//
+// One actor can watch many sockets: the socket given as args, if any, and
+// any number added with ADD. Events are delivered as MODE says:
+//      STRING  event name, value and address, then the socket name for
+//              sockets added with a name (default)
+//      BINARY  one bsend "24ss" frame: event, value, socket name, address
+//      QUIET   nothing, use STATS or ROLLUP
+// Each socket keeps counters per endpoint. STATS, and every ROLLUP msecs
+// if anything changed, sends "STATS" and then seven frames per endpoint:
+// socket name, endpoint, peers, connected, disconnected, retried, failed.
+
+//  Aggregated state of one endpoint of a monitored socket
+class MonitorEndpoint {
+public:
+    MonitorEndpoint() {
+        peers = connected = disconnected = retried = failed = 0;
+    }
+
+    int peers;                  //  Connected peers now
+    int connected;              //  CONNECTED and ACCEPTED events
+    int disconnected;           //  DISCONNECTED events
+    int retried;                //  CONNECT_RETRIED, reconnect attempts
+    int failed;                 //  Bind, accept and handshake failures
+};
+
+//  One monitored socket, with its own event sink
+class MonitorTarget {
+public:
+    MonitorTarget(Socket* s, const QString& n) {
+        socket = s;
+        name = n;
+        sink = 0;
+    }
+
+    Socket* socket;
+    Socket* sink;               //  Event sink, once started
+    QString name;               //  Name given with ADD, or empty
+    QMap<QString, MonitorEndpoint> endpoints;
+};
+
+enum { MONITOR_STRING, MONITOR_BINARY, MONITOR_QUIET };
 
 class MonitorHandler {
 public:
     MonitorHandler(Socket* pip, Socket* monitored) {
         pipe = pip;
-        monitor = monitored;
         terminated = false;
         verbose = false;
+        started = false;
+        changed = false;
+        events = 0;
+        mode = MONITOR_STRING;
+        rollup = 0;
+        rollup_at = 0;
         poller.append(pipe);
-        sink = 0;
+        if (monitored)
+            targets.append(new MonitorTarget(monitored, QString()));
     }
 
     ~MonitorHandler()
     {
-#if defined (ZMQ_EVENT_ALL)
-        zmq_socket_monitor (monitor->resolve(), NULL, 0);
-#endif
-        sink->deleteLater();
+        foreach (MonitorTarget* target, targets)
+            stop(target);
+        qDeleteAll(targets);
     }
 
     void listen(const QString &msg);
     void start();
+    void start(MonitorTarget* target);
+    void stop(MonitorTarget* target);
     int handlePipe();
-    void handleSink();
+    void handleSink(MonitorTarget* target);
+    void aggregate(MonitorTarget* target, int event, const QString& address);
+    void sendStats();
+    int timeout();
 
-    Socket* sink;
     Socket* pipe;
-    Socket* monitor;
+    QList<MonitorTarget*> targets;
     Poller poller;
-    int events;
+    int events;                 //  Events to listen to, 0 = all
+    int mode;                   //  How events go to the pipe
+    int rollup;                 //  Rollup interval, msecs, 0 = none
+    qint64 rollup_at;           //  Next rollup, clock_mono
+    bool started;               //  START received
+    bool changed;               //  Counters changed since last stats
     bool terminated;
     bool verbose;
 };
@@ -205,6 +261,13 @@ void MonitorHandler::listen(const QString& msg)
     if (msg == "MONITOR_STOPPED")
         events |= ZMQ_EVENT_MONITOR_STOPPED;
     else
+#endif
+#if defined (ZMQ_EVENT_HANDSHAKE_FAILED_NO_DETAIL)
+    if (msg == "HANDSHAKE_FAILED")
+        events |= ZMQ_EVENT_HANDSHAKE_FAILED_NO_DETAIL
+                | ZMQ_EVENT_HANDSHAKE_FAILED_PROTOCOL
+                | ZMQ_EVENT_HANDSHAKE_FAILED_AUTH;
+    else
 #endif
     if (msg == "ALL")
         events |= ZMQ_EVENT_ALL;
@@ -215,22 +278,43 @@ void MonitorHandler::listen(const QString& msg)
 
 void MonitorHandler::start()
 {
-    assert (!sink);
-    char *endpoint = zsys_sprintf ("inproc://qmonitor-%p", monitor->resolve());
+    started = true;
+    foreach (MonitorTarget* target, targets)
+        start(target);
+}
+
+void MonitorHandler::start(MonitorTarget* target)
+{
+    if (target->sink)
+        return;
+    char *endpoint = zsys_sprintf ("inproc://qmonitor-%p", target->socket->resolve());
     assert (endpoint);
     int rc;
 #if defined (ZMQ_EVENT_ALL)
-    rc = zmq_socket_monitor(monitor->resolve(), endpoint, events);
+    rc = zmq_socket_monitor(target->socket->resolve(), endpoint,
+                            events ? events : ZMQ_EVENT_ALL);
     assert (rc == 0);
 #endif
-    Context* cntx = monitor->context();
-    sink = (Socket*)cntx->createSocket(ZMQ_PAIR);
-    rc = sink->connect("%s", endpoint);
+    Context* cntx = target->socket->context();
+    target->sink = (Socket*)cntx->createSocket(ZMQ_PAIR);
+    rc = target->sink->connect("%s", endpoint);
     assert (rc == 0);
-    poller.append(sink);
+    poller.append(target->sink);
     free (endpoint);
 }
 
+void MonitorHandler::stop(MonitorTarget *target)
+{
+    if (!target->sink)
+        return;
+#if defined (ZMQ_EVENT_ALL)
+    zmq_socket_monitor (target->socket->resolve(), NULL, 0);
+#endif
+    poller.remove(target->sink);
+    target->sink->deleteLater();
+    target->sink = 0;
+}
+
 int MonitorHandler::handlePipe()
 {
     Messages mlist;
@@ -261,6 +345,56 @@ int MonitorHandler::handlePipe()
         pipe->signal(0);
     }
     else
+    if(cmd == "ADD" || cmd == "REMOVE")
+    {
+        //  Socket pointer, as send "p", then its name for ADD
+        Frame *frame = mlist.pop();
+        Socket *socket = frame && frame->size() == sizeof (void *)
+                       ? *(Socket **) frame->data() : NULL;
+        delete frame;
+        MonitorTarget *found = NULL;
+        foreach (MonitorTarget* target, targets)
+            if (target->socket == socket)
+                found = target;
+
+        if (cmd == "ADD" && socket && !found) {
+            MonitorTarget *target = new MonitorTarget(socket, mlist.popstr());
+            targets.append(target);
+            if (started)
+                start(target);
+        }
+        else
+        if (cmd == "REMOVE" && found) {
+            stop(found);
+            targets.removeAll(found);
+            delete found;
+        }
+        pipe->signal(socket ? 0 : 1);
+    }
+    else
+    if (cmd == "MODE")
+    {
+        QString name = mlist.popstr();
+        if (name == "BINARY")
+            mode = MONITOR_BINARY;
+        else
+        if (name == "QUIET")
+            mode = MONITOR_QUIET;
+        else
+            mode = MONITOR_STRING;
+        pipe->signal(0);
+    }
+    else
+    if (cmd == "STATS")
+        sendStats();
+    else
+    if (cmd == "ROLLUP")
+    {
+        rollup = qMax(mlist.popstr().toInt(), 0);
+        rollup_at = clock_mono() + rollup;
+        pipe->signal(0);
+    }
+    else
     if (cmd == "VERBOSE")
         verbose = true;
     else
@@ -275,9 +409,91 @@ int MonitorHandler::handlePipe()
     return 0;
 }
 
-void MonitorHandler::handleSink()
+#if defined (ZMQ_EVENT_ALL)
+static QString s_event_name(int event)
+{
+    switch (event) {
+        case ZMQ_EVENT_ACCEPTED:
+            return "ACCEPTED";
+        case ZMQ_EVENT_ACCEPT_FAILED:
+            return "ACCEPT_FAILED";
+        case ZMQ_EVENT_BIND_FAILED:
+            return "BIND_FAILED";
+        case ZMQ_EVENT_CLOSED:
+            return "CLOSED";
+        case ZMQ_EVENT_CLOSE_FAILED:
+            return "CLOSE_FAILED";
+        case ZMQ_EVENT_DISCONNECTED:
+            return "DISCONNECTED";
+        case ZMQ_EVENT_CONNECTED:
+            return "CONNECTED";
+        case ZMQ_EVENT_CONNECT_DELAYED:
+            return "CONNECT_DELAYED";
+        case ZMQ_EVENT_CONNECT_RETRIED:
+            return "CONNECT_RETRIED";
+        case ZMQ_EVENT_LISTENING:
+            return "LISTENING";
+#if (ZMQ_VERSION_MAJOR == 4)
+        case ZMQ_EVENT_MONITOR_STOPPED:
+            return "MONITOR_STOPPED";
+#endif
+#if defined (ZMQ_EVENT_HANDSHAKE_FAILED_NO_DETAIL)
+        case ZMQ_EVENT_HANDSHAKE_FAILED_NO_DETAIL:
+        case ZMQ_EVENT_HANDSHAKE_FAILED_PROTOCOL:
+        case ZMQ_EVENT_HANDSHAKE_FAILED_AUTH:
+            return "HANDSHAKE_FAILED";
+#endif
+#if defined (ZMQ_EVENT_HANDSHAKE_SUCCEEDED)
+        case ZMQ_EVENT_HANDSHAKE_SUCCEEDED:
+            return "HANDSHAKE_SUCCEEDED";
+#endif
+        default:
+            qCritical("illegal socket monitor event: %d", event);
+            return "UNKNOWN";
+    }
+}
+#endif
+
+//  Count the event against its endpoint
+
+void MonitorHandler::aggregate(MonitorTarget *target, int event, const QString &address)
 {
 #if defined (ZMQ_EVENT_ALL)
+    MonitorEndpoint &endpoint = target->endpoints [address];
+    switch (event) {
+        case ZMQ_EVENT_CONNECTED:
+        case ZMQ_EVENT_ACCEPTED:
+            endpoint.peers++;
+            endpoint.connected++;
+            break;
+        case ZMQ_EVENT_DISCONNECTED:
+            if (endpoint.peers > 0)
+                endpoint.peers--;
+            endpoint.disconnected++;
+            break;
+        case ZMQ_EVENT_CONNECT_RETRIED:
+            endpoint.retried++;
+            break;
+        case ZMQ_EVENT_BIND_FAILED:
+        case ZMQ_EVENT_ACCEPT_FAILED:
+#if defined (ZMQ_EVENT_HANDSHAKE_FAILED_NO_DETAIL)
+        case ZMQ_EVENT_HANDSHAKE_FAILED_NO_DETAIL:
+        case ZMQ_EVENT_HANDSHAKE_FAILED_PROTOCOL:
+        case ZMQ_EVENT_HANDSHAKE_FAILED_AUTH:
+#endif
+            endpoint.failed++;
+            break;
+        default:
+            return;
+    }
+    changed = true;
+#endif
+}
+
+void MonitorHandler::handleSink(MonitorTarget *target)
+{
+#if defined (ZMQ_EVENT_ALL)
+    Socket *sink = target->sink;
 #if (ZMQ_VERSION_MAJOR == 4)
     //  First frame is event number and value
     Frame frame;
@@ -301,58 +517,63 @@ void MonitorHandler::handleSink()
     assert (false);
 #endif
 
-    //  Now map event to text equivalent
-    QString name;
-    switch (event) {
-        case ZMQ_EVENT_ACCEPTED:
-            name = "ACCEPTED";
-            break;
-        case ZMQ_EVENT_ACCEPT_FAILED:
-            name = "ACCEPT_FAILED";
-            break;
-        case ZMQ_EVENT_BIND_FAILED:
-            name = "BIND_FAILED";
-            break;
-        case ZMQ_EVENT_CLOSED:
-            name = "CLOSED";
-            break;
-        case ZMQ_EVENT_CLOSE_FAILED:
-            name = "CLOSE_FAILED";
-            break;
-        case ZMQ_EVENT_DISCONNECTED:
-            name = "DISCONNECTED";
-            break;
-        case ZMQ_EVENT_CONNECTED:
-            name = "CONNECTED";
-            break;
-        case ZMQ_EVENT_CONNECT_DELAYED:
-            name = "CONNECT_DELAYED";
-            break;
-        case ZMQ_EVENT_CONNECT_RETRIED:
-            name = "CONNECT_RETRIED";
-            break;
-        case ZMQ_EVENT_LISTENING:
-            name = "LISTENING";
-            break;
-#if (ZMQ_VERSION_MAJOR == 4)
-        case ZMQ_EVENT_MONITOR_STOPPED:
-            name = "MONITOR_STOPPED";
-            break;
-#endif
-        default:
-            qCritical("illegal socket monitor event: %d", event);
-            name = "UNKNOWN";
-            break;
+    aggregate(target, event, address);
+    if (mode == MONITOR_QUIET)
+        return;
+
+    //  Binary events skip the text mapping altogether
+    if (mode == MONITOR_BINARY) {
+        pipe->bsend("24ss", event, value, target->name.toLatin1().data(),
+                    address.toLatin1().data());
+        return;
     }
+
+    //  Now map event to text equivalent
+    QString name = s_event_name(event);
     if (verbose)
         qDebug("qmonitor: %s - %s", name.toLocal8Bit().data(), address.toLocal8Bit().data());
 
     pipe->sendstr(name, true);
     pipe->sendstr(QString::number(value), true);
-    pipe->sendstr(address);
+    if (target->name.isEmpty())
+        pipe->sendstr(address);
+    else {
+        pipe->sendstr(address, true);
+        pipe->sendstr(target->name);
+    }
 #endif
 }
 
+void MonitorHandler::sendStats()
+{
+    Messages msg;
+    msg.append(QString("STATS"));
+    foreach (MonitorTarget* target, targets) {
+        QMap<QString, MonitorEndpoint>::const_iterator it;
+        for (it = target->endpoints.constBegin(); it != target->endpoints.constEnd(); ++it) {
+            msg.append(target->name);
+            msg.append(it.key());
+            msg.append("%d", it->peers);
+            msg.append("%d", it->connected);
+            msg.append("%d", it->disconnected);
+            msg.append("%d", it->retried);
+            msg.append("%d", it->failed);
+        }
+    }
+    msg.send(*pipe);
+    changed = false;
+}
+
+//  Time to wait in poll before next rollup is due
+
+int MonitorHandler::timeout()
+{
+    if (!rollup)
+        return -1;
+    qint64 wait = rollup_at - clock_mono();
+    return wait < 0 ? 0 : int(wait);
+}
+
 void qmonitor(Socket* pipe, void* sock)
 {
     MonitorHandler self(pipe, static_cast<Socket*>(sock));
@@ -360,15 +581,26 @@ void qmonitor(Socket* pipe, void* sock)
     pipe->signal(0);
 
     while (!self.terminated) {
-        SocketBase *which = self.poller.wait(-1);
+        SocketBase *which = self.poller.wait(self.timeout());
         if (which == pipe)
             self.handlePipe();
         else
-        if (which == self.sink)
-            self.handleSink();
-        else
         if (self.poller.terminated())
             break;          //  Interrupted
+        else
+        if (which) {
+            foreach (MonitorTarget* target, self.targets)
+                if (which == target->sink) {
+                    self.handleSink(target);
+                    break;
+                }
+        }
+
+        if (self.rollup && clock_mono() >= self.rollup_at) {
+            if (self.changed)
+                self.sendStats();
+            self.rollup_at = clock_mono() + self.rollup;
+        }
     }
 }
 
@@ -434,6 +666,59 @@ void monitorTest(bool verbose)
     delete servermon;
     delete client;
     delete server;
+
+    //  One actor for two sockets, binary events and counters
+    ActorSocket *monitor = new ActorSocket(qmonitor, NULL, srnet);
+    assert (monitor);
+    Socket *listener = Socket::createRouter();
+    Socket *dialer = Socket::createDealer();
+    monitor->send("sps", "ADD", listener, "listener");
+    monitor->wait();
+    monitor->send("sps", "ADD", dialer, "dialer");
+    monitor->wait();
+    monitor->sendx("MODE", "BINARY", NULL);
+    monitor->wait();
+    monitor->sendx("LISTEN", "CONNECTED", "ACCEPTED", NULL);
+    monitor->sendx("START", NULL);
+    monitor->wait();
+    zmq_poll (NULL, 0, 10);
+
+    port_nbr = listener->bind("tcp://127.0.0.1:*");
+    assert (port_nbr != -1);
+    dialer->connect("tcp://127.0.0.1:%d", port_nbr);
+    int event_nbr;
+    for (event_nbr = 0; event_nbr < 2; event_nbr++) {
+        uint16_t event;
+        uint32_t value;
+        char *name, *address;
+        int rc = monitor->brecv("24ss", &event, &value, &name, &address);
+        assert (rc == 0);
+        if (event == ZMQ_EVENT_CONNECTED)
+            assert (streq (name, "dialer"));
+        else
+            assert (event == ZMQ_EVENT_ACCEPTED && streq (name, "listener"));
+    }
+
+    monitor->sendx("STATS", NULL);
+    Messages stats;
+    stats.recv(*monitor);
+    assert (stats.popstr() == "STATS");
+    assert (stats.size() == 14);
+    int peers = 0;
+    while (stats.size()) {
+        stats.popstr();
+        stats.popstr();
+        peers += stats.popstr().toInt();
+        delete stats.pop();
+        delete stats.pop();
+        delete stats.pop();
+        delete stats.pop();
+    }
+    assert (peers == 2);
+
+    delete monitor;
+    delete listener;
+    delete dialer;
 #endif
     //  @end
     printf ("OK\n");
@@ -3,6 +3,9 @@
 
 #include "socket.h"
 
+class QIODevice;
+class Messages;
+
 /// this function run in different thread
 /// must send an signal in initialization
 /// you must terminate function with $TERM command
@@ -25,7 +28,9 @@ private:
 
 
 /// Monitor handler
-/// see sample for using monitors
+/// see sample for using monitors; sock may be NULL, more sockets are
+/// added with send("sps", "ADD", socket, name), see actor.cpp for MODE,
+/// STATS and ROLLUP
 extern "C" QMQ_EXPORT void qmonitor(Socket* pipe, void* sock);
 extern "C" QMQ_EXPORT void monitorTest(bool verbose=false);
 
@@ -38,4 +43,18 @@ extern "C" QMQ_EXPORT void qproxy(Socket* pipe, void*);
 extern "C" QMQ_EXPORT void qforwarder(Socket *pipe, void *);
 extern "C" QMQ_EXPORT void proxyTest(bool verbose=false);
 
+/// Replay handler
+/// sends a journal recorded with qreplayRecord into a socket, at original
+/// timing, scaled by SPEED or as fast as possible (SPEED 0)
+/// stamp is record time in msecs, -1 uses monotonic clock
+QMQ_EXPORT int qreplayRecord(QIODevice* journal, Messages& msg, qint64 stamp = -1);
+extern "C" QMQ_EXPORT void qreplay(Socket* pipe, void*);
+extern "C" QMQ_EXPORT void replayTest(bool verbose=false);
+
+/// Stats handler
+/// publishes the stats of all instrumented sockets of its context (args,
+/// or the pipe context when NULL) on a PUB socket, see stats.cpp
+extern "C" QMQ_EXPORT void qstats(Socket* pipe, void* args);
+extern "C" QMQ_EXPORT void statsTest(bool verbose=false);
+
 #endif // ACTOR_H
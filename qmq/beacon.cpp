@@ -4,11 +4,83 @@
 #undef max
 
 #include <QTime>
-
-#include <QUdpSocket>
+#include <QHash>
 #include <QHostAddress>
 #include <QNetworkInterface>
 
+#if defined (Q_OS_WIN)
+#   include <ws2tcpip.h>
+typedef SOCKET beacon_socket_t;
+#else
+typedef int beacon_socket_t;
+#   define INVALID_SOCKET   -1
+#   define closesocket      close
+#endif
+
+//  On Linux we read and write datagrams in batches, one system call
+//  for up to BEACON_BATCH datagrams
+#if defined (Q_OS_LINUX)
+#   define BEACON_MMSG
+#endif
+
+#define BEACON_MAX          255     //  Largest beacon we send or accept
+#define BEACON_BATCH        32      //  Datagrams read per wakeup
+#define BEACON_TARGETS      8       //  Broadcast address or joined groups
+
+//  Fill a socket address from host address and port, returns its length
+
+static socklen_t
+s_sockaddr (const QHostAddress& host, int port, uint scope, struct sockaddr_storage *addr)
+{
+    memset (addr, 0, sizeof (struct sockaddr_storage));
+    if (host.protocol() == QAbstractSocket::IPv6Protocol) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) addr;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons (port);
+        Q_IPV6ADDR ip6 = host.toIPv6Address();
+        memcpy (&in6->sin6_addr, ip6.c, 16);
+        in6->sin6_scope_id = scope;
+        return sizeof (struct sockaddr_in6);
+    }
+    struct sockaddr_in *in = (struct sockaddr_in *) addr;
+    in->sin_family = AF_INET;
+    in->sin_port = htons (port);
+    in->sin_addr.s_addr = htonl (host.toIPv4Address());
+    return sizeof (struct sockaddr_in);
+}
+
+static void
+s_set_nonblock (beacon_socket_t sock)
+{
+#if defined (Q_OS_WIN)
+    u_long nonblock = 1;
+    ioctlsocket (sock, FIONBIO, &nonblock);
+#else
+    fcntl (sock, F_SETFL, fcntl (sock, F_GETFL, 0) | O_NONBLOCK);
+#endif
+}
+
+class BeaconTarget {
+public:
+    struct sockaddr_storage addr;   //  Where beacons are sent
+    socklen_t addrlen;              //  Length of addr
+};
+
+//  Peer table entry. Each beacon sends from its own ephemeral port, so
+//  peers are keyed by "address/port" and keep their key when they change
+//  their beacon. Entries stay in a list ordered by last beacon heard, so
+//  expiry only looks at the oldest
+
+class BeaconPeer {
+public:
+    QByteArray key;             //  Address and source port, table key
+    QByteArray address;         //  Peer address
+    QByteArray payload;         //  Last beacon received from peer
+    qint64 expires_at;          //  Peer expires unless heard again
+    BeaconPeer *prev;           //  Heard before us
+    BeaconPeer *next;           //  Heard after us
+};
+
 class BeaconHandler {
 public:
     BeaconHandler(Socket* pip) {
@@ -17,99 +89,290 @@ public:
         verbose = false;
         transmit = 0;
         filter = 0;
+        udpsock = INVALID_SOCKET;
+        sendsock = INVALID_SOCKET;
+        family = AF_INET;
+        port_nbr = 0;
+        ifindex = 0;
+        ntargets = 0;
+        peer_ttl = 0;
+        oldest = newest = 0;
+
+#if defined (BEACON_MMSG)
+        //  Receive vectors point to our buffers once and for all
+        memset (rcvmsgs, 0, sizeof (rcvmsgs));
+        int msg_nbr;
+        for (msg_nbr = 0; msg_nbr < BEACON_BATCH; msg_nbr++) {
+            rcviov [msg_nbr].iov_base = buffers [msg_nbr];
+            rcviov [msg_nbr].iov_len = BEACON_MAX + 1;
+            rcvmsgs [msg_nbr].msg_hdr.msg_iov = &rcviov [msg_nbr];
+            rcvmsgs [msg_nbr].msg_hdr.msg_iovlen = 1;
+            rcvmsgs [msg_nbr].msg_hdr.msg_name = &peers [msg_nbr];
+        }
+#endif
     }
 
     ~BeaconHandler() {
         delete transmit;
         delete filter;
-        udpsock.close();
+        clearPeers();
+        closeUdp();
     }
 
-    void prepareUdp(const QString &iface);
+    void closeUdp();
+    int prepareUdp(const QString &iface);
+    int joinGroup(const QHostAddress& group);
     void configureUdp(const QString &iface, int port);
+    void sendBeacon();
 
     int handlePipe();
     int handleUdp();
-
-    Socket *pipe;              //  Actor command pipe
-    QUdpSocket udpsock;         //  UDP socket for send/recv
+    void accept(const struct sockaddr_storage *peer, socklen_t peerlen,
+                const byte *data, int size);
+
+    void trackPeer(const char *peername, const char *portname,
+                   const byte *data, int size);
+    void sendEvent(const char *event, BeaconPeer *peer);
+    void expirePeers();
+    void sendPeers();
+    void clearPeers();
+    void unlinkPeer(BeaconPeer *peer);
+    void appendPeer(BeaconPeer *peer);
+
+    Socket *pipe;               //  Actor command pipe
+    beacon_socket_t udpsock;    //  Non-blocking UDP socket, receives
+    beacon_socket_t sendsock;   //  Non-blocking UDP socket, sends
+    int family;                 //  AF_INET or AF_INET6
     int port_nbr;               //  UDP port number we work on
     int interval;               //  Beacon broadcast interval
     qint64 ping_at;             //  Next broadcast time
-    Frame* transmit;          //  Beacon transmit data
-    Frame* filter;            //  Beacon filter data
-    QHostAddress broadcast;     //  Our broadcast address
+    Frame* transmit;            //  Beacon transmit data
+    Frame* filter;              //  Beacon filter data
+    QString iface_name;         //  Interface asked for, empty = first
+    QHostAddress iface_address; //  Address of interface we work on
+    uint ifindex;               //  Index of interface, for IPv6 scopes
+    QList<QHostAddress> groups; //  Multicast groups, empty = broadcast
+    BeaconTarget targets [BEACON_TARGETS];
+    int ntargets;               //  Number of targets we send to
     bool terminated;            //  Did caller ask us to quit?
     bool verbose;               //  Verbose logging enabled?
     QString hostname;           //  Saved host name
+
+    int peer_ttl;               //  Peer expiry, msecs, 0 = no peer table
+    QHash<QByteArray, BeaconPeer*> peer_table;
+    BeaconPeer *oldest;         //  Peer to expire first
+    BeaconPeer *newest;         //  Peer heard last
+
+    byte buffers [BEACON_BATCH][BEACON_MAX + 1];
+#if defined (BEACON_MMSG)
+    struct mmsghdr rcvmsgs [BEACON_BATCH];
+    struct iovec rcviov [BEACON_BATCH];
+    struct sockaddr_storage peers [BEACON_BATCH];
+#endif
 };
 
-void BeaconHandler::prepareUdp(const QString& iface)
+void BeaconHandler::closeUdp()
+{
+    if (udpsock != INVALID_SOCKET)
+        closesocket (udpsock);
+    if (sendsock != INVALID_SOCKET)
+        closesocket (sendsock);
+    udpsock = INVALID_SOCKET;
+    sendsock = INVALID_SOCKET;
+    ntargets = 0;
+}
+
+int BeaconHandler::prepareUdp(const QString& iface)
 {
-    udpsock.abort();
+    closeUdp();
 
     hostname = "";
     //  Get the network interface from iface or else use first
-    //  broadcast interface defined on system. iface=* means
-    //  use INADDR_ANY + INADDR_BROADCAST.
-
-    uint64_t bind_to = 0;
-    uint64_t send_to = 0;
+    //  broadcast (or multicast, when we have groups) interface
+    //  defined on system. iface=* means use INADDR_ANY + INADDR_BROADCAST.
+    family = !groups.isEmpty()
+            && groups.first().protocol() == QAbstractSocket::IPv6Protocol ? AF_INET6 : AF_INET;
+    QAbstractSocket::NetworkLayerProtocol protocol = family == AF_INET6 ?
+                QAbstractSocket::IPv6Protocol : QAbstractSocket::IPv4Protocol;
+
+    QHostAddress broadcast;
     if(iface == "*")
     {
-        bind_to = INADDR_ANY;
-        send_to = INADDR_BROADCAST;
+        iface_address = family == AF_INET6 ?
+                    QHostAddress(QHostAddress::AnyIPv6) : QHostAddress((quint32) INADDR_ANY);
+        broadcast = QHostAddress(QHostAddress::Broadcast);
+        ifindex = 0;
+        hostname = iface_address.toString();
     }
     else
     {
-       QList<QNetworkInterface> ifaces = QNetworkInterface::allInterfaces();
-       foreach (QNetworkInterface nf, ifaces) {
-           if(nf.name() == iface || iface.isNull() || iface.isEmpty())
-           {
-               if(nf.flags() & QNetworkInterface::CanBroadcast)
-               {
-                   foreach (QNetworkAddressEntry na, nf.addressEntries()) {
-                       if(na.broadcast().toString() != "") {
-                           send_to = na.broadcast().toIPv4Address();
-                           bind_to = na.ip().toIPv4Address();
-                           hostname = na.ip().toString();
-                           if (verbose)
-                               qDebug("qbeacon: using address=%s broadcast=%s",
-                                          na.ip().toString().toLocal8Bit().data(), na.broadcast().toString().toLocal8Bit().data());
-                           break;
-                       }
-                   }
-               }
-           }
-           if(hostname != "") break;
-       }
-    }
-
-    if(bind_to || send_to)
-    {
-        broadcast.setAddress(send_to);
-#ifdef Q_OS_WIN
-        QHostAddress address(bind_to);
-#elif defined(Q_OS_LINUX)
-        QHostAddress address(send_to); // dont work on centos Qt 4.7
+        QList<QNetworkInterface> ifaces = QNetworkInterface::allInterfaces();
+        foreach (QNetworkInterface nf, ifaces) {
+            if(!iface.isEmpty() && nf.name() != iface)
+                continue;
+            if(!(nf.flags() & QNetworkInterface::IsUp))
+                continue;
+            if(!(nf.flags() & (groups.isEmpty() ? QNetworkInterface::CanBroadcast
+                                                 : QNetworkInterface::CanMulticast)))
+                continue;
+
+            foreach (QNetworkAddressEntry na, nf.addressEntries()) {
+                if(na.ip().protocol() != protocol)
+                    continue;
+                if(groups.isEmpty() && na.broadcast().isNull())
+                    continue;
+
+                iface_address = na.ip();
+                broadcast = na.broadcast();
+                ifindex = nf.index();
+                hostname = na.ip().toString();
+                if (verbose)
+                    qDebug("qbeacon: using address=%s broadcast=%s",
+                           na.ip().toString().toLocal8Bit().data(),
+                           na.broadcast().toString().toLocal8Bit().data());
+                break;
+            }
+            if(hostname != "") break;
+        }
+    }
+
+    if(hostname == "")
+        return -1;
+
+    udpsock = socket (family, SOCK_DGRAM, IPPROTO_UDP);
+    if (udpsock == INVALID_SOCKET) {
+        srnet->handleError("socket");
+        return -1;
+    }
+
+    //  Several beacons can share a port on one host
+    int on = 1;
+    setsockopt (udpsock, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof (on));
+#if defined (SO_REUSEPORT)
+    setsockopt (udpsock, SOL_SOCKET, SO_REUSEPORT, (char *) &on, sizeof (on));
 #endif
+    s_set_nonblock (udpsock);
+
+    //  Bind to the wildcard address: on Linux a socket bound to the
+    //  interface address doesn't get broadcasts, and one bound to the
+    //  broadcast address can't send
+    struct sockaddr_storage bind_to;
+    socklen_t bind_len = s_sockaddr (family == AF_INET6 ?
+                                         QHostAddress(QHostAddress::AnyIPv6) : QHostAddress((quint32) INADDR_ANY),
+                                     port_nbr, 0, &bind_to);
+    if (bind (udpsock, (struct sockaddr *) &bind_to, bind_len)) {
+        srnet->handleError("bind");
+        closeUdp();
+        return -1;
+    }
 
-        if(!udpsock.bind(address, port_nbr, QUdpSocket::ShareAddress
-                         | QUdpSocket::ReuseAddressHint))
-            qFatal("bind udp");
+    //  We send from a socket of our own, its ephemeral port tells our
+    //  beacons apart from others on this host, which share port_nbr
+    sendsock = socket (family, SOCK_DGRAM, IPPROTO_UDP);
+    if (sendsock == INVALID_SOCKET) {
+        srnet->handleError("socket");
+        closeUdp();
+        return -1;
+    }
+    if (family == AF_INET)
+        setsockopt (sendsock, SOL_SOCKET, SO_BROADCAST, (char *) &on, sizeof (on));
+    s_set_nonblock (sendsock);
 
-        if(verbose)
-            qDebug() << "qbeacon: configured, hostname=" << hostname;
+    if (groups.isEmpty()) {
+        targets [0].addrlen = s_sockaddr (broadcast, port_nbr, 0, &targets [0].addr);
+        ntargets = 1;
     }
+    else {
+        foreach (QHostAddress group, groups)
+            joinGroup(group);
+    }
+
+    if(verbose)
+        qDebug() << "qbeacon: configured, hostname=" << hostname;
+    return 0;
+}
+
+//  Join multicast group on our interface and send beacons to it too
+
+int BeaconHandler::joinGroup(const QHostAddress &group)
+{
+    if (udpsock == INVALID_SOCKET || ntargets >= BEACON_TARGETS)
+        return -1;
+
+    int on = 1;
+    int rc = -1;
+    if (family == AF_INET6 && group.protocol() == QAbstractSocket::IPv6Protocol) {
+        struct ipv6_mreq mreq;
+        Q_IPV6ADDR ip6 = group.toIPv6Address();
+        memcpy (&mreq.ipv6mr_multiaddr, ip6.c, 16);
+        mreq.ipv6mr_interface = ifindex;
+        rc = setsockopt (udpsock, IPPROTO_IPV6, IPV6_JOIN_GROUP, (char *) &mreq, sizeof (mreq));
+        setsockopt (sendsock, IPPROTO_IPV6, IPV6_MULTICAST_IF, (char *) &ifindex, sizeof (ifindex));
+        setsockopt (sendsock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, (char *) &on, sizeof (on));
+    }
+    else
+    if (family == AF_INET && group.protocol() == QAbstractSocket::IPv4Protocol) {
+        struct ip_mreq mreq;
+        mreq.imr_multiaddr.s_addr = htonl (group.toIPv4Address());
+        mreq.imr_interface.s_addr = htonl (iface_address.toIPv4Address());
+        rc = setsockopt (udpsock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char *) &mreq, sizeof (mreq));
+        setsockopt (sendsock, IPPROTO_IP, IP_MULTICAST_IF, (char *) &mreq.imr_interface, sizeof (mreq.imr_interface));
+        setsockopt (sendsock, IPPROTO_IP, IP_MULTICAST_LOOP, (char *) &on, sizeof (on));
+    }
+    else
+        qWarning("qbeacon: group %s doesn't match beacon address family",
+                 group.toString().toLocal8Bit().data());
+
+    if (rc == 0) {
+        targets [ntargets].addrlen = s_sockaddr (group, port_nbr, ifindex, &targets [ntargets].addr);
+        ntargets++;
+        if (verbose)
+            qDebug("qbeacon: joined group=%s", group.toString().toLocal8Bit().data());
+    }
+    return rc;
 }
 
 void BeaconHandler::configureUdp(const QString& iface, int port)
 {
     port_nbr = port;
+    iface_name = iface;
     prepareUdp(iface);
     pipe->sendstr(hostname);
     if(hostname == "")
-        qFatal("No broadcast interface found");
+        qWarning("qbeacon: no broadcast interface found");
+}
+
+//  Send beacon to every target, in one system call where we can
+
+void BeaconHandler::sendBeacon()
+{
+    int sent = 0;
+#if defined (BEACON_MMSG)
+    struct iovec iov;
+    iov.iov_base = transmit->data();
+    iov.iov_len = transmit->size();
+
+    struct mmsghdr msgs [BEACON_TARGETS];
+    memset (msgs, 0, sizeof (msgs));
+    int target_nbr;
+    for (target_nbr = 0; target_nbr < ntargets; target_nbr++) {
+        msgs [target_nbr].msg_hdr.msg_name = &targets [target_nbr].addr;
+        msgs [target_nbr].msg_hdr.msg_namelen = targets [target_nbr].addrlen;
+        msgs [target_nbr].msg_hdr.msg_iov = &iov;
+        msgs [target_nbr].msg_hdr.msg_iovlen = 1;
+    }
+    sent = sendmmsg (sendsock, msgs, ntargets, 0);
+#else
+    for (sent = 0; sent < ntargets; sent++) {
+        if (sendto (sendsock, (const char *) transmit->constData(), transmit->size(), 0,
+                    (struct sockaddr *) &targets [sent].addr, targets [sent].addrlen) == -1)
+            break;
+    }
+#endif
+    if (sent < ntargets) {
+        srnet->handleError("send");
+        prepareUdp(iface_name);
+    }
 }
 
 int BeaconHandler::handlePipe()
@@ -125,16 +388,30 @@ int BeaconHandler::handlePipe()
         verbose = true;
     else if(command == "CONFIGURE")
     {
+        //  Optional group selects multicast, an IPv6 group selects IPv6
         int port;
-        int rc = pipe->recv("i", &port);
+        QString group;
+        int rc = pipe->recv("is", &port, &group);
         assert(rc == 0);
+        groups.clear();
+        if (!group.isEmpty())
+            groups.append(QHostAddress(group));
         configureUdp("", port);
     }
+    else if(command == "JOIN")
+    {
+        QString group = pipe->recvstr();
+        QHostAddress address(group);
+        if (!groups.contains(address)) {
+            groups.append(address);
+            joinGroup(address);
+        }
+    }
     else if(command == "PUBLISH")
     {
         delete transmit;
         pipe->recv("fi", &transmit, &interval);
-        assert(transmit->size() <= 255);
+        assert(transmit->size() <= BEACON_MAX);
         ping_at = clock_mono();
     }
     else if(command == "SILENCE") {
@@ -142,14 +419,28 @@ int BeaconHandler::handlePipe()
         transmit = 0;
     }
     else if(command == "SUBSCRIBE") {
+        delete filter;
         pipe->recv("f", &filter);
-        assert (filter->size() <= 255);
+        assert (filter->size() <= BEACON_MAX);
     }
     else if(command == "UNSUBSCRIBE")
     {
         delete filter;
         filter = 0;
     }
+    else if(command == "TRACK")
+    {
+        //  Keep a peer table and send only JOIN/UPDATE/EXPIRE events of
+        //  event, address, key, payload; the key is "address/port" of the
+        //  sender. ttl 0 switches table off and delivers every beacon again
+        int ttl;
+        pipe->recv("i", &ttl);
+        peer_ttl = ttl > 0 ? ttl : 0;
+        if (!peer_ttl)
+            clearPeers();
+    }
+    else if(command == "PEERS")
+        sendPeers();
     else if(command == "$TERM") {
         terminated = true;
     }
@@ -160,47 +451,182 @@ int BeaconHandler::handlePipe()
     return 0;
 }
 
-int BeaconHandler::handleUdp()
+//  Check one received datagram against filter and our own beacon,
+//  and pass it on to the API
+
+void BeaconHandler::accept(const struct sockaddr_storage *peer, socklen_t peerlen,
+                           const byte *data, int size)
 {
-    if(!udpsock.hasPendingDatagrams()) return -1;
-    char data[1024];
-    QHostAddress peerAddress;
+    if (size > BEACON_MAX || !filter)
+        return;                 //  Truncated, or nobody listening
 
-    int rsize = udpsock.readDatagram(data, 1024, &peerAddress);
-    if(rsize <= 0) return -1;
+    int filter_size = filter->size();
+    if (size < filter_size
+    ||  memcmp (data, filter->constData(), filter_size) != 0)
+        return;
 
-    Frame frame(data, rsize);
+    //  Discard our own broadcasts, which UDP echoes to us
+    if (transmit
+    &&  size == transmit->size()
+    &&  memcmp (data, transmit->constData(), size) == 0)
+        return;
 
-    bool is_valid = false;
+    char peername [NI_MAXHOST];
+    char portname [NI_MAXSERV];
+    if (getnameinfo ((const struct sockaddr *) peer, peerlen,
+                     peername, NI_MAXHOST, portname, NI_MAXSERV,
+                     NI_NUMERICHOST | NI_NUMERICSERV))
+        return;
 
-    if(filter)
-    {
-        const void *filter_data = filter->constData();
-        int filter_size = filter->size();
-        if (frame.size() >= filter_size
-        && memcmp(frame.constData(), filter_data, filter_size) == 0)
-            is_valid = true;
+    if (peer_ttl)
+        trackPeer(peername, portname, data, size);
+    else {
+        pipe->sendmem(peername, strlen (peername), QFRAME_MORE);
+        pipe->sendmem(data, size, 0);
     }
+}
 
-    //  If valid, discard our own broadcasts, which UDP echoes to us
-    if(is_valid && transmit)
-    {
-        const void *transmit_data = transmit->constData();
-        int transmit_size = transmit->size();
-        if (frame.size() == transmit_size
-        && memcmp (frame.constData(), transmit_data, transmit_size) == 0)
-            is_valid = false;
+//  Update peer table with one beacon, and tell the API if the peer is
+//  new or changed its beacon. Repeated beacons only refresh expiry.
+
+void BeaconHandler::trackPeer(const char *peername, const char *portname,
+                              const byte *data, int size)
+{
+    //  Lookup keys point to our buffers, we copy only for new peers
+    char keyname [NI_MAXHOST + NI_MAXSERV + 1];
+    int keysize = snprintf (keyname, sizeof (keyname), "%s/%s", peername, portname);
+    QByteArray key = QByteArray::fromRawData(keyname, keysize);
+
+    const char *event = NULL;
+    BeaconPeer *peer = peer_table.value(key, 0);
+    if (!peer) {
+        peer = new BeaconPeer;
+        peer->key = QByteArray(keyname, keysize);
+        peer->address = QByteArray(peername);
+        peer_table.insert(peer->key, peer);
+        event = "JOIN";
     }
+    else {
+        unlinkPeer(peer);
+        if (peer->payload.size() != size
+        ||  memcmp (peer->payload.constData(), data, size) != 0)
+            event = "UPDATE";
+    }
+    if (event)
+        peer->payload = QByteArray((const char *) data, size);
+    peer->expires_at = clock_mono() + peer_ttl;
+    appendPeer(peer);
+
+    if (event)
+        sendEvent(event, peer);
+}
 
-    //  If still a valid beacon, send on to the API
-    if (is_valid) {
-        Messages msg;
-        msg.append(peerAddress.toString());
-        msg.append(frame);
-        msg.send(*pipe);
+void BeaconHandler::sendEvent(const char *event, BeaconPeer *peer)
+{
+    if (verbose)
+        qDebug("qbeacon: %s peer=%s", event, peer->key.constData());
+
+    pipe->sendmem(event, strlen (event), QFRAME_MORE);
+    pipe->sendmem(peer->address.constData(), peer->address.size(), QFRAME_MORE);
+    pipe->sendmem(peer->key.constData(), peer->key.size(), QFRAME_MORE);
+    pipe->sendmem(peer->payload.constData(), peer->payload.size(), 0);
+}
+
+void BeaconHandler::expirePeers()
+{
+    qint64 now = clock_mono();
+    while (oldest && oldest->expires_at <= now) {
+        BeaconPeer *peer = oldest;
+        unlinkPeer(peer);
+        peer_table.remove(peer->key);
+        sendEvent("EXPIRE", peer);
+        delete peer;
     }
+}
 
-    return 0;
+//  Reply to PEERS with all live peers, oldest first
+
+void BeaconHandler::sendPeers()
+{
+    Messages reply;
+    reply.append(QString("PEERS"));
+    BeaconPeer *peer;
+    for (peer = oldest; peer; peer = peer->next) {
+        reply.appendmem(peer->address.constData(), peer->address.size());
+        reply.appendmem(peer->key.constData(), peer->key.size());
+        reply.appendmem(peer->payload.constData(), peer->payload.size());
+    }
+    reply.send(*pipe);
+}
+
+void BeaconHandler::clearPeers()
+{
+    qDeleteAll(peer_table);
+    peer_table.clear();
+    oldest = newest = 0;
+}
+
+void BeaconHandler::unlinkPeer(BeaconPeer *peer)
+{
+    if (peer->prev)
+        peer->prev->next = peer->next;
+    else
+        oldest = peer->next;
+    if (peer->next)
+        peer->next->prev = peer->prev;
+    else
+        newest = peer->prev;
+    peer->prev = peer->next = 0;
+}
+
+void BeaconHandler::appendPeer(BeaconPeer *peer)
+{
+    peer->prev = newest;
+    peer->next = 0;
+    if (newest)
+        newest->next = peer;
+    else
+        oldest = peer;
+    newest = peer;
+}
+
+//  Read all datagrams waiting, up to BEACON_BATCH of them
+
+int BeaconHandler::handleUdp()
+{
+#if defined (BEACON_MMSG)
+    int msg_nbr;
+    for (msg_nbr = 0; msg_nbr < BEACON_BATCH; msg_nbr++)
+        rcvmsgs [msg_nbr].msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+
+    int count = recvmmsg (udpsock, rcvmsgs, BEACON_BATCH, MSG_DONTWAIT, NULL);
+    if (count == -1) {
+        srnet->handleError("recvmmsg");
+        return -1;
+    }
+    for (msg_nbr = 0; msg_nbr < count; msg_nbr++) {
+        int size = rcvmsgs [msg_nbr].msg_len;
+        if (rcvmsgs [msg_nbr].msg_hdr.msg_flags & MSG_TRUNC)
+            size = BEACON_MAX + 1;
+        accept(&peers [msg_nbr], rcvmsgs [msg_nbr].msg_hdr.msg_namelen,
+               buffers [msg_nbr], size);
+    }
+    return count;
+#else
+    int count;
+    for (count = 0; count < BEACON_BATCH; count++) {
+        struct sockaddr_storage peer;
+        socklen_t peerlen = sizeof (peer);
+        int size = recvfrom (udpsock, (char *) buffers [0], BEACON_MAX + 1, 0,
+                             (struct sockaddr *) &peer, &peerlen);
+        if (size == -1) {
+            srnet->handleError("recvfrom");
+            break;              //  Nothing more to read
+        }
+        accept(&peer, peerlen, buffers [0], size);
+    }
+    return count;
+#endif
 }
 
 void qbeacon(Socket* pipe, void*)
@@ -210,17 +636,22 @@ void qbeacon(Socket* pipe, void*)
 
     while (!beacon.terminated) {
 
-        int fd = beacon.udpsock.socketDescriptor();
         zmq_pollitem_t pollitems[] = { { pipe->resolve(), 0, ZMQ_POLLIN, 0 },
-                                       { NULL, fd, ZMQ_POLLIN, 0 } };
+                                       { NULL, beacon.udpsock, ZMQ_POLLIN, 0 } };
         long timeout = -1;
         if(beacon.transmit)
         {
             timeout = (long)(beacon.ping_at - clock_mono());
             if(timeout < 0) timeout = 0;
         }
+        if(beacon.oldest)
+        {
+            long expiry = (long)(beacon.oldest->expires_at - clock_mono());
+            if(expiry < 0) expiry = 0;
+            if(timeout == -1 || expiry < timeout) timeout = expiry;
+        }
 
-        int pollset_size = beacon.udpsock.state() != QUdpSocket::UnconnectedState ? 2 : 1;
+        int pollset_size = beacon.udpsock != INVALID_SOCKET ? 2 : 1;
         if(zmq_poll(pollitems, pollset_size, timeout) == -1)
             break; // interupted
 
@@ -228,13 +659,15 @@ void qbeacon(Socket* pipe, void*)
             beacon.handlePipe();
         if(pollitems[1].revents)
             beacon.handleUdp();
+        if(beacon.oldest)
+            beacon.expirePeers();
 
         if(beacon.transmit
+                && beacon.udpsock != INVALID_SOCKET
                 && clock_mono() >= beacon.ping_at)
         {
             //  Send beacon to any listening peers
-            if(beacon.udpsock.writeDatagram(beacon.transmit->bdata(), beacon.broadcast, beacon.port_nbr) == -1)
-                beacon.prepareUdp("");
+            beacon.sendBeacon();
             beacon.ping_at = clock_mono() + beacon.interval;
         }
     }
@@ -256,7 +689,7 @@ void beaconTest(bool verbose)
 
     speaker->send("si", "CONFIGURE", 9999);
     QString hostname = speaker->recvstr();
-    if (hostname.isNull()) {
+    if (hostname.isEmpty()) {
         qDebug("OK (skipping test, no UDP broadcasting)\n");
         delete speaker;
         return;
@@ -290,6 +723,91 @@ void beaconTest(bool verbose)
     srnet->closeSocket(&listener);
     delete speaker;
 
+    //  Test 2 - same over an IPv4 multicast group
+    ActorSocket *mspeaker = new ActorSocket(qbeacon, NULL, srnet);
+    mspeaker->send("sis", "CONFIGURE", 9997, "239.255.77.77");
+    hostname = mspeaker->recvstr();
+    if (!hostname.isEmpty()) {
+        ActorSocket mlistener(qbeacon, NULL);
+        mlistener.send("sis", "CONFIGURE", 9997, "239.255.77.77");
+        hostname = mlistener.recvstr();
+
+        mspeaker->send("sbi", "PUBLISH", announcement, 2, 100);
+        mlistener.send("sb", "SUBSCRIBE", "", 0);
+
+        mlistener.setRcvtimeo(500);
+        ipaddress = mlistener.recvstr();
+        if (!ipaddress.isNull()) {
+            Frame content;
+            content.recv(mlistener);
+            assert (content.size() == 2);
+            mspeaker->sendx("SILENCE", NULL);
+        }
+        srnet->closeSocket(&mlistener);
+    }
+    delete mspeaker;
+
+    //  Test 3 - peer table, repeated beacons give one JOIN
+    ActorSocket *tspeaker = new ActorSocket(qbeacon, NULL, srnet);
+    tspeaker->send("si", "CONFIGURE", 9996);
+    hostname = tspeaker->recvstr();
+    if (!hostname.isEmpty()) {
+        ActorSocket tlistener(qbeacon, NULL);
+        tlistener.send("si", "CONFIGURE", 9996);
+        hostname = tlistener.recvstr();
+        tlistener.send("si", "TRACK", 300);
+        tlistener.send("sb", "SUBSCRIBE", "", 0);
+        tspeaker->send("sbi", "PUBLISH", announcement, 2, 50);
+
+        tlistener.setRcvtimeo(500);
+        QString event = tlistener.recvstr();
+        if (!event.isNull()) {
+            assert (event == "JOIN");
+            QString peer_address = tlistener.recvstr();
+            QString peer_key = tlistener.recvstr();
+            assert (peer_key.startsWith(peer_address + "/"));
+            Frame content;
+            content.recv(tlistener);
+            assert (content.size() == 2);
+
+            //  Next beacons are the same, nothing more arrives
+            tlistener.setRcvtimeo(200);
+            event = tlistener.recvstr();
+            assert (event.isNull());
+
+            //  A changed beacon is an UPDATE under the same key
+            byte changed [2] = { 0xCA, 0xFF };
+            tspeaker->send("sbi", "PUBLISH", changed, 2, 50);
+            tlistener.setRcvtimeo(500);
+            event = tlistener.recvstr();
+            assert (event == "UPDATE");
+            assert (tlistener.recvstr() == peer_address);
+            assert (tlistener.recvstr() == peer_key);
+            content.recv(tlistener);
+            assert (content.size() == 2);
+            assert (uchar(content.bdata().at(1)) == 0xFF);
+
+            tlistener.sendx("PEERS", NULL);
+            Messages peers;
+            peers.recv(tlistener);
+            assert (peers.size() == 4);
+            assert (peers.popstr() == "PEERS");
+            assert (peers.popstr() == peer_address);
+            assert (peers.popstr() == peer_key);
+
+            //  Silent peer expires after ttl
+            tspeaker->sendx("SILENCE", NULL);
+            tlistener.setRcvtimeo(1000);
+            event = tlistener.recvstr();
+            assert (event == "EXPIRE");
+            assert (tlistener.recvstr() == peer_address);
+            assert (tlistener.recvstr() == peer_key);
+            tlistener.flush();
+        }
+        srnet->closeSocket(&tlistener);
+    }
+    delete tspeaker;
+
     //  Test subscription filter using a 3-node setup
     ActorSocket node1(qbeacon, NULL, srnet);
     node1.send("si", "CONFIGURE", 5670);
@@ -1,5 +1,9 @@
 #include "context_p.hpp"
+#include "socket_p.hpp"
 #include <qthread.h>
+#include <QFile>
+#include <QStringList>
+#include <QAtomicInt>
 
 void ContextPrivate::initialize_underlying()
 {
@@ -38,12 +42,15 @@ Context::~Context()
 Context::Context(ContextPrivate &d, QObject *parent): d_ptr(&d) , QObject(parent)
 {}
 
-void Context::setIoThreads(int iothreads)
+int Context::setIoThreads(int iothreads)
 {
     Q_D(Context);
     d->mutex.lock();
-    d->s_io_threads = iothreads;
+    int rc = d->context ? -1 : 0;
+    if (rc == 0)
+        d->s_io_threads = iothreads;
     d->mutex.unlock();
+    return rc;
 }
 
 void Context::setLinger(int linger)
@@ -108,6 +115,13 @@ Socket *Context::createSocket(int type)
     return zocket;
 }
 
+Socket *Context::createSocket(int type, const QString &endpoints, const QString &tag)
+{
+    Q_UNUSED(endpoints);
+    Q_UNUSED(tag);
+    return createSocket(type);
+}
+
 Socket *Context::createPipe()
 {
     Q_D(Context);
@@ -175,6 +189,20 @@ int Context::closeSocket(SocketBase *zocket)
     return rc;
 }
 
+QList<SocketStats> Context::socketStats()
+{
+    Q_D(Context);
+    QList<SocketStats> list;
+    d->mutex.lock();
+    foreach (SocketBase* so, d->sockets) {
+        SocketStats* stats = so->d_func()->stats;
+        if (stats)
+            list.append(stats->snapshot());
+    }
+    d->mutex.unlock();
+    return list;
+}
+
 void Context::test()
 {
     printf (" * ctx (deprecated): ");
@@ -242,12 +270,16 @@ QMNet* QMNet::m_instance = 0;
 
 QMNet::QMNet(QObject* parent) : Context(*(new QMNetPrivate), parent)
 {
-    m_instance = this;
+    //  First context is the default one, others are reached by placement
+    if (!m_instance)
+        m_instance = this;
 }
 
 QMNet::~QMNet()
 {
     shutdown();
+    if (m_instance == this)
+        m_instance = 0;
 }
 
 QMNet *QMNet::instance()
@@ -264,30 +296,27 @@ void QMNet::init()
     if(d->s_initialized)
         return;
 
-    //  Pull process defaults from environment
-    if (getenv ("QMN_IO_THREADS"))
-        d->s_io_threads = atoi (getenv ("QMN_IO_THREADS"));
-
-    if (getenv ("QMN_MAX_SOCKETS"))
-        d->s_max_sockets = atoi (getenv ("QMN_MAX_SOCKETS"));
-
-    if (getenv ("QMN_LINGER"))
-        d->s_linger = atoi (getenv ("QMN_LINGER"));
-
-    if (getenv ("QMN_SNDHWM"))
-        d->s_pipehwm = atoi (getenv ("QMN_SNDHWM"));
-
-    if (getenv ("QMN_RCVHWM"))
-        d->s_pipehwm = atoi (getenv ("QMN_RCVHWM"));
-
-    if (getenv ("QMN_PIPEHWM"))
-        d->s_pipehwm = atoi (getenv ("QMN_PIPEHWM"));
-
-    if (getenv ("QMN_IPV6"))
-        d->s_ipv6 = atoi (getenv ("QMN_IPV6"));
+    //  Pull process defaults from QMN_CONFIG file and environment
+    QString path;
+    if (getenv ("QMN_CONFIG"))
+        path = QString::fromLocal8Bit (getenv ("QMN_CONFIG"));
+
+    //  At startup each good value is applied on its own, after the file
+    //  so the environment wins; bad entries are only reported
+    typedef QPair<QString, int> ConfigValue;
+    QMNetPrivate::ConfigValues values;
+    QString error;
+    if (d->readConfig(path, values, &error) == -1)
+        qWarning("QMNet: %s, skipped", error.toLocal8Bit().data());
+    foreach (const ConfigValue& pair, values) {
+        QMNetPrivate::ConfigValues value;
+        value << pair;
+        if (d->configure(value, &error) == -1)
+            qWarning("QMNet: %s, skipped", error.toLocal8Bit().data());
+    }
+    d->s_config = path;
 
-    d->context = zmq_init(d->s_io_threads);
-    zmq_ctx_set (d->context, ZMQ_MAX_SOCKETS, d->s_max_sockets);
+    d->createContext();
     d->s_initialized = true;
 }
 
@@ -297,7 +326,7 @@ void QMNet::shutdown()
     if(!d->s_initialized) return;
 
     d->mutex.lock();
-    int busy = d->s_open_sockets;
+    int busy = d->sockets.size();
     d->mutex.unlock();
 
     if(busy)
@@ -316,10 +345,21 @@ void QMNet::shutdown()
         delete s;
     }
     d->sockets.clear();
+    d->pipes.clear();
     d->mutex.unlock();
 }
 
 Socket *QMNet::createSocket(int type)
+{
+    return placement(type)->newSocket(type);
+}
+
+Socket *QMNet::createSocket(int type, const QString &endpoints, const QString &tag)
+{
+    return placement(type, endpoints, tag)->newSocket(type);
+}
+
+Socket *QMNet::newSocket(int type)
 {
     Q_D(QMNet);
     init();
@@ -333,13 +373,10 @@ Socket *QMNet::createSocket(int type)
 
     sock->reset(this, type);
 
-    sock->setLinger(d->s_linger);
-    sock->setSndhwm(d->s_sndhwm);
-    sock->setRcvhwm(d->s_rcvhwm);
+    d->applyOptions(sock, false);
     sock->setIpv6(d->s_ipv6);
 
     d->sockets.append(sock);
-    d->s_open_sockets++;
     d->mutex.unlock();
 
     return sock;
@@ -362,7 +399,7 @@ int QMNet::closeSocket(SocketBase *sock)
         return 0;
     }
     int rc = sock->close();
-    d->s_open_sockets -= count;
+    d->pipes.removeAll(sock);
     d->mutex.unlock();
 
     // thread safe deleting QObject
@@ -373,13 +410,17 @@ int QMNet::closeSocket(SocketBase *sock)
 
 std::pair<Socket *, Socket *> QMNet::createPipe()
 {
-    Q_D(QMNet);std::pair<Socket *, Socket *> pair;
+    std::pair<Socket *, Socket *> pair;
 
-    Socket *frontend = createSocket(ZMQ_PAIR);
-    Socket *backend = createSocket(ZMQ_PAIR);
+    //  Both pipe ends go to one context, inproc can't cross contexts
+    QMNet *target = placement(ZMQ_PAIR);
+    QMNetPrivate *d = target->d_func();
+
+    Socket *frontend = target->newSocket(ZMQ_PAIR);
+    Socket *backend = target->newSocket(ZMQ_PAIR);
     if (!frontend || !backend) {
-        closeSocket(frontend);
-        closeSocket(backend);
+        target->closeSocket(frontend);
+        target->closeSocket(backend);
 
         delete frontend;
         delete backend;
@@ -389,8 +430,12 @@ std::pair<Socket *, Socket *> QMNet::createPipe()
         return pair;
     }
 
-    frontend->setSndhwm(d->s_sndhwm);
-    backend->setSndhwm(d->s_sndhwm);
+    d->mutex.lock();
+    d->pipes.append(frontend);
+    d->pipes.append(backend);
+    d->applyOptions(frontend, true);
+    d->applyOptions(backend, true);
+    d->mutex.unlock();
 
     //  Now bind and connect pipe ends
     char endpoint [32];
@@ -411,6 +456,12 @@ std::pair<Socket *, Socket *> QMNet::createPipe()
 }
 
 void QMNet::append(SocketBase *sock, int type)
+{
+    if (sock)
+        placement(type)->addSocket(sock, type);
+}
+
+void QMNet::addSocket(SocketBase *sock, int type)
 {
     Q_D(QMNet);
     if(!sock) {
@@ -421,32 +472,36 @@ void QMNet::append(SocketBase *sock, int type)
     d->mutex.lock();
     sock->reset(this, type);
 
-    int rm = d->sockets.removeAll(sock);
-    d->s_open_sockets -= rm;
+    d->sockets.removeAll(sock);
+    d->pipes.removeAll(sock);
 
-    sock->setLinger(d->s_linger);
-    sock->setSndhwm(d->s_sndhwm);
-    sock->setRcvhwm(d->s_rcvhwm);
+    d->applyOptions(sock, false);
     sock->setIpv6(d->s_ipv6);
 
     d->sockets.append(sock);
-    d->s_open_sockets++;
     d->mutex.unlock();
 }
 
 void QMNet::appendPipe(SocketBase *frontend, SocketBase *backend)
 {
-    Q_D(QMNet);
+    //  Both pipe ends go to one context, inproc can't cross contexts
+    if (frontend && backend)
+        placement(ZMQ_PAIR)->addPipe(frontend, backend);
+}
 
-    if (!frontend || !backend) {
-        return;
-    }
+void QMNet::addPipe(SocketBase *frontend, SocketBase *backend)
+{
+    Q_D(QMNet);
 
-    append(frontend, ZMQ_PAIR);
-    append(backend, ZMQ_PAIR);
+    addSocket(frontend, ZMQ_PAIR);
+    addSocket(backend, ZMQ_PAIR);
 
-    frontend->setSndhwm(d->s_sndhwm);
-    backend->setSndhwm(d->s_sndhwm);
+    d->mutex.lock();
+    d->pipes.append(frontend);
+    d->pipes.append(backend);
+    d->applyOptions(frontend, true);
+    d->applyOptions(backend, true);
+    d->mutex.unlock();
 
     //  Now bind and connect pipe ends
     char endpoint [32];
@@ -517,18 +572,474 @@ QString QMNet::hostName()
     return QString(host->h_name);
 }
 
-void QMNet::setIoThreads(int iothreads)
+int QMNet::setIoThreads(int iothreads)
+{
+    QString error;
+    int rc = configure("io_threads", iothreads, &error);
+    if (rc == -1)
+        qWarning("QMNet: %s", error.toLocal8Bit().data());
+    return rc;
+}
+
+//  Configuration keys, each one can also be set with QMN_<KEY> in the
+//  environment. Startup keys only change while no socket is open, runtime
+//  keys reach open sockets through applyConfig, ipv6 only new sockets.
+
+enum { CONFIG_STARTUP, CONFIG_RUNTIME, CONFIG_NEW_SOCKETS };
+
+//  Bumped on every runtime change, owner loops compare it with theirs
+static QAtomicInt s_config_generation;
+
+static struct {
+    const char *key;
+    int QMNetPrivate::*value;
+    int scope;
+    int minimum;
+} s_config_keys [] = {
+    { "io_threads",  &QMNetPrivate::s_io_threads,  CONFIG_STARTUP,     1 },
+    { "max_sockets", &QMNetPrivate::s_max_sockets, CONFIG_STARTUP,     1 },
+    { "linger",      &QMNetPrivate::s_linger,      CONFIG_RUNTIME,    -1 },
+    { "sndhwm",      &QMNetPrivate::s_sndhwm,      CONFIG_RUNTIME,     0 },
+    { "rcvhwm",      &QMNetPrivate::s_rcvhwm,      CONFIG_RUNTIME,     0 },
+    { "pipehwm",     &QMNetPrivate::s_pipehwm,     CONFIG_RUNTIME,     0 },
+    { "sndbuf",      &QMNetPrivate::s_sndbuf,      CONFIG_RUNTIME,     0 },
+    { "rcvbuf",      &QMNetPrivate::s_rcvbuf,      CONFIG_RUNTIME,     0 },
+    { "ipv6",        &QMNetPrivate::s_ipv6,        CONFIG_NEW_SOCKETS, 0 }
+};
+#define CONFIG_KEYS int(sizeof (s_config_keys) / sizeof (s_config_keys [0]))
+
+static int s_config_index(const QString& key)
+{
+    for (int index = 0; index < CONFIG_KEYS; index++)
+        if (key == s_config_keys [index].key)
+            return index;
+    return -1;
+}
+
+//  Read config file, if path isn't empty, and environment into values.
+//  Returns 0 if OK, -1 if the file can't be read or has bad lines; values
+//  then holds the good entries.
+
+int QMNetPrivate::readConfig(const QString &path, ConfigValues &values, QString *error)
+{
+    QStringList errors;
+    if (!path.isEmpty()) {
+        QFile file(path);
+        if (!file.open(QFile::ReadOnly | QFile::Text))
+            errors << QString("can't read config file '%1'").arg(path);
+
+        int line_nbr = 0;
+        while (file.isOpen() && !file.atEnd()) {
+            QString line = QString::fromLocal8Bit(file.readLine());
+            line_nbr++;
+            line = line.section('#', 0, 0).section(';', 0, 0).trimmed();
+            if (line.isEmpty() || line.startsWith('['))
+                continue;
+
+            bool ok;
+            int value = line.section('=', 1).trimmed().toInt(&ok);
+            if (ok)
+                values << qMakePair(line.section('=', 0, 0).trimmed().toLower(), value);
+            else
+                errors << QString("%1:%2: expected 'key = number'").arg(path).arg(line_nbr);
+        }
+    }
+
+    for (int index = 0; index < CONFIG_KEYS; index++) {
+        QByteArray name = "QMN_" + QByteArray(s_config_keys [index].key).toUpper();
+        if (!getenv (name.data()) || !*getenv (name.data()))
+            continue;           //  Unset or empty
+
+        bool ok;
+        int value = QByteArray(getenv (name.data())).trimmed().toInt(&ok);
+        if (ok)
+            values << qMakePair(QString(s_config_keys [index].key), value);
+        else
+            errors << QString("%1 is not a number").arg(name.data());
+    }
+
+    if (errors.isEmpty())
+        return 0;
+    if (error)
+        *error = errors.join("; ");
+    return -1;
+}
+
+//  Check every value, then apply them all. Nothing changes if any value
+//  is rejected.
+
+int QMNetPrivate::configure(const ConfigValues &values, QString *error)
+{
+    typedef QPair<QString, int> ConfigValue;
+    QStringList errors;
+    QMutexLocker lock(&mutex);
+
+    foreach (const ConfigValue& pair, values) {
+        int index = s_config_index(pair.first);
+        if (index == -1)
+            errors << QString("unknown setting '%1'").arg(pair.first);
+        else
+        if (pair.second < s_config_keys [index].minimum)
+            errors << QString("%1 = %2 is out of range, minimum is %3")
+                      .arg(pair.first).arg(pair.second)
+                      .arg(s_config_keys [index].minimum);
+        else
+        if (s_config_keys [index].scope == CONFIG_STARTUP
+        &&  this->*(s_config_keys [index].value) != pair.second
+        &&  !sockets.isEmpty())
+            errors << QString("%1 is a startup setting, it can't change "
+                              "while %2 sockets are open")
+                      .arg(pair.first).arg(sockets.size());
+    }
+    if (!errors.isEmpty()) {
+        if (error)
+            *error = errors.join("; ");
+        return -1;
+    }
+
+    bool restart = false;
+    foreach (const ConfigValue& pair, values) {
+        int index = s_config_index(pair.first);
+        int &value = this->*(s_config_keys [index].value);
+        if (value == pair.second)
+            continue;
+
+        value = pair.second;
+        if (s_config_keys [index].scope == CONFIG_STARTUP)
+            restart = true;
+        else
+        if (s_config_keys [index].scope == CONFIG_RUNTIME)
+            s_config_generation.ref();
+    }
+
+    //  No socket is open, so the context can be replaced safely
+    if (restart && context)
+        createContext();
+    return 0;
+}
+
+//  Create the 0MQ context from startup settings, replacing the old one.
+//  I/O threads start with the first socket, so affinity set here holds.
+//  zmq_term blocks until every socket of the context is closed, so one
+//  that holds sockets is kept as it is.
+
+void QMNetPrivate::createContext()
+{
+    if (context) {
+        if (!sockets.isEmpty()) {
+            qWarning("QMNet: %d sockets are open, startup settings are "
+                     "not applied", sockets.size());
+            return;
+        }
+        zmq_term(context);
+    }
+    context = zmq_init(s_io_threads);
+    zmq_ctx_set (context, ZMQ_MAX_SOCKETS, s_max_sockets);
+#if defined (ZMQ_THREAD_AFFINITY_CPU_ADD)
+    foreach (int cpu, s_affinity)
+        zmq_ctx_set (context, ZMQ_THREAD_AFFINITY_CPU_ADD, cpu);
+#endif
+}
+
+void QMNetPrivate::applyOptions(SocketBase *sock, bool pipe)
+{
+    sock->setLinger(s_linger);
+    if (pipe) {
+        sock->setSndhwm(s_pipehwm);
+        sock->setRcvhwm(s_pipehwm);
+        return;
+    }
+    sock->setSndhwm(s_sndhwm);
+    sock->setRcvhwm(s_rcvhwm);
+    if (s_sndbuf > 0)
+        sock->setSndbuf(s_sndbuf);
+    if (s_rcvbuf > 0)
+        sock->setRcvbuf(s_rcvbuf);
+}
+
+int QMNet::configure(const QString &key, int value, QString *error)
+{
+    Q_D(QMNet);
+    init();
+    QMNetPrivate::ConfigValues values;
+    values << qMakePair(key, value);
+    return d->configure(values, error);
+}
+
+int QMNet::loadConfig(const QString &path, QString *error)
 {
     Q_D(QMNet);
     init();
+    QMNetPrivate::ConfigValues values;
+    if (d->readConfig(path, values, error) == -1
+    ||  d->configure(values, error) == -1)
+        return -1;
+
+    d->mutex.lock();
+    d->s_config = path;
+    d->mutex.unlock();
+    return 0;
+}
+
+int QMNet::reloadConfig(QString *error)
+{
+    Q_D(QMNet);
+    init();
+    d->mutex.lock();
+    QString path = d->s_config;
+    d->mutex.unlock();
+    return loadConfig(path, error);
+}
+
+int QMNet::applyConfig(SocketBase *sock)
+{
+    Q_D(QMNet);
+    //  Placement may have put the socket in another context
+    QMNet *owner = sock ? dynamic_cast<QMNet*>(sock->context()) : 0;
+    if (owner && owner != this)
+        return owner->applyConfig(sock);
+
+    QMutexLocker lock(&d->mutex);
+    if (!sock || !d->sockets.contains(sock))
+        return -1;
+    d->applyOptions(sock, d->pipes.contains(sock));
+    return 0;
+}
 
+bool QMNet::configChanged(int &generation)
+{
+    int current = s_config_generation;
+    if (current == generation)
+        return false;
+    generation = current;
+    return true;
+}
+
+QMap<QString, int> QMNet::config()
+{
+    Q_D(QMNet);
+    init();
+    QMap<QString, int> values;
     d->mutex.lock();
-    if(d->s_open_sockets > 0)
-        qFatal("setIoThreads is not valid after creating sockets");
-    zmq_term(d->context);
+    for (int index = 0; index < CONFIG_KEYS; index++)
+        values.insert(s_config_keys [index].key,
+                      d->*(s_config_keys [index].value));
+    d->mutex.unlock();
+    return values;
+}
+
+int QMNet::setAffinity(const QList<int> &cpus)
+{
+#if defined (ZMQ_THREAD_AFFINITY_CPU_ADD)
+    Q_D(QMNet);
+    init();
+    QMutexLocker lock(&d->mutex);
+    if (!d->sockets.isEmpty() && cpus != d->s_affinity) {
+        qWarning("QMNet: affinity is a startup setting, it can't change "
+                 "while %d sockets are open", d->sockets.size());
+        return -1;
+    }
+    if (cpus != d->s_affinity) {
+        d->s_affinity = cpus;
+        d->createContext();
+    }
+    return 0;
+#else
+    Q_UNUSED(cpus);
+    qWarning("QMNet: I/O thread affinity needs libzmq 4.3 or later");
+    return -1;
+#endif
+}
+
+QList<int> QMNet::affinity()
+{
+    Q_D(QMNet);
+    QMutexLocker lock(&d->mutex);
+    return d->s_affinity;
+}
 
-    d->s_io_threads = iothreads;
-    d->context = zmq_init(d->s_io_threads);
-    zmq_ctx_set (d->context, ZMQ_MAX_SOCKETS, d->s_max_sockets);
+static void s_place(QList<Placement>& placements, QMutex& mutex,
+                    int type, const QString& endpoint, const QString& tag,
+                    QMNet* context)
+{
+    Placement rule;
+    rule.type = type;
+    rule.endpoint = endpoint;
+    rule.tag = tag;
+    rule.context = context;
+
+    mutex.lock();
+    placements.append(rule);
+    mutex.unlock();
+}
+
+void QMNet::placeType(int type, QMNet *context)
+{
+    Q_D(QMNet);
+    s_place(d->placements, d->mutex, type, QString(), QString(), context);
+}
+
+void QMNet::placeEndpoint(const QString &prefix, QMNet *context)
+{
+    Q_D(QMNet);
+    s_place(d->placements, d->mutex, -1, prefix, QString(), context);
+}
+
+void QMNet::placeTag(const QString &tag, QMNet *context)
+{
+    Q_D(QMNet);
+    s_place(d->placements, d->mutex, -1, QString(), tag, context);
+}
+
+//  True if any of the comma separated endpoints starts with prefix
+
+static bool s_endpoint_matches(const QString& endpoints, const QString& prefix)
+{
+    foreach (QString endpoint, endpoints.split(',', QString::SkipEmptyParts)) {
+        endpoint = endpoint.trimmed();
+        if (endpoint.startsWith('@') || endpoint.startsWith('>'))
+            endpoint.remove(0, 1);
+        if (endpoint.startsWith(prefix))
+            return true;
+    }
+    return false;
+}
+
+QMNet *QMNet::placement(int type, const QString &endpoints, const QString &tag)
+{
+    Q_D(QMNet);
+    QMNet* target = this;
+    int rank = 0;               //  Tag 3, endpoint 2, type 1
+
+    //  Other end of an inproc socket may be another type
+    bool inproc = s_endpoint_matches(endpoints, "inproc://");
+
+    d->mutex.lock();
+    foreach (const Placement& rule, d->placements) {
+        if (!rule.context)
+            continue;           //  Context was destroyed
+        int match = 0;
+        if (!rule.tag.isEmpty())
+            match = (rule.tag == tag) ? 3 : 0;
+        else
+        if (!rule.endpoint.isEmpty())
+            match = s_endpoint_matches(endpoints, rule.endpoint) ? 2 : 0;
+        else
+            match = (rule.type == type && !inproc) ? 1 : 0;
+
+        if (match > rank) {
+            rank = match;
+            target = rule.context;
+        }
+    }
     d->mutex.unlock();
+    return target;
+}
+
+void QMNet::test()
+{
+    printf (" * qmnet config: ");
+
+    //  @selftest
+    QMNet *net = srnet;
+    QMap<QString, int> saved = net->config();
+    assert (saved.contains("sndhwm"));
+    assert (saved.contains("io_threads"));
+
+    QString error;
+    int rc = net->configure("no_such_key", 1, &error);
+    assert (rc == -1);
+    assert (!error.isEmpty());
+
+    //  Runtime settings reach new sockets, and open sockets when their
+    //  owner thread asks for them. Sockets made through the Context
+    //  interface, as actors and brokers do, are counted as open too
+    Context *base = net;
+    Socket *sock = base->createSocket(ZMQ_PUSH);
+    assert (sock);
+    int sndhwm = sock->sndhwm();
+    rc = net->configure("sndhwm", sndhwm + 500);
+    assert (rc == 0);
+    assert (net->config().value("sndhwm") == sndhwm + 500);
+    assert (sock->sndhwm() == sndhwm);
+    rc = net->applyConfig(sock);
+    assert (rc == 0);
+    assert (sock->sndhwm() == sndhwm + 500);
+
+    //  Startup settings are rejected while sockets are open
+    rc = net->configure("io_threads", saved.value("io_threads") + 1, &error);
+    assert (rc == -1);
+    assert (net->config().value("io_threads") == saved.value("io_threads"));
+
+    //  Config file is applied as a whole or not at all
+    QFile file("qmnet.test");
+    file.open(QFile::WriteOnly | QFile::Text);
+    file.write("[qmnet]\nrcvhwm = 700   # retuned\n");
+    file.close();
+    rc = net->loadConfig("qmnet.test", &error);
+    assert (rc == 0);
+    net->applyConfig(sock);
+    assert (sock->rcvhwm() == 700);
+
+    file.open(QFile::WriteOnly | QFile::Text);
+    file.write("rcvhwm = 800\nsndhwm = lots\n");
+    file.close();
+    rc = net->reloadConfig(&error);
+    assert (rc == -1);
+    assert (net->config().value("rcvhwm") == 700);
+
+    net->configure("sndhwm", saved.value("sndhwm"));
+    net->configure("rcvhwm", saved.value("rcvhwm"));
+    delete sock;
+
+    //  At startup a bad line is skipped, good lines and the environment
+    //  still count
+    qputenv("QMN_CONFIG", "qmnet.test");
+    qputenv("QMN_IO_THREADS", "3");
+    {
+        QMNet startup;
+        assert (startup.config().value("io_threads") == 3);
+        assert (startup.config().value("rcvhwm") == 800);
+    }
+    qputenv("QMN_CONFIG", "");
+    qputenv("QMN_IO_THREADS", "");
+    file.remove();
+
+    //  Placement by tag, then endpoint, then socket type
+    QMNet control;
+    QMNet bulk;
+    assert (srnet == net);
+    bulk.setIoThreads(2);
+    control.placeType(ZMQ_PULL, &bulk);
+    control.placeEndpoint("ipc://", &bulk);
+    control.placeTag("control", &control);
+    assert (control.placement(ZMQ_PUSH) == &control);
+    assert (control.placement(ZMQ_PULL) == &bulk);
+    assert (control.placement(ZMQ_PUSH, "@tcp://*:5560,>ipc://bulk") == &bulk);
+    assert (control.placement(ZMQ_PULL, "ipc://bulk", "control") == &control);
+
+    Socket *pull = control.createSocket(ZMQ_PULL);
+    assert (pull);
+    assert (pull->context() == &bulk);
+    assert (bulk.config().value("io_threads") == 2);
+    delete pull;
+
+    //  Rules hold through the Context interface, and both ends of an
+    //  inproc pair stay together whatever their types
+    Context *generic = &control;
+    pull = generic->createSocket(ZMQ_PULL);
+    assert (pull->context() == &bulk);
+    delete pull;
+    pull = generic->createSocket(ZMQ_PULL, "inproc://placed");
+    Socket *push = generic->createSocket(ZMQ_PUSH, "inproc://placed");
+    assert (pull->context() == &control);
+    assert (push->context() == &control);
+    delete push;
+    delete pull;
+    pull = generic->createSocket(ZMQ_PULL, "inproc://placed", "control");
+    assert (pull->context() == &control);
+    delete pull;
+    //  @end
+
+    printf ("OK\n");
 }
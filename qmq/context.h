@@ -2,6 +2,7 @@
 #define CONTEXT_H
 
 #include <QObject>
+#include <QMap>
 
 #ifndef QMQ_EXPORT
 #define QMQ_EXPORT
@@ -9,6 +10,7 @@
 
 class SocketBase;
 class Socket;
+class SocketStats;
 
 class ContextPrivate;
 class QMQ_EXPORT Context : public QObject
@@ -23,7 +25,8 @@ public:
     //  Configure number of I/O threads in context, only has effect if called
     //  before creating first socket, or calling zctx_shadow. Default I/O
     //  threads is 1, sufficient for all except very high volume applications.
-    virtual void setIoThreads(int iothreads);
+    //  Returns 0 if OK, -1 if the context is already running.
+    virtual int setIoThreads(int iothreads);
 
 
     //  --------------------------------------------------------------------------
@@ -56,7 +59,13 @@ public:
     //  The default, no matter the underlying ZeroMQ version, is 1,000.
     void setRcvhwm(int rcvhwm);
 
-    Socket *createSocket(int type);
+    virtual Socket *createSocket(int type);
+
+    //  --------------------------------------------------------------------------
+    //  Create a socket for these endpoints and tag. A plain context ignores
+    //  them, QMNet places the socket by them, see QMNet::placement().
+    virtual Socket *createSocket(int type, const QString& endpoints,
+                                 const QString& tag = QString());
     Socket *createPipe();
     void* desctiptor();
 
@@ -65,6 +74,11 @@ public:
 
     virtual int closeSocket(SocketBase *zocket);
 
+    //  --------------------------------------------------------------------------
+    //  Snapshot of every socket in this context that has stats enabled,
+    //  safe to call from any thread.
+    QList<SocketStats> socketStats();
+
     static void test();
 
 protected:
@@ -90,6 +104,12 @@ public:
     void shutdown();
 
     Socket* createSocket(int type);
+
+    //  --------------------------------------------------------------------------
+    //  Create a socket in the context the placement rules pick for its type,
+    //  endpoints and tag, see placement().
+    Socket* createSocket(int type, const QString& endpoints,
+                         const QString& tag = QString());
     int closeSocket(SocketBase* sock);
     std::pair<Socket*, Socket*> createPipe();
 
@@ -100,12 +120,83 @@ public:
 
     QString hostName();
 
-    //
-    void setIoThreads(int iothreads);
+    //  --------------------------------------------------------------------------
+    //  Configure number of I/O threads, valid until the first socket is
+    //  created. Returns 0 if OK, -1 with a warning if sockets are open.
+    int setIoThreads(int iothreads);
+
+    //  --------------------------------------------------------------------------
+    //  Set one configuration value, keys are the ones config() reports.
+    //  io_threads and max_sockets are startup only and rejected while sockets
+    //  are open. Other values apply to sockets created afterwards; sockets
+    //  are not thread safe, so open ones only pick up linger, sndhwm, rcvhwm,
+    //  pipehwm, sndbuf and rcvbuf when their owner thread calls applyConfig.
+    //  Returns 0 if OK, -1 and the reason in error if the value was rejected.
+    int configure(const QString& key, int value, QString* error = 0);
+
+    //  --------------------------------------------------------------------------
+    //  Apply current runtime settings to an open socket, from the QMNet
+    //  context it lives in. Call it from the thread that owns the socket.
+    //  HWM changes reach existing connections on libzmq 4.2 and later, buffer
+    //  sizes new connections only. Returns 0 if OK, -1 if the socket isn't
+    //  open in a QMNet context.
+    int applyConfig(SocketBase* sock);
+
+    //  --------------------------------------------------------------------------
+    //  True once runtime settings changed, in any context, since the owner
+    //  loop saw generation, which is then brought up to date. Long lived
+    //  loops check it each round and call applyConfig on their sockets.
+    static bool configChanged(int& generation);
+
+    //  --------------------------------------------------------------------------
+    //  Load "key = value" lines from a config file (# and ; start comments,
+    //  [sections] are ignored), then QMN_<KEY> environment variables on top
+    //  of it. All values are checked first, nothing is applied if any is
+    //  rejected. At startup the file named by QMN_CONFIG is loaded.
+    //  Returns 0 if OK, -1 and the reasons in error.
+    int loadConfig(const QString& path, QString* error = 0);
+
+    //  --------------------------------------------------------------------------
+    //  Load the last config file again, to retune a running process.
+    int reloadConfig(QString* error = 0);
+
+    //  --------------------------------------------------------------------------
+    //  Effective value of every configuration key.
+    QMap<QString, int> config();
+
+    //  --------------------------------------------------------------------------
+    //  Pin the I/O threads of this context to the given CPUs, a startup
+    //  setting like io_threads. Returns -1 with a warning if sockets are open
+    //  or libzmq has no ZMQ_THREAD_AFFINITY_CPU_ADD (4.3 and later).
+    int setAffinity(const QList<int>& cpus);
+    QList<int> affinity();
+
+    //  --------------------------------------------------------------------------
+    //  Placement rules send sockets created through this context to another
+    //  one, so bulk transfer and latency critical sockets don't share I/O
+    //  threads. A tag rule wins over an endpoint prefix rule (matched after
+    //  any '@' or '>'), which wins over a socket type rule; the earliest of
+    //  equal rules is taken. Both ends of an inproc endpoint must end up in
+    //  the same context, so type rules skip sockets with an inproc endpoint.
+    void placeType(int type, QMNet* context);
+    void placeEndpoint(const QString& prefix, QMNet* context);
+    void placeTag(const QString& tag, QMNet* context);
+
+    //  --------------------------------------------------------------------------
+    //  Context a socket with this type, endpoints and tag is created in,
+    //  this context if no rule matches.
+    QMNet* placement(int type, const QString& endpoints = QString(),
+                     const QString& tag = QString());
+
+    static void test();
 
 private:
     Q_DECLARE_PRIVATE(QMNet)
     static QMNet* m_instance;
+
+    Socket* newSocket(int type);
+    void addSocket(SocketBase* sock, int type);
+    void addPipe(SocketBase* frontend, SocketBase* backend);
 };
 
 #define srnet QMNet::instance()
@@ -5,6 +5,8 @@
 
 #include <QQueue>
 #include <QMutex>
+#include <QPair>
+#include <QPointer>
 #include <QSharedPointer>
 /* context private,
  *
@@ -20,7 +22,7 @@ public:
 
         context = 0;
     }
-    ~ContextPrivate() {
+    virtual ~ContextPrivate() {
         zmq_term(context);
     }
 
@@ -43,6 +45,15 @@ public:
  *
  * ******************************/
 
+/// one placement rule, sockets matching it are created in context
+class Placement {
+public:
+    int type;                     //  Socket type, or -1
+    QString endpoint;             //  Endpoint prefix, or empty
+    QString tag;                  //  Explicit tag, or empty
+    QPointer<QMNet> context;      //  Where matching sockets go
+};
+
 class QMNetPrivate : public ContextPrivate {
 public:
     QMNetPrivate() {
@@ -53,14 +64,27 @@ public:
         s_sndhwm = 1000;
         s_pipehwm = 1000;
         s_ipv6 = 0;
-        s_open_sockets = 0;
+        s_sndbuf = 0;
+        s_rcvbuf = 0;
         s_initialized = false;
     }
 
+    typedef QList<QPair<QString, int> > ConfigValues;
+
+    int readConfig(const QString& path, ConfigValues& values, QString* error);
+    int configure(const ConfigValues& values, QString* error);
+    void applyOptions(SocketBase* sock, bool pipe);
+    void createContext();
+
     int s_max_sockets;
     int s_ipv6;
-    int s_open_sockets;
+    int s_sndbuf;                 //  ZMQ_SNDBUF for normal sockets, 0 = OS default
+    int s_rcvbuf;                 //  ZMQ_RCVBUF for normal sockets, 0 = OS default
     bool s_initialized;
+    QString s_config;             //  Config file loaded last, for reloadConfig
+    QList<SocketBase*> pipes;     //  Pipe ends, these take s_pipehwm
+    QList<int> s_affinity;        //  CPUs for I/O threads, empty = any
+    QList<Placement> placements;  //  Rules for placing sockets elsewhere
 };
 
 #endif // PRIVATE_HPP
@@ -192,6 +192,7 @@ void qforwarder(Socket *pipe, void *)
     ForwarderHandler ph(pipe);
     pipe->signal(0);
 
+    int generation = 0;
     while (!ph.terminated) {
         Socket* witch = (Socket*)ph.poller.wait(-1);
         if(ph.poller.terminated())
@@ -202,5 +203,11 @@ void qforwarder(Socket *pipe, void *)
             ph.s_switch(ph.frontend, ph.backend);
         else if(witch == ph.backend)
             ph.s_switch(ph.backend, ph.frontend);
+
+        if (QMNet::configChanged(generation)) {
+            srnet->applyConfig(ph.frontend);
+            srnet->applyConfig(ph.backend);
+            srnet->applyConfig(ph.capture);
+        }
     }
 }
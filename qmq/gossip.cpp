@@ -1,24 +1,54 @@
 #include "msg_p.hpp"
 #include <QIODevice>
 #include <QDataStream>
+#include <QVector>
+#include <QHash>
+#include <QThread>
 #include <QDebug>
 
+//  Initial room for encoded batch tuples, grows as needed and is kept
+#define GOSSIP_BATCH_RESERVE    4096
+
+//  Decoded key and value are views into the received frame, and strings
+//  are made only when the caller asks for them.
+
 class GossipFramePrivate : public FramePrivate {
 public:
     GossipFramePrivate() {
-        value = 0;
+        zmq_msg_init (&body);
+        id = 0;
+        key = value = NULL;
+        key_size = value_size = 0;
+        ttl = 0;
+        count = 0;
+        cursor = NULL;
+        batch_count = 0;
+        batch.reserve(GOSSIP_BATCH_RESERVE);
+        encoded.reserve(GOSSIP_BATCH_RESERVE);
+        sent_more = false;
     }
     ~GossipFramePrivate() {
-        if(value)
-            free(value);
+        zmq_msg_close (&body);
     }
 
     int id;                             //  gossipframe message ID
     byte *needle;                       //  Read/write pointer for serialization
     byte *ceiling;                      //  Valid upper limit for read pointer
-    char key [256];                     //  Tuple key, globally unique
-    char *value;                        //  Tuple value, as printable string
+    zmq_msg_t body;                     //  Last received frame, views point here
+    const char *key;                    //  Tuple key, globally unique
+    size_t key_size;
+    const char *value;                  //  Tuple value, as printable string
+    size_t value_size;
     uint32_t ttl;                       //  Time to live, msecs
+    QByteArray key_store;               //  Key set by caller
+    QByteArray value_store;             //  Value set by caller
+    QByteArray digest;                  //  Anti-entropy bucket digests
+    uint16_t count;                     //  Batch tuples not read yet
+    byte *cursor;                       //  Next batch tuple in body
+    uint16_t batch_count;               //  Tuples in batch to send
+    QByteArray batch;                   //  Batch tuples, encoded
+    QByteArray encoded;                 //  Message to send, buffer is kept
+    bool sent_more;                     //  Last send continues a batch
 };
 
 //  Put a block of octets to the frame
@@ -123,48 +153,59 @@ public:
     d->needle += 8; \
 }
 
-//  Put a string to the frame
-#define PUT_STRING(host) { \
-    size_t string_size = strlen (host); \
-    PUT_NUMBER1 (string_size); \
-    memcpy (d->needle, (host), string_size); \
-    d->needle += string_size; \
+//  Put a string of known size to the frame
+#define PUT_STRING(host,host_size) { \
+    PUT_NUMBER1 (host_size); \
+    memcpy (d->needle, (host), (host_size)); \
+    d->needle += (host_size); \
 }
 
-//  Get a string from the frame
-#define GET_STRING(host) { \
-    size_t string_size; \
-    GET_NUMBER1 (string_size); \
-    if (d->needle + string_size > (d->ceiling)) { \
+//  Get a string from the frame, as a view into the frame
+#define GET_STRING(host,host_size) { \
+    GET_NUMBER1 (host_size); \
+    if (d->needle + (host_size) > (d->ceiling)) { \
         qWarning("gossipframe: GET_STRING failed"); \
         goto malformed; \
     } \
-    memcpy ((host), d->needle, string_size); \
-    (host) [string_size] = 0; \
-    d->needle += string_size; \
+    (host) = (const char *) d->needle; \
+    d->needle += (host_size); \
 }
 
-//  Put a long string to the frame
-#define PUT_LONGSTR(host) { \
-    size_t string_size = strlen (host); \
-    PUT_NUMBER4 (string_size); \
-    memcpy (d->needle, (host), string_size); \
-    d->needle += string_size; \
+//  Put a long string of known size to the frame
+#define PUT_LONGSTR(host,host_size) { \
+    PUT_NUMBER4 (host_size); \
+    memcpy (d->needle, (host), (host_size)); \
+    d->needle += (host_size); \
 }
 
-//  Get a long string from the frame
-#define GET_LONGSTR(host) { \
-    size_t string_size; \
-    GET_NUMBER4 (string_size); \
-    if (d->needle + string_size > (d->ceiling)) { \
+//  Get a long string from the frame, as a view into the frame
+#define GET_LONGSTR(host,host_size) { \
+    GET_NUMBER4 (host_size); \
+    if (d->needle + (host_size) > (d->ceiling)) { \
         qWarning("gossipframe: GET_LONGSTR failed"); \
         goto malformed; \
     } \
-    free ((host)); \
-    (host) = (char *) malloc (string_size + 1); \
-    memcpy ((host), d->needle, string_size); \
-    (host) [string_size] = 0; \
-    d->needle += string_size; \
+    (host) = (const char *) d->needle; \
+    d->needle += (host_size); \
+}
+
+//  Put a chunk to the frame
+#define PUT_CHUNK(host) { \
+    PUT_NUMBER4 ((host).size()); \
+    memcpy (d->needle, (host).constData(), (host).size()); \
+    d->needle += (host).size(); \
+}
+
+//  Get a chunk from the frame
+#define GET_CHUNK(host) { \
+    size_t chunk_size; \
+    GET_NUMBER4 (chunk_size); \
+    if (d->needle + chunk_size > (d->ceiling)) { \
+        qWarning("gossipframe: GET_CHUNK failed"); \
+        goto malformed; \
+    } \
+    (host) = QByteArray((const char *) d->needle, chunk_size); \
+    d->needle += chunk_size; \
 }
 
 // message
@@ -175,26 +216,34 @@ GossipFrame::GossipFrame(const QByteArray &frout) : Frame(*(new GossipFramePriva
     reset(frout);
 }
 
+//  Several messages sent with QFRAME_MORE travel as one network message,
+//  and hasMore() tells the receiver another one follows. Only the first
+//  of them carries the routing ID.
+
 bool GossipFrame::recv(SocketBase &input)
 {
     Q_D(GossipFrame);
-    if (input.type() == ZMQ_ROUTER) {
+    if (input.type() == ZMQ_ROUTER && !d->more) {
         bool rcv = Frame::recv(input);
         if (!rcv || !d->more) {
             qWarning("gossipframe: no routing ID");
             return false;          //  Interrupted or malformed
         }
     }
-    zmq_msg_t frame;
-    zmq_msg_init (&frame);
-    int size = zmq_msg_recv (&frame, input.resolve(), 0);
+    //  Views into previous body die here
+    d->key = d->value = NULL;
+    d->key_size = d->value_size = 0;
+    d->count = 0;
+    int size = zmq_msg_recv (&d->body, input.resolve(), 0);
     if (size == -1) {
+        d->more = 0;
         qWarning("gossipframe: interrupted");
-        goto malformed;         //  Interrupted
+        return false;           //  Interrupted
     }
+    d->more = zmq_msg_more (&d->body);
     //  Get and check protocol signature
-    d->needle = (byte *) zmq_msg_data (&frame);
-    d->ceiling = d->needle + zmq_msg_size (&frame);
+    d->needle = (byte *) zmq_msg_data (&d->body);
+    d->ceiling = d->needle + zmq_msg_size (&d->body);
 
     uint16_t signature;
     GET_NUMBER2 (signature);
@@ -228,8 +277,8 @@ bool GossipFrame::recv(SocketBase &input)
                     goto malformed;
                 }
             }
-            GET_STRING (d->key);
-            GET_LONGSTR (d->value);
+            GET_STRING (d->key, d->key_size);
+            GET_LONGSTR (d->value, d->value_size);
             GET_NUMBER4 (d->ttl);
             break;
 
@@ -266,26 +315,114 @@ bool GossipFrame::recv(SocketBase &input)
             }
             break;
 
+        case GOSSIP_MSG_DIGEST:
+            {
+                byte version;
+                GET_NUMBER1 (version);
+                if (version != 1) {
+                    qWarning("gossipframe: version is invalid");
+                    goto malformed;
+                }
+            }
+            GET_CHUNK (d->digest);
+            break;
+
+        case GOSSIP_MSG_BATCH:
+            {
+                byte version;
+                GET_NUMBER1 (version);
+                if (version != 1) {
+                    qWarning("gossipframe: version is invalid");
+                    goto malformed;
+                }
+            }
+            //  Tuples are decoded one at a time by nextTuple
+            GET_NUMBER2 (d->count);
+            d->cursor = d->needle;
+            break;
+
         default:
             qWarning("gossipframe: bad message ID");
             goto malformed;
     }
     //  Successful return
-    zmq_msg_close (&frame);
     return true;
 
     //  Error returns
     malformed:
         qWarning("gossipframe: gossipframe malformed message, fail");
-        zmq_msg_close (&frame);
+        d->key = d->value = NULL;
+        d->key_size = d->value_size = 0;
+        d->count = 0;
         return false;              //  Invalid message
 }
 
+//  Decode next tuple of a BATCH into key, value and ttl. Returns false
+//  when batch is done or malformed.
+
+bool GossipFrame::nextTuple()
+{
+    Q_D(GossipFrame);
+    if (d->id != GOSSIP_MSG_BATCH || d->count == 0)
+        return false;
+
+    d->needle = d->cursor;
+    GET_STRING (d->key, d->key_size);
+    GET_LONGSTR (d->value, d->value_size);
+    GET_NUMBER4 (d->ttl);
+    d->cursor = d->needle;
+    d->count--;
+    return true;
+
+    malformed:
+        d->key = d->value = NULL;
+        d->key_size = d->value_size = 0;
+        d->count = 0;
+        return false;
+}
+
+//  Add a tuple to the BATCH we send next. Returns -1 if key is too long.
+
+int GossipFrame::appendTuple(const QByteArray &key, const QByteArray &value, int ttl)
+{
+    Q_D(GossipFrame);
+    if (key.size() > 255 || d->batch_count == 0xFFFF)
+        return -1;
+
+    int offset = d->batch.size();
+    d->batch.resize(offset + 1 + key.size() + 4 + value.size() + 4);
+    d->needle = (byte *) d->batch.data() + offset;
+    PUT_STRING (key.constData(), key.size());
+    PUT_LONGSTR (value.constData(), value.size());
+    PUT_NUMBER4 (ttl);
+    d->batch_count++;
+    return 0;
+}
+
+//  Empty the batch, keeping its buffer for the next one
+
+void GossipFrame::clearTuples()
+{
+    Q_D(GossipFrame);
+    d->batch.resize(0);
+    d->batch_count = 0;
+}
+
+int GossipFrame::tupleCount() const
+{
+    Q_D(const GossipFrame);
+    return d->batch_count;
+}
+
 int GossipFrame::send(SocketBase &output, int flags)
 {
     Q_D(GossipFrame);
-    if (output.type() == ZMQ_ROUTER)
-        Frame::send(output, QFRAME_MORE + QFRAME_REUSE + flags);
+    if (output.type() == ZMQ_ROUTER && !d->sent_more) {
+        //  Routing ID is copied by zmq_send, our frame stays as it is
+        if (zmq_send (output.resolve(), d->data(), d->size(),
+                      ZMQ_SNDMORE | ((flags & QFRAME_DONTWAIT) ? ZMQ_DONTWAIT : 0)) == -1)
+            return -1;
+    }
 
     size_t frame_size = 2 + 1;          //  Signature and message ID
     switch (d->id) {
@@ -294,10 +431,8 @@ int GossipFrame::send(SocketBase &output, int flags)
             break;
         case GOSSIP_MSG_PUBLISH:
             frame_size += 1;            //  version
-            frame_size += 1 + strlen (d->key);
-            frame_size += 4;
-            if (d->value)
-                frame_size += strlen (d->value);
+            frame_size += 1 + d->key_size;
+            frame_size += 4 + d->value_size;
             frame_size += 4;            //  ttl
             break;
         case GOSSIP_MSG_PING:
@@ -309,14 +444,21 @@ int GossipFrame::send(SocketBase &output, int flags)
         case GOSSIP_MSG_INVALID:
             frame_size += 1;            //  version
             break;
+        case GOSSIP_MSG_DIGEST:
+            frame_size += 1;            //  version
+            frame_size += 4 + d->digest.size();
+            break;
+        case GOSSIP_MSG_BATCH:
+            frame_size += 1;            //  version
+            frame_size += 2 + d->batch.size();
+            break;
     }
-    //  Now serialize message into the frame
-    zmq_msg_t frame;
-    zmq_msg_init_size (&frame, frame_size);
-    d->needle = (byte *) zmq_msg_data (&frame);
+    //  Now serialize message into our send buffer; it only grows, so
+    //  steady traffic encodes without allocating
+    d->encoded.resize(int(frame_size));
+    d->needle = (byte *) d->encoded.data();
     PUT_NUMBER2 (0xAAA0 | 0);
     PUT_NUMBER1 (d->id);
-    size_t nbr_frames = 1;              //  Total number of frames to send
 
     switch (d->id) {
         case GOSSIP_MSG_HELLO:
@@ -325,12 +467,8 @@ int GossipFrame::send(SocketBase &output, int flags)
 
         case GOSSIP_MSG_PUBLISH:
             PUT_NUMBER1 (1);
-            PUT_STRING (d->key);
-            if (d->value) {
-                PUT_LONGSTR (d->value);
-            }
-            else
-                PUT_NUMBER4 (0);    //  Empty string
+            PUT_STRING (d->key, d->key_size);
+            PUT_LONGSTR (d->value, d->value_size);
             PUT_NUMBER4 (d->ttl);
             break;
 
@@ -346,9 +484,24 @@ int GossipFrame::send(SocketBase &output, int flags)
             PUT_NUMBER1 (1);
             break;
 
+        case GOSSIP_MSG_DIGEST:
+            PUT_NUMBER1 (1);
+            PUT_CHUNK (d->digest);
+            break;
+
+        case GOSSIP_MSG_BATCH:
+            PUT_NUMBER1 (1);
+            PUT_NUMBER2 (d->batch_count);
+            PUT_OCTETS (d->batch.constData(), d->batch.size());
+            break;
+
     }
-    //  Now send the data frame
-    zmq_msg_send (&frame, output.resolve(), --nbr_frames? ZMQ_SNDMORE: 0);
+    //  Now send the data frame, zmq_send copies it out of our buffer
+    int send_flags = (flags & QFRAME_MORE) ? ZMQ_SNDMORE : 0;
+    send_flags |= (flags & QFRAME_DONTWAIT) ? ZMQ_DONTWAIT : 0;
+    d->sent_more = (flags & QFRAME_MORE) != 0;
+    if (zmq_send (output.resolve(), d->encoded.constData(), frame_size, send_flags) == -1)
+        return -1;
 
     return 0;
 }
@@ -368,16 +521,26 @@ void GossipFrame::setId(int id)
 QString GossipFrame::key() const
 {
     Q_D(const GossipFrame);
-    return QString(reinterpret_cast<const char*>(d->key));
+    return QString::fromLatin1(d->key, int(d->key_size));
 }
 
 void GossipFrame::setKey(const QString &k)
+{
+    setKeyData(k.toLatin1());
+}
+
+QByteArray GossipFrame::keyData() const
+{
+    Q_D(const GossipFrame);
+    return QByteArray::fromRawData(d->key, int(d->key_size));
+}
+
+void GossipFrame::setKeyData(const QByteArray &k)
 {
     Q_D(GossipFrame);
-    if (k == d->key)
-            return;
-    strncpy (d->key, k.toLatin1().data(), 255);
-    d->key [255] = 0;
+    d->key_store = k.left(255);
+    d->key = d->key_store.constData();
+    d->key_size = d->key_store.size();
 }
 
 QByteArray GossipFrame::routingId() const
@@ -393,14 +556,26 @@ void GossipFrame::setRoutingId(const QByteArray &frout)
 QString GossipFrame::value() const
 {
     Q_D(const GossipFrame);
-    return QString::fromLocal8Bit(d->value);
+    return QString::fromLocal8Bit(d->value, int(d->value_size));
 }
 
 void GossipFrame::setValue(const QString &v)
+{
+    setValueData(v.toLocal8Bit());
+}
+
+QByteArray GossipFrame::valueData() const
+{
+    Q_D(const GossipFrame);
+    return QByteArray::fromRawData(d->value, int(d->value_size));
+}
+
+void GossipFrame::setValueData(const QByteArray &v)
 {
     Q_D(GossipFrame);
-    free(d->value);
-    d->value = strdup(v.toLocal8Bit().data());
+    d->value_store = v;
+    d->value = d->value_store.constData();
+    d->value_size = d->value_store.size();
 }
 
 int GossipFrame::timeTolive() const
@@ -415,6 +590,18 @@ void GossipFrame::setTimeToLive(int ttl)
     d->ttl = ttl;
 }
 
+QByteArray GossipFrame::digest() const
+{
+    Q_D(const GossipFrame);
+    return d->digest;
+}
+
+void GossipFrame::setDigest(const QByteArray &digest)
+{
+    Q_D(GossipFrame);
+    d->digest = digest;
+}
+
 QString GossipFrame::command() const
 {
     Q_D(const GossipFrame);
@@ -434,6 +621,12 @@ QString GossipFrame::command() const
         case GOSSIP_MSG_INVALID:
             return QString("INVALID");
             break;
+        case GOSSIP_MSG_DIGEST:
+            return QString("DIGEST");
+            break;
+        case GOSSIP_MSG_BATCH:
+            return QString("BATCH");
+            break;
     }
     return QString("?");
 }
@@ -450,14 +643,8 @@ void GossipFrame::print()
         case GOSSIP_MSG_PUBLISH:
             qDebug ("GOSSIP_MSG_PUBLISH:");
             qDebug ("    version=1");
-            if (d->key)
-                qDebug ("    key='%s'", d->key);
-            else
-                qDebug ("    key=");
-            if (d->value)
-                qDebug ("    value='%s'", d->value);
-            else
-                qDebug ("    value=");
+            qDebug ("    key='%.*s'", int(d->key_size), d->key);
+            qDebug ("    value='%.*s'", int(d->value_size), d->value);
             qDebug ("    ttl=%ld", (long) d->ttl);
             break;
 
@@ -476,6 +663,18 @@ void GossipFrame::print()
             qDebug ("    version=1");
             break;
 
+        case GOSSIP_MSG_DIGEST:
+            qDebug ("GOSSIP_MSG_DIGEST:");
+            qDebug ("    version=1");
+            qDebug ("    digest=[%d bytes]", d->digest.size());
+            break;
+
+        case GOSSIP_MSG_BATCH:
+            qDebug ("GOSSIP_MSG_BATCH:");
+            qDebug ("    version=1");
+            qDebug ("    tuples=%d", int(d->batch_count));
+            break;
+
     }
 }
 
@@ -557,6 +756,50 @@ void GossipFrame::test()
         bool rec = self->recv(*input);
         assert (rec);
     }
+    self->setId(GOSSIP_MSG_DIGEST);
+
+    self->setDigest(QByteArray(512, 'D'));
+    //  Send twice
+    self->send(*output);
+    self->send(*output);
+
+    for (instance = 0; instance < 2; instance++) {
+        bool rec = self->recv(*input);
+        assert (rec);
+        assert (self->digest() == QByteArray(512, 'D'));
+    }
+
+    //  Batch of three PUBLISH in one network message
+    self->setId(GOSSIP_MSG_PUBLISH);
+    for (instance = 0; instance < 3; instance++) {
+        self->setKey(QString("key-%1").arg(instance));
+        self->send(*output, instance < 2 ? QFRAME_MORE : 0);
+    }
+    for (instance = 0; instance < 3; instance++) {
+        bool rec = self->recv(*input);
+        assert (rec);
+        assert (self->key() == QString("key-%1").arg(instance));
+        assert (self->hasMore() == (instance < 2));
+    }
+
+    //  Batch of three tuples in one message, empty value survives
+    self->setId(GOSSIP_MSG_BATCH);
+    self->clearTuples();
+    self->appendTuple("key-0", "value-0", 100);
+    self->appendTuple("key-1", "", 0);
+    self->appendTuple("key-2", "value-2", 300);
+    assert (self->tupleCount() == 3);
+    self->send(*output);
+    bool rec = self->recv(*input);
+    assert (rec);
+    for (instance = 0; instance < 3; instance++) {
+        rec = self->nextTuple();
+        assert (rec);
+        assert (self->keyData() == QString("key-%1").arg(instance).toLatin1());
+        assert (self->timeTolive() == instance * 100);
+    }
+    assert (self->valueData().isEmpty());
+    assert (!self->nextTuple());
 
     delete self;
     delete input;
@@ -566,52 +809,623 @@ void GossipFrame::test()
     printf ("OK\n");
 }
 
-
 /*
  *
  *
  * Actor Implementation ***/
 
-class Server_t {
+//  Tuples fall in one of GOSSIP_BUCKETS buckets by key, and the digest of
+//  a bucket is the XOR of its tuple hashes. Nodes swap digests on connect
+//  and send each other only the buckets that differ.
+#define GOSSIP_BUCKETS      64
+
+//  Timer wheel for tuple expiry, slots and resolution in msecs
+#define GOSSIP_WHEEL        256
+#define GOSSIP_TICK         100
+
+//  Maximum tuples we put into one network message
+#define GOSSIP_BATCH        64
+
+//  Heartbeat to remotes; clients silent for three heartbeats are dropped
+#define GOSSIP_PING         1000
+#define GOSSIP_EXPIRY       (GOSSIP_PING * 3)
+
+//  FNV-1a, stable across nodes and Qt versions, unlike qHash
+static quint64 s_fnv(quint64 hash, const QByteArray &data)
+{
+    const byte *bytes = (const byte *) data.constData();
+    for (int index = 0; index < data.size(); index++)
+        hash = (hash ^ bytes [index]) * Q_UINT64_C(1099511628211);
+    return hash;
+}
+
+#define FNV_BASIS           Q_UINT64_C(14695981039346656037)
+
+class Tuple_t {
 public:
-    Server_t();
-    //  These properties must always be present in the server_t
-    //  and are set by the generated engine; do not modify them!
-    Socket *pipe;              //  Actor pipe back to caller
-    //zconfig_t *config;          //  Current loaded configuration
-
-    //  Add any properties you need here
-    QList<Socket*> remotes;          //  Parents, as Socket instances
-    QHash<QString, QString> tuples;  //  Tuples, indexed by key
-
-    QString cur_tuple;         //  Holds current tuple to publish
-    GossipFrame message;       //  Message to broadcast
+    QByteArray key;             //  Tuple key, store index
+    QByteArray value;           //  Tuple value
+    quint64 hash;               //  Hash of key and value, part of digest
+    int bucket;                 //  Digest bucket, from key
+    qint64 expires_at;          //  Expiry time, 0 = never expires
+    qint64 advertised;          //  Expiry we last forwarded to peers
+    bool queued;                //  Waiting in outgoing batch
+    Tuple_t *prev;              //  Neighbours in timer wheel slot
+    Tuple_t *next;
 };
 
 class Client_t {
 public:
-    Server_t* parent;
-    GossipFrame frame;
+    QByteArray routing_id;      //  Client connected to our server
+    qint64 expires_at;          //  Dropped unless heard before this
 };
 
 class GossipHandler {
 public:
-    GossipHandler() {
-
+    GossipHandler(Socket *pip) {
+        pipe = pip;
+        server = 0;
+        memset (buckets, 0, sizeof (buckets));
+        memset (wheel, 0, sizeof (wheel));
+        scheduled = 0;
+        wheel_tick = clock_mono() / GOSSIP_TICK - 1;
+        ping_at = clock_mono() + GOSSIP_PING;
+        terminated = false;
+        verbose = false;
     }
 
-    QList<zmq_pollitem_t> readers;
+    ~GossipHandler() {
+        qDeleteAll(tuples);
+        qDeleteAll(clients);
+        qDeleteAll(remotes);
+        delete server;
+    }
 
+    int handlePipe();
+    void handleSocket(Socket *socket);
+    void process(Socket *socket);
+
+    bool store(const QByteArray &key, const QByteArray &value, int ttl,
+               bool *changed = 0);
+    void receive(const QByteArray &key, const QByteArray &value, int ttl);
+    void removeTuple(Tuple_t *tuple);
+    void queue(Tuple_t *tuple);
+    void schedule(Tuple_t *tuple);
+    void unschedule(Tuple_t *tuple);
+    void expireTuples();
+    void heartbeat();
+    long timeout();
+
+    QByteArray digest() const;
+    void sendDigest(Socket *socket, const QByteArray &route);
+    void sendBuckets(Socket *socket, const QByteArray &route,
+                     const QByteArray &theirs);
+    void sendTuples(Socket *socket, const QByteArray &route,
+                    const QList<Tuple_t*> &list);
+    void appendTuples(const QList<Tuple_t*> &list, int from);
+    void flush();
+
+    Socket *pipe;               //  Actor pipe back to caller
+    Socket *server;             //  Our server, once we BIND
+    QList<Socket*> remotes;     //  Servers we connected to
+    QHash<QByteArray, Client_t*> clients;   //  Clients, by routing ID
+    QHash<QByteArray, Tuple_t*> tuples;     //  Tuples, indexed by key
+    quint64 buckets [GOSSIP_BUCKETS];       //  Digest of each bucket
+
+    Tuple_t *wheel [GOSSIP_WHEEL];          //  Tuples to expire, by slot
+    int scheduled;              //  Tuples in wheel
+    qint64 wheel_tick;          //  Last tick we expired
+    qint64 ping_at;             //  Next heartbeat
+
+    QList<Tuple_t*> outgoing;   //  New and changed tuples to forward
+    GossipFrame request;        //  Message from network
+    GossipFrame reply;          //  Message to network
+    bool terminated;            //  Did caller ask us to quit?
+    bool verbose;               //  Verbose logging enabled?
 };
 
+int GossipHandler::handlePipe()
+{
+    Messages request;
+    request.recv(*pipe);
+    if(request.size() <= 0) return -1;
+
+    QString command = request.popstr();
+    if (verbose)
+        qDebug("qgossip: API command=%s", command.toLatin1().data());
+
+    if (command == "BIND") {
+        QString endpoint = request.popstr();
+        if (!server)
+            server = pipe->context()->createSocket(ZMQ_ROUTER);
+        int rc = server ? server->bind("%s", endpoint.toLatin1().data()) : -1;
+        pipe->signal(rc == -1 ? 1 : 0);
+    }
+    else
+    if (command == "CONNECT") {
+        //  Say hello and send our digest, the server answers with what
+        //  we are missing and its own digest
+        QString endpoint = request.popstr();
+        Socket *remote = pipe->context()->createSocket(ZMQ_DEALER);
+        if (remote && remote->connect("%s", endpoint.toLatin1().data()) == 0) {
+            remotes.append(remote);
+            reply.setId(GOSSIP_MSG_HELLO);
+            reply.send(*remote);
+            sendDigest(remote, QByteArray());
+            pipe->signal(0);
+        }
+        else {
+            delete remote;
+            pipe->signal(1);
+        }
+    }
+    else
+    if (command == "PUBLISH") {
+        //  PUBLISH key value [ttl msecs]
+        QByteArray key = request.popstr().toLatin1();
+        QByteArray value = request.popstr().toLocal8Bit();
+        int ttl = request.size() ? request.popstr().toInt() : 0;
+        if (key.size() > 255)
+            qWarning("qgossip: key too long: %s", key.constData());
+        else
+            store(key, value, ttl);
+    }
+    else
+    if (command == "STATUS")
+        pipe->send("i", tuples.size());
+    else
+    if (command == "VERBOSE") {
+        verbose = true;
+        pipe->signal(0);
+    }
+    else
+    if (command == "$TERM")
+        terminated = true;
+    else {
+        qFatal("qgossip: - invalid command: %s", command.toLatin1().data());
+    }
 
-void qgossip(Socket *pipe, void *)
+    return 0;
+}
+
+//  Read one network message, which may be a batch of gossip messages
+
+void GossipHandler::handleSocket(Socket *socket)
+{
+    do {
+        if (!request.recv(*socket))
+            continue;           //  Malformed, rest of batch may be fine
+        process(socket);
+    } while (request.hasMore());
+}
+
+void GossipHandler::process(Socket *socket)
+{
+    QByteArray route;
+    if (socket == server) {
+        route = request.routingId();
+        Client_t *client = clients.value(route, 0);
+        if (!client) {
+            client = new Client_t;
+            client->routing_id = route;
+            clients.insert(route, client);
+        }
+        client->expires_at = clock_mono() + GOSSIP_EXPIRY;
+    }
+    if (verbose)
+        qDebug("qgossip: received %s", request.command().toLatin1().data());
+
+    switch (request.id()) {
+        case GOSSIP_MSG_PUBLISH:
+            receive(request.keyData(), request.valueData(), request.timeTolive());
+            break;
+
+        case GOSSIP_MSG_BATCH:
+            while (request.nextTuple())
+                receive(request.keyData(), request.valueData(), request.timeTolive());
+            break;
+
+        case GOSSIP_MSG_DIGEST:
+            sendBuckets(socket, route, request.digest());
+            if (socket == server)
+                sendDigest(socket, route);
+            break;
+
+        case GOSSIP_MSG_PING:
+            reply.setId(GOSSIP_MSG_PONG);
+            reply.setRoutingId(route);
+            reply.send(*socket);
+            break;
+
+        default:
+            break;              //  HELLO and PONG only keep peer alive
+    }
+}
+
+//  Store tuple from network, key and value are views into the request.
+//  New values go to the caller as DELIVER key value.
+
+void GossipHandler::receive(const QByteArray &key, const QByteArray &value, int ttl)
+{
+    bool changed;
+    store(key, value, ttl, &changed);
+    if (changed) {
+        pipe->sendmem("DELIVER", 7, QFRAME_MORE);
+        pipe->sendmem(key.constData(), key.size(), QFRAME_MORE);
+        pipe->sendmem(value.constData(), value.size(), 0);
+    }
+}
+
+//  Store tuple. Returns true if peers need to hear about it: tuple is new,
+//  its value changed, or its expiry moved by more than half its ttl since
+//  we last forwarded it. Sets changed if value is new.
+
+bool GossipHandler::store(const QByteArray &key, const QByteArray &value,
+                          int ttl, bool *changed)
 {
+    qint64 expires_at = ttl > 0 ? clock_mono() + ttl : 0;
+    Tuple_t *tuple = tuples.value(key, 0);
+    bool is_new = false;
+    if (!tuple) {
+        tuple = new Tuple_t;
+        tuple->key = QByteArray(key.constData(), key.size());
+        tuple->hash = 0;
+        tuple->bucket = int(s_fnv(FNV_BASIS, key) % GOSSIP_BUCKETS);
+        tuple->expires_at = 0;
+        tuple->advertised = 0;
+        tuple->queued = false;
+        tuple->prev = tuple->next = 0;
+        tuples.insert(tuple->key, tuple);
+        is_new = true;
+    }
+    bool value_changed = is_new || tuple->value != value;
+    if (value_changed) {
+        buckets [tuple->bucket] ^= tuple->hash;
+        tuple->value = QByteArray(value.constData(), value.size());
+        tuple->hash = s_fnv(s_fnv(FNV_BASIS, key) * Q_UINT64_C(1099511628211), value);
+        buckets [tuple->bucket] ^= tuple->hash;
+    }
+    if (changed)
+        *changed = value_changed;
+
+    bool forward = value_changed;
+    if (!forward) {
+        if (!expires_at || !tuple->advertised)
+            forward = expires_at != tuple->advertised;
+        else
+            forward = expires_at - tuple->advertised > ttl / 2;
+    }
 
+    unschedule(tuple);
+    tuple->expires_at = expires_at;
+    schedule(tuple);
+    if (forward) {
+        tuple->advertised = expires_at;
+        queue(tuple);
+    }
+    return forward;
 }
 
+void GossipHandler::removeTuple(Tuple_t *tuple)
+{
+    if (verbose)
+        qDebug("qgossip: expired key=%s", tuple->key.constData());
+
+    unschedule(tuple);
+    buckets [tuple->bucket] ^= tuple->hash;
+    tuples.remove(tuple->key);
+    if (tuple->queued)
+        outgoing.removeOne(tuple);
+    delete tuple;
+}
+
+void GossipHandler::queue(Tuple_t *tuple)
+{
+    if (!tuple->queued) {
+        tuple->queued = true;
+        outgoing.append(tuple);
+    }
+}
+
+void GossipHandler::schedule(Tuple_t *tuple)
+{
+    if (!tuple->expires_at)
+        return;
+    int slot = int((tuple->expires_at / GOSSIP_TICK) % GOSSIP_WHEEL);
+    tuple->prev = 0;
+    tuple->next = wheel [slot];
+    if (wheel [slot])
+        wheel [slot]->prev = tuple;
+    wheel [slot] = tuple;
+    scheduled++;
+}
+
+void GossipHandler::unschedule(Tuple_t *tuple)
+{
+    if (!tuple->expires_at)
+        return;
+    int slot = int((tuple->expires_at / GOSSIP_TICK) % GOSSIP_WHEEL);
+    if (tuple->prev)
+        tuple->prev->next = tuple->next;
+    else
+        wheel [slot] = tuple->next;
+    if (tuple->next)
+        tuple->next->prev = tuple->prev;
+    tuple->prev = tuple->next = 0;
+    scheduled--;
+}
+
+//  Visit the slot of every tick that has fully passed since last time.
+//  Tuples due on a later turn of the wheel stay in their slot.
+
+void GossipHandler::expireTuples()
+{
+    qint64 last_tick = clock_mono() / GOSSIP_TICK - 1;
+    if (wheel_tick < last_tick - GOSSIP_WHEEL)
+        wheel_tick = last_tick - GOSSIP_WHEEL;
+
+    while (wheel_tick < last_tick) {
+        wheel_tick++;
+        Tuple_t *tuple = wheel [wheel_tick % GOSSIP_WHEEL];
+        while (tuple) {
+            Tuple_t *next = tuple->next;
+            if (tuple->expires_at / GOSSIP_TICK <= wheel_tick)
+                removeTuple(tuple);
+            tuple = next;
+        }
+    }
+}
+
+void GossipHandler::heartbeat()
+{
+    qint64 now = clock_mono();
+    if (now < ping_at)
+        return;
+
+    reply.setId(GOSSIP_MSG_PING);
+    foreach (Socket *remote, remotes)
+        reply.send(*remote);
+
+    QMutableHashIterator<QByteArray, Client_t*> it(clients);
+    while (it.hasNext()) {
+        it.next();
+        if (it.value()->expires_at < now) {
+            delete it.value();
+            it.remove();
+        }
+    }
+    ping_at = now + GOSSIP_PING;
+}
+
+long GossipHandler::timeout()
+{
+    qint64 now = clock_mono();
+    qint64 wake_at = ping_at;
+    if (scheduled)
+        wake_at = qMin(wake_at, (wheel_tick + 2) * GOSSIP_TICK);
+    return wake_at > now ? long(wake_at - now) : 0;
+}
+
+QByteArray GossipHandler::digest() const
+{
+    QByteArray digest(GOSSIP_BUCKETS * 8, 0);
+    byte *needle = (byte *) digest.data();
+    for (int bucket = 0; bucket < GOSSIP_BUCKETS; bucket++) {
+        for (int shift = 56; shift >= 0; shift -= 8)
+            *needle++ = (byte) ((buckets [bucket] >> shift) & 255);
+    }
+    return digest;
+}
+
+void GossipHandler::sendDigest(Socket *socket, const QByteArray &route)
+{
+    reply.setId(GOSSIP_MSG_DIGEST);
+    reply.setRoutingId(route);
+    reply.setDigest(digest());
+    reply.send(*socket);
+}
+
+//  Send tuples of every bucket where peer digest differs from ours
+
+void GossipHandler::sendBuckets(Socket *socket, const QByteArray &route,
+                                const QByteArray &theirs)
+{
+    QByteArray ours = digest();
+    bool differs [GOSSIP_BUCKETS];
+    bool any = false;
+    for (int bucket = 0; bucket < GOSSIP_BUCKETS; bucket++) {
+        differs [bucket] = theirs.size() != ours.size()
+                        || memcmp (theirs.constData() + bucket * 8,
+                                   ours.constData() + bucket * 8, 8) != 0;
+        any |= differs [bucket];
+    }
+    if (!any)
+        return;
+
+    QList<Tuple_t*> list;
+    foreach (Tuple_t *tuple, tuples) {
+        if (differs [tuple->bucket])
+            list.append(tuple);
+    }
+    if (verbose)
+        qDebug("qgossip: anti-entropy sends %d tuples", list.size());
+    sendTuples(socket, route, list);
+}
+
+//  Encode up to GOSSIP_BATCH tuples of list, starting at from, into reply
+
+void GossipHandler::appendTuples(const QList<Tuple_t*> &list, int from)
+{
+    qint64 now = clock_mono();
+    reply.setId(GOSSIP_MSG_BATCH);
+    reply.clearTuples();
+    int index;
+    for (index = from; index < list.size() && index < from + GOSSIP_BATCH; index++) {
+        Tuple_t *tuple = list [index];
+        reply.appendTuple(tuple->key, tuple->value, tuple->expires_at ?
+                          qMax(1, int(tuple->expires_at - now)) : 0);
+    }
+}
+
+//  Send tuples to one peer, GOSSIP_BATCH per network message
+
+void GossipHandler::sendTuples(Socket *socket, const QByteArray &route,
+                               const QList<Tuple_t*> &list)
+{
+    for (int from = 0; from < list.size(); from += GOSSIP_BATCH) {
+        appendTuples(list, from);
+        reply.setRoutingId(route);
+        reply.send(*socket);
+    }
+}
+
+//  Forward new and changed tuples to all remotes and clients, each
+//  batch is encoded once for all of them
+
+void GossipHandler::flush()
+{
+    if (outgoing.isEmpty())
+        return;
+
+    for (int from = 0; from < outgoing.size(); from += GOSSIP_BATCH) {
+        appendTuples(outgoing, from);
+        foreach (Socket *remote, remotes)
+            reply.send(*remote);
+        if (server) {
+            foreach (Client_t *client, clients) {
+                reply.setRoutingId(client->routing_id);
+                reply.send(*server);
+            }
+        }
+    }
+    foreach (Tuple_t *tuple, outgoing)
+        tuple->queued = false;
+    outgoing.clear();
+}
+
+void qgossip(Socket *pipe, void *)
+{
+    GossipHandler self(pipe);
+    pipe->signal(0);
+
+    while (!self.terminated) {
+        QList<Socket*> sockets;
+        sockets.append(pipe);
+        if (self.server)
+            sockets.append(self.server);
+        sockets.append(self.remotes);
+
+        QVector<zmq_pollitem_t> items(sockets.size());
+        for (int index = 0; index < sockets.size(); index++) {
+            zmq_pollitem_t item = { sockets [index]->resolve(), 0, ZMQ_POLLIN, 0 };
+            items [index] = item;
+        }
+        if (zmq_poll(items.data(), items.size(), self.timeout()) == -1)
+            break;              //  Interrupted
+
+        //  Take everything that is waiting, so one flush batches it all
+        for (int index = 0; index < sockets.size(); index++) {
+            if (!(items [index].revents & ZMQ_POLLIN))
+                continue;
+            Socket *socket = sockets [index];
+            int count = 0;
+            do {
+                if (socket == pipe)
+                    self.handlePipe();
+                else
+                    self.handleSocket(socket);
+            } while (!self.terminated && ++count < GOSSIP_BATCH
+                     && (socket->events() & ZMQ_POLLIN));
+        }
+        self.expireTuples();
+        self.heartbeat();
+        self.flush();
+    }
+}
 
 void gossipTest(bool verbose)
 {
+    printf (" * qgossip: ");
+    if (verbose)
+        printf ("\n");
 
+    //  @selftest
+    //  Base node has tuples before anybody joins
+    ActorSocket base(qgossip, NULL);
+    if (verbose) {
+        base.sendx("VERBOSE", NULL);
+        base.wait();
+    }
+    base.sendx("BIND", "inproc://gossip-base", NULL);
+    int rc = base.wait();
+    assert (rc == 0);
+    base.sendx("PUBLISH", "inproc://orange", "service1", NULL);
+    base.sendx("PUBLISH", "inproc://lemon", "service2", NULL);
+
+    //  Joining node gets both by anti-entropy
+    ActorSocket node(qgossip, NULL);
+    node.sendx("CONNECT", "inproc://gossip-base", NULL);
+    rc = node.wait();
+    assert (rc == 0);
+
+    QStringList delivered;
+    int index;
+    for (index = 0; index < 2; index++) {
+        QString command, key, value;
+        node.recv("sss", &command, &key, &value);
+        assert (command == "DELIVER");
+        delivered << key + "=" + value;
+    }
+    delivered.sort();
+    assert (delivered [0] == "inproc://lemon=service2");
+    assert (delivered [1] == "inproc://orange=service1");
+
+    //  Node publishes, base hears it; same value again is not forwarded
+    node.sendx("PUBLISH", "inproc://apple", "service3", NULL);
+    QString command, key, value;
+    base.recv("sss", &command, &key, &value);
+    assert (command == "DELIVER");
+    assert (key == "inproc://apple");
+    assert (value == "service3");
+    node.sendx("PUBLISH", "inproc://apple", "service3", NULL);
+
+    //  Keys from the network stay valid after later messages come in:
+    //  a new value for apple replaces the tuple base already has
+    node.sendx("PUBLISH", "inproc://banana", "service5", NULL);
+    base.recv("sss", &command, &key, &value);
+    assert (key == "inproc://banana");
+    node.sendx("PUBLISH", "inproc://apple", "service6", NULL);
+    base.recv("sss", &command, &key, &value);
+    assert (key == "inproc://apple");
+    assert (value == "service6");
+
+    //  Short lived tuple expires everywhere
+    base.sendx("PUBLISH", "inproc://cherry", "service4", "200", NULL);
+    node.recv("sss", &command, &key, &value);
+    assert (key == "inproc://cherry");
+
+    int count;
+    base.sendx("STATUS", NULL);
+    base.recv("i", &count);
+    assert (count == 5);
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+    QThread::msleep(500);
+#else
+    usleep(500 * 1000);
+#endif
+    base.sendx("STATUS", NULL);
+    base.recv("i", &count);
+    assert (count == 4);
+    node.sendx("STATUS", NULL);
+    node.recv("i", &count);
+    assert (count == 4);
+
+    //  Nothing else was delivered
+    node.setRcvtimeo(100);
+    assert (node.recvstr().isNull());
+    base.setRcvtimeo(100);
+    assert (base.recvstr().isNull());
+    //  @end
+
+    printf ("OK\n");
 }
@@ -8,6 +8,8 @@
 #define GOSSIP_MSG_PING                    3
 #define GOSSIP_MSG_PONG                    4
 #define GOSSIP_MSG_INVALID                 5
+#define GOSSIP_MSG_DIGEST                  6
+#define GOSSIP_MSG_BATCH                   7
 
 class GossipFramePrivate;
 class QMQ_EXPORT GossipFrame : public Frame
@@ -24,16 +26,32 @@ public:
 
     QString key() const;
     void setKey(const QString& k);
+    /// raw key, a view valid until next recv or set
+    QByteArray keyData() const;
+    void setKeyData(const QByteArray& k);
 
     QByteArray routingId() const;
     void setRoutingId(const QByteArray& frout);
 
     QString value() const;
     void setValue(const QString& v);
+    /// raw value, a view valid until next recv or set
+    QByteArray valueData() const;
+    void setValueData(const QByteArray& v);
 
     int timeTolive() const;
     void setTimeToLive(int ttl);
 
+    QByteArray digest() const;
+    void setDigest(const QByteArray& digest);
+
+    /// BATCH carries many tuples: nextTuple decodes the next one into
+    /// key, value and ttl; appendTuple adds one to the batch we send
+    bool nextTuple();
+    int appendTuple(const QByteArray& key, const QByteArray& value, int ttl);
+    void clearTuples();
+    int tupleCount() const;
+
     QString command() const;
     void print();
 
@@ -43,7 +61,8 @@ private:
     Q_DECLARE_PRIVATE(GossipFrame)
 };
 
-// its not implemented yet
+/// Gossip handler
+/// keeps a store of key/value tuples in sync over a network of nodes
 class Socket;
 extern "C" QMQ_EXPORT void qgossip(Socket *pipe, void *);
 extern "C" QMQ_EXPORT void gossipTest(bool verbose=false);
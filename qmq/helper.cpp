@@ -309,3 +309,33 @@ int64_t clock_mono()
     return (int64_t) (count.QuadPart * 1000) / frequency;
 #endif
 }
+
+int64_t clock_usecs()
+{
+#if defined (Q_OS_MAC)
+    clock_serv_t cclock;
+    mach_timespec_t mts;
+    host_get_clock_service (mach_host_self (), SYSTEM_CLOCK, &cclock);
+    clock_get_time (cclock, &mts);
+    mach_port_deallocate (mach_task_self (), cclock);
+    return (int64_t) ((int64_t) mts.tv_sec * 1000000 + (int64_t) mts.tv_nsec / 1000);
+
+#elif defined (Q_OS_UNIX)
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (int64_t) ((int64_t) ts.tv_sec * 1000000 + (int64_t) ts.tv_nsec / 1000);
+
+#elif (defined (Q_OS_WIN))
+    static int64_t frequency = 0;
+    if (frequency == 0) {
+        LARGE_INTEGER freq;
+        QueryPerformanceFrequency (&freq);
+        assert (freq.QuadPart != 0);
+        frequency = freq.QuadPart;
+    }
+    LARGE_INTEGER count;
+    QueryPerformanceCounter (&count);
+    return (int64_t) (count.QuadPart / frequency) * 1000000
+         + (int64_t) (count.QuadPart % frequency) * 1000000 / frequency;
+#endif
+}
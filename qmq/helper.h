@@ -154,4 +154,7 @@ void zrex_test (bool verbose);
 
 int64_t clock_mono (void);
 
+//  Same clock in usecs
+int64_t clock_usecs (void);
+
 #endif // HELPER_HPP
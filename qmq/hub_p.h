@@ -2,15 +2,16 @@
 #define HUB_P_H
 
 #include <QMap>
+#include <QHash>
+#include <QVector>
 #include <QThread>
 #include <QMutex>
 
 #undef min
 #undef max
 
-#include <QDateTime>
-
 class Socket;
+class ActorSocket;
 class QHub;
 class Frame;
 class QTimer;
@@ -18,11 +19,15 @@ class QTimer;
 class Worker_t {
 public:
 
-    QString id;
+    QByteArray id;      // identity in hex, also its pong identity
+    QByteArray identity; // router identity, raw, commands come with it
     QString name;
     QString address;
-    QDateTime expiry;
+    qint64 expiry;      // clock_mono
+    qint64 seen;        // clock_mono, last pong or command
+    qint64 busy_until;  // clock_mono, skips heartbeats until then
     int liveness;
+    int heap_index;     // position in expiry heap, -1 if not in it
 
     friend inline bool operator ==(const Worker_t& w1, const Worker_t& w2);
 };
@@ -34,7 +39,7 @@ inline bool operator ==(const Worker_t& w1, const Worker_t& w2) {
 class Client_t {
 public:
 
-    QString id;
+    QByteArray id;      // router identity, raw
     QString address;
     QString name;
     QHash<int, QString> requests;
@@ -45,10 +50,86 @@ inline bool operator ==(const Client_t& c1, const Client_t& c2) {
     return c1.id == c2.id;
 }
 
+//  Command from a client or worker. In version 2 it is one binary
+//  frame, decoded in place: strings point into the frame and are not
+//  terminated, so the frame must outlive the command.
+class HubCommand {
+public:
+    bool decode(Frame* frame);
+
+    int version;                //  Highest protocol version of sender
+    int command;
+    const char* address;
+    int address_size;
+    const char* name;
+    int name_size;
+    const char* value;
+    int value_size;
+};
+
+//  Worker registered at another hub of the mesh
+class RemoteWorker {
+public:
+    QString name;
+    QString address;
+};
+
+//  Worker table of a hub kept in sync from a snapshot and then numbered
+//  deltas; used by peer hubs and by clients
+class WorkerDirectory {
+public:
+    enum Result { Applied, Stale, Gap, Invalid };
+
+    WorkerDirectory() : sequence(0) {}
+
+    bool load(Frame* snapshot, int command, QByteArray* uuid);
+    Result apply(const QByteArray& delta);
+
+    quint64 sequence;           //  Last delta applied
+    QHash<QByteArray, RemoteWorker> workers;
+    QHash<QString, QList<QByteArray> > names;   //  Worker ids by name
+};
+
+//  Another hub of the mesh, found by beacon. Its deltas come over our
+//  peers socket; a gap in sequence or a new hub asks for a snapshot over
+//  the dealer, and deltas are kept until it arrives.
+class RemoteHub {
+public:
+    QByteArray uuid;
+    QByteArray beacon;          //  Beacon peer key it was found by
+    QString endpoint;           //  Registrar, where we redirect clients
+    QString feed;               //  Its federation publisher
+    Socket* dealer;             //  Snapshot requests to its registrar
+    WorkerDirectory directory;  //  Its workers
+    bool syncing;               //  Snapshot asked and not arrived yet
+    QList<QByteArray> pending;  //  Deltas received while syncing
+    qint64 asked_at;            //  clock_mono, snapshot request
+    qint64 rtt;                 //  Snapshot round trip, msecs
+    qint64 expiry;              //  clock_mono, no delta or beat after it
+};
+
+//  Min-heap of workers by expiry. Each worker keeps its index; a pong only
+//  marks the worker seen, and purge moves the expired ones that were seen,
+//  so a heartbeat costs O(log n) per worker at most once.
+class WorkerHeap {
+public:
+    void push(Worker_t* w);
+    void remove(Worker_t* w);
+    void update(Worker_t* w);
+    Worker_t* top() const { return heap.isEmpty() ? 0 : heap.first(); }
+
+private:
+    void place(int index, Worker_t* w);
+    void siftUp(int index);
+    void siftDown(int index);
+
+    QVector<Worker_t*> heap;
+};
+
 class QHubPrivate : public QThread {
     Q_OBJECT
 public:
-    QHubPrivate(QHub* parent);
+    QHubPrivate(QHub* parent, const QString& tag);
     ~QHubPrivate();
 
     void purge();
@@ -65,7 +146,31 @@ public:
     void clientQuery(Frame* command, Frame* senderinfo, Frame *sender);
     void workerRequest(Frame* command, Frame* senderinfo, Frame *sender);
 
-    void workerPong(Frame* sender);
+    void clientCommand(const HubCommand& cmd, Frame* sender, int version);
+    void workerCommand(const HubCommand& cmd, Frame* sender, int version);
+    void sendReply(Frame* sender, const char* header, const void* body, int size);
+    void sendEndpoint(Frame* sender, int version, int command, bool found,
+                      const QByteArray& endpoint);
+
+    void workerPong(Frame* sender, qint64 now);
+
+    void workerAdded(Worker_t* w);
+    void workerRemoved(Worker_t* w);
+
+    void startFederation();
+    void stopFederation();
+    void publishDelta(int type, Worker_t* w);
+    void beaconEvent();
+    void feedMessage();
+    void hubCommand(Frame* body, Frame* sender);
+    QByteArray snapshot(int command);
+    void snapshotReply(RemoteHub* r);
+    void applyDelta(RemoteHub* r, const QByteArray& delta);
+    void requestSnapshot(RemoteHub* r);
+    void addRemote(const QByteArray& id, const QString& address, int hubport, int feedport);
+    void removeRemote(RemoteHub* r);
+    void purgeRemotes();
+    QString nearestHub(const QString& name, bool* found);
 
     void run();
 
@@ -76,15 +181,33 @@ public:
     Socket* notifier;
 
     int hport, mport, pport, poport, nport;
+    QString tag;            // placement of our sockets
 
     bool terminate;
     QString hubid;
+    QByteArray hubid_data;  // hubid as pongs carry it
 
-    QMap<QString ,Worker_t*> m_workers;
-    QMap<QString ,Client_t*> m_clients;
+    QHash<QByteArray ,Worker_t*> m_workers;
+    QHash<QByteArray, Worker_t*> m_identities; // m_workers by router identity
+    WorkerHeap m_expiry;
+    QHash<QByteArray ,Client_t*> m_clients;
     QHash<Client_t*, Worker_t*> m_cw;
-
-    QDateTime heartbeat_at;
+    QHash<QString, int> m_names;    // local workers by name
+    QHash<QString, QList<Worker_t*> > m_direct; // workers with a data endpoint, by name
+    uint m_pick;                    // round robin of CMD_WORKER_ADDR
+
+    // federation, off while beacon_port is 0
+    int beacon_port;
+    int fport;
+    QByteArray uuid;        // random, names this hub in the mesh
+    quint64 sequence;       // last delta we published
+    ActorSocket* beacon;
+    Socket* feed;           // PUB, our deltas
+    Socket* peers;          // SUB, deltas of other hubs
+    QHash<QByteArray, RemoteHub*> m_remotes;
+    QHash<QByteArray, RemoteHub*> m_beacons; // by beacon peer key
+
+    qint64 heartbeat_at;    // clock_mono
     int heartbeat;
     int liveness;
     QTimer* m_timer;
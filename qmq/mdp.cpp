@@ -6,25 +6,97 @@
 #include <QTime>
 #include <QDebug>
 #include <QThread>
+#include <QQueue>
+#include <QVector>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QThreadStorage>
 #include <QtConcurrent>
 
+//  Protocol frames are compared as bytes, never converted to strings
+
+static bool s_frame_is(Frame *frame, const char *data, int size)
+{
+    return frame && frame->size() == size
+        && memcmp (frame->constData(), data, size) == 0;
+}
+
+//  Take the client envelope off a request or report. A correlated
+//  request has its correlation id between address and delimiter;
+//  correlation is set to it, or NULL.
+
+static Frame *s_unwrap_client(Messages *msgs, Frame **correlation)
+{
+    Frame *client = msgs->pop();
+    *correlation = NULL;
+    Frame *next = msgs->first();
+    if (next && next->size() && msgs->size() >= 2 && msgs->at(1)->size() == 0)
+        *correlation = msgs->pop();
+    Frame *empty = msgs->first();
+    if (empty && empty->size() == 0)
+        delete msgs->pop();
+    return client;
+}
+
+class MdpClientPrivate;
+
+class MdpReplyPrivate {
+public:
+    MdpReplyPrivate() {
+        client = 0;
+        id = 0;
+        status = MdpReply::Pending;
+        deadline = 0;
+        retries = 0;
+    }
+
+    MdpClientPrivate* client;   //  Client we are pending on, or NULL
+    quint32 id;                 //  Correlation id
+    MdpReply::Status status;
+    QString service;
+    Messages request;           //  Kept for retries
+    Messages report;            //  Application frames of the reply
+    QByteArray trace;           //  Trace trailer, if traced
+    qint64 deadline;            //  When to retry or give up, clock_mono
+    int retries;                //  Retries left
+};
+
 class MdpClientPrivate {
 public:
     MdpClientPrivate(Context *ctx) {
         timeout = 2500;
+        retries = 0;
+        sequence = 0;
         verbose = false;
-        if(ctx)
-            client = ctx->createSocket(ZMQ_DEALER);
-        else client = srnet->createSocket(ZMQ_DEALER);
+        tracing = false;
+        context = ctx ? ctx : srnet;
+        client = context->createSocket(ZMQ_DEALER);
     }
     ~MdpClientPrivate() {
+        //  Replies outlive us, they just stop waiting
+        foreach (MdpReply* reply, pending)
+            reply->d_func()->client = 0;
         delete client;
     }
 
+    int sendRequest(MdpReply* reply);
+    void expire(QList<MdpReply*>& timed_out);
+
+    Context* context;           //  Places the socket on each connect
+    QString tag;                //  Placement tag
     Socket* client;
     QString broker;
     bool verbose;
     int timeout;
+    int retries;                //  Resends before a request times out
+    bool tracing;               //  Requests get a trace trailer
+
+    //  In-flight requests by correlation id. Timeout is the same for all,
+    //  so deadlines come in send order; entries for replies that finished
+    //  or were resent since are skipped when they come up.
+    quint32 sequence;
+    QHash<quint32, MdpReply*> pending;
+    QQueue<QPair<qint64, quint32> > deadlines;
 };
 
 MdpClient::MdpClient(Context *ctx, QObject *parent) : d_ptr(new MdpClientPrivate(ctx)) ,QObject(parent)
@@ -59,6 +131,54 @@ void MdpClient::setTimeOut(int ms)
     d->timeout = ms;
 }
 
+int MdpClient::timeOut() const
+{
+    Q_D(const MdpClient);
+    return d->timeout;
+}
+
+void MdpClient::setRetries(int count)
+{
+    Q_D(MdpClient);
+    d->retries = count;
+}
+
+int MdpClient::retries() const
+{
+    Q_D(const MdpClient);
+    return d->retries;
+}
+
+void MdpClient::setTracing(bool enable)
+{
+    Q_D(MdpClient);
+    d->tracing = enable;
+}
+
+bool MdpClient::tracing() const
+{
+    Q_D(const MdpClient);
+    return d->tracing;
+}
+
+void MdpClient::setTag(const QString &tag)
+{
+    Q_D(MdpClient);
+    d->tag = tag;
+}
+
+QString MdpClient::tag() const
+{
+    Q_D(const MdpClient);
+    return d->tag;
+}
+
+int MdpClient::pending() const
+{
+    Q_D(const MdpClient);
+    return d->pending.size();
+}
+
 void MdpClient::setVerbose(bool v)
 {
     Q_D(MdpClient);
@@ -71,10 +191,9 @@ bool MdpClient::connectToBroker()
     if(d->client)
     {
         // for reconnect
-        Context* c = d->client->context();
-        c->closeSocket(d->client);
+        d->client->context()->closeSocket(d->client);
         delete d->client;
-        d->client = c->createSocket(ZMQ_DEALER);
+        d->client = d->context->createSocket(ZMQ_DEALER, d->broker, d->tag);
 
         int rc = d->client->attach(d->broker.toLocal8Bit().data(), false);
         if(d->verbose)
@@ -85,11 +204,47 @@ bool MdpClient::connectToBroker()
     return false;
 }
 
+//  Same as send, with extended header: priority (0 is normal, higher
+//  goes first) and timeout in msecs after which the broker NAKs the
+//  request if no worker took it
+
+bool MdpClient::send(const QString &service, Messages *request,
+                     int priority, int timeout)
+{
+    if(!request) return false;
+    Q_D(MdpClient);
+
+    //  Frame 1: empty frame (delimiter)
+    //  Frame 2: "QMDPCX1" (MDP/Client extended)
+    //  Frame 3: Service name (printable string)
+    //  Frame 4: options, priority (1 byte) and timeout (4 bytes)
+    byte options [5];
+    options [0] = (byte) qBound(0, priority, 255);
+    options [1] = (byte) ((timeout >> 24) & 255);
+    options [2] = (byte) ((timeout >> 16) & 255);
+    options [3] = (byte) ((timeout >> 8) & 255);
+    options [4] = (byte) (timeout & 255);
+    if (d->tracing)
+        Trace::begin(*request, ++d->sequence);
+    request->push(options, 5);
+    request->push(service);
+    request->push(QMDPCX);
+    request->push("");
+    if (d->verbose) {
+        qDebug("I: send request to '%s' service, priority %d:",
+               service.toLatin1().data(), priority);
+    }
+    return request->send(*d->client) == 0;
+}
+
 bool MdpClient::send(const QString &service, Messages *request)
 {
     if(!request) return false;
     Q_D(MdpClient);
 
+    if (d->tracing)
+        Trace::begin(*request, ++d->sequence);
+
     //  Prefix request with protocol frames
     //  Frame 1: empty frame (delimiter)
     //  Frame 2: "QMDPCxy" (six bytes, MDP/Client x.y)
@@ -153,6 +308,244 @@ void MdpClient::startTest()
     QtConcurrent::run(this, &MdpClient::testRun);
 }
 
+//  ---------------------------------------------------------------------
+//  Asynchronous requests. Each request gets a correlation id, sent in
+//  the options frame of the extended header; the broker hands it to the
+//  worker in the reply envelope and returns it in front of the reply
+//  body, so any number of requests can be in flight at once.
+
+MdpReply *MdpClient::request(const QString &service, Messages *request, int priority)
+{
+    if(!request) return 0;
+    Q_D(MdpClient);
+
+    MdpReply *reply = new MdpReply;
+    MdpReplyPrivate *r = reply->d_func();
+    r->client = d;
+    r->id = ++d->sequence;
+    r->service = service;
+    r->retries = d->retries;
+    //  Priority travels in the request so resends keep it
+    r->request = *request;
+    if (d->tracing)
+        Trace::begin(r->request, r->id);
+    byte options [9];
+    options [0] = (byte) qBound(0, priority, 255);
+    memset (options + 1, 0, 4);     //  Broker default timeout
+    options [5] = (byte) ((r->id >> 24) & 255);
+    options [6] = (byte) ((r->id >> 16) & 255);
+    options [7] = (byte) ((r->id >> 8) & 255);
+    options [8] = (byte) (r->id & 255);
+    r->request.push(options, 9);
+    r->request.push(service);
+    r->request.push(QMDPCX);
+    r->request.push("");
+
+    d->pending.insert(r->id, reply);
+    if (d->sendRequest(reply) != 0) {
+        d->pending.remove(r->id);
+        r->client = 0;
+        r->status = MdpReply::Failed;
+    }
+    return reply;
+}
+
+int MdpClientPrivate::sendRequest(MdpReply *reply)
+{
+    MdpReplyPrivate *r = reply->d_func();
+    r->deadline = clock_mono() + timeout;
+    deadlines.enqueue(qMakePair(r->deadline, r->id));
+    if (verbose)
+        qDebug("I: send request %u to '%s' service",
+               r->id, r->service.toLatin1().data());
+
+    //  Keep the request for resends, unless there won't be any
+    if (r->retries == 0)
+        return r->request.send(*client);
+    Messages copy(r->request);
+    return copy.send(*client);
+}
+
+//  Resend or time out requests past their deadline
+
+void MdpClientPrivate::expire(QList<MdpReply*>& timed_out)
+{
+    qint64 now = clock_mono();
+    while (!deadlines.isEmpty() && deadlines.head().first <= now) {
+        QPair<qint64, quint32> entry = deadlines.dequeue();
+        MdpReply *reply = pending.value(entry.second, 0);
+        if (!reply || reply->d_func()->deadline != entry.first)
+            continue;           //  Finished or resent since
+
+        MdpReplyPrivate *r = reply->d_func();
+        if (r->retries > 0) {
+            if (verbose)
+                qDebug("W: no reply to request %u, retrying...", r->id);
+            r->retries--;
+            if (sendRequest(reply) == 0)
+                continue;
+        }
+        pending.remove(r->id);
+        r->client = 0;
+        r->status = MdpReply::TimedOut;
+        r->request.clear();
+        timed_out.append(reply);
+    }
+}
+
+//  Wait up to timeout msecs for replies, -1 waits for the next one and 0
+//  only takes what is there; returns the number of requests finished,
+//  or -1 if interrupted.
+
+int MdpClient::process(int timeout)
+{
+    Q_D(MdpClient);
+    int finished = 0;
+    qint64 until = timeout >= 0 ? clock_mono() + timeout : 0;
+    while (true) {
+        if (timeout < 0 && d->pending.isEmpty())
+            break;              //  Nothing to wait for
+
+        qint64 now = clock_mono();
+        long wait = timeout >= 0 ? qMax(long(until - now), 0L) : -1;
+        if (!d->deadlines.isEmpty()) {
+            long due = qMax(long(d->deadlines.head().first - now), 0L);
+            if (wait < 0 || due < wait)
+                wait = due;
+        }
+        zmq_pollitem_t items [] = { { d->client->resolve(), 0, ZMQ_POLLIN, 0 } };
+        if (zmq_poll (items, 1, wait) == -1)
+            return -1;          //  Interrupted
+
+        while (d->client->events() & ZMQ_POLLIN) {
+            Messages msgs;
+            msgs.recv(*d->client);
+            if (msgs.size() == 0)
+                return -1;      //  Interrupted
+            if (msgs.size() < 5)
+                continue;
+
+            //  Frame 1: empty frame (delimiter)
+            //  Frame 2: "QMDPCX1" (MDP/Client extended)
+            //  Frame 3: REPORT|NAK
+            //  Frame 4: Service name (printable string)
+            //  Frame 5: Correlation id
+            //  Frame 6..n: Application frames
+            msgs.popstr();
+            if (msgs.popstr() != QMDPCX) {
+                if (d->verbose)
+                    qDebug("W: dropping reply without correlation id");
+                continue;
+            }
+            QString command = msgs.popstr();
+            QString service = msgs.popstr();
+            Frame *correlation = msgs.pop();
+            quint32 id = 0;
+            if (correlation->size() == 4) {
+                const byte *data = (const byte *) correlation->constData();
+                id = (data [0] << 24) | (data [1] << 16) | (data [2] << 8) | data [3];
+            }
+            delete correlation;
+
+            MdpReply *reply = d->pending.take(id);
+            if (!reply)
+                continue;       //  Late reply to a resent request
+            MdpReplyPrivate *r = reply->d_func();
+            r->client = 0;
+            r->status = command == MDPC_REPORT ? MdpReply::Finished : MdpReply::Rejected;
+            Frame *trace = Trace::take(msgs);
+            if (trace) {
+                Trace::stamp(trace, Trace::ClientReceive);
+                r->trace = trace->bdata();
+                delete trace;
+            }
+            r->report = msgs;
+            r->request.clear();
+            if (d->verbose)
+                qDebug("I: received reply %u from '%s' service",
+                       id, service.toLatin1().data());
+            finished++;
+            emit reply->finished();
+            emit replied(reply);
+        }
+        QList<MdpReply*> timed_out;
+        d->expire(timed_out);
+        foreach (MdpReply *reply, timed_out) {
+            finished++;
+            emit reply->finished();
+            emit replied(reply);
+        }
+
+        if (finished || (timeout >= 0 && clock_mono() >= until))
+            break;
+    }
+    return finished;
+}
+
+MdpReply::MdpReply() : d_ptr(new MdpReplyPrivate)
+{}
+
+MdpReply::~MdpReply()
+{
+    Q_D(MdpReply);
+    if (d->client)
+        d->client->pending.remove(d->id);
+    delete d_ptr;
+}
+
+MdpReply::Status MdpReply::status() const
+{
+    Q_D(const MdpReply);
+    return d->status;
+}
+
+bool MdpReply::isFinished() const
+{
+    Q_D(const MdpReply);
+    return d->status != Pending;
+}
+
+quint32 MdpReply::id() const
+{
+    Q_D(const MdpReply);
+    return d->id;
+}
+
+QString MdpReply::service() const
+{
+    Q_D(const MdpReply);
+    return d->service;
+}
+
+QByteArray MdpReply::trace() const
+{
+    Q_D(const MdpReply);
+    return d->trace;
+}
+
+Messages MdpReply::messages() const
+{
+    Q_D(const MdpReply);
+    return d->report;
+}
+
+//  Run the client until this reply comes in, other replies are delivered
+//  on the way; returns false on timeout, -1 waits as long as it takes
+
+bool MdpReply::waitForFinished(MdpClient *client, int msecs)
+{
+    Q_D(MdpReply);
+    qint64 until = clock_mono() + msecs;
+    while (d->status == Pending) {
+        int wait = msecs >= 0 ? int(until - clock_mono()) : -1;
+        if (msecs >= 0 && wait <= 0)
+            break;
+        if (client->process(wait) == -1)
+            break;
+    }
+    return d->status != Pending;
+}
+
 
 /*
  * Worker implementation
@@ -164,19 +557,38 @@ public:
     MdpWorkerPrivate(Context* ctx) {
         heartbeat = 2500;
         reconnect = 2500;
+        concurrency = 1;
         verbose = false;
-        if(ctx)
-            worker = ctx->createSocket(ZMQ_DEALER);
-        else worker = srnet->createSocket(ZMQ_DEALER);
+        tracing = false;
+        context = ctx ? ctx : srnet;
+        worker = context->createSocket(ZMQ_DEALER);
     }
     ~MdpWorkerPrivate() {
+        pool.waitForDone();
         delete worker;
     }
 
+    Context* context;           //  Places the sockets by tag
+    QString tag;                //  Placement tag
     Socket* worker;
     QString broker;
     QString service;
     bool verbose;
+    volatile bool tracing;      //  Stamp worker hops on trace trailers
+
+    //  Correlation ids and trace trailers of requests being served, by
+    //  reply address
+    QHash<QString, QQueue<QByteArray> > correlations;
+    QHash<QString, QQueue<QByteArray> > traces;
+
+    //  Event-driven mode: handlers run on the pool and push reports
+    //  back to the I/O thread, each pool thread on its own socket.
+    //  Storage goes before pool so pool threads are joined first.
+    int concurrency;            //  Handler threads, and credit at broker
+    QString reports;            //  Endpoint the I/O thread pulls from
+    QThreadStorage<Socket*> report_socket;
+    QThreadPool pool;
+    QAtomicInt terminated;
 
     //  Heartbeat management
     QTime heartbeat_at;      //  When to send HEARTBEAT
@@ -256,26 +668,68 @@ int MdpWorker::liveness() const
     return d->liveness;
 }
 
+void MdpWorker::setConcurrency(int threads)
+{
+    Q_D(MdpWorker);
+    d->concurrency = qMax(threads, 1);
+}
+
+int MdpWorker::concurrency() const
+{
+    Q_D(const MdpWorker);
+    return d->concurrency;
+}
+
 void MdpWorker::setVerbose(bool v)
 {
     Q_D(MdpWorker);
     d->verbose = v;
 }
 
+void MdpWorker::setTracing(bool enable)
+{
+    Q_D(MdpWorker);
+    d->tracing = enable;
+}
+
+bool MdpWorker::tracing() const
+{
+    Q_D(const MdpWorker);
+    return d->tracing;
+}
+
+void MdpWorker::setTag(const QString &tag)
+{
+    Q_D(MdpWorker);
+    d->tag = tag;
+}
+
+QString MdpWorker::tag() const
+{
+    Q_D(const MdpWorker);
+    return d->tag;
+}
+
 bool MdpWorker::connectToBroker()
 {
     Q_D(MdpWorker);
 
     if(d->worker)
     {
-        Context* c = d->worker->context();
         delete d->worker;
-        d->worker = c->createSocket(ZMQ_DEALER);
+        d->worker = d->context->createSocket(ZMQ_DEALER, d->broker, d->tag);
         d->worker->attach(d->broker.toLocal8Bit().data(), false);
         if(d->verbose)
             qDebug() << "I: connecting to broker at " << d->broker << " ....";
 
-        sendToBroker(MDPW_READY, d->service, NULL);
+        //  Tell the broker how many requests we take at once
+        if (d->concurrency > 1) {
+            Messages credit;
+            credit.append("%d", d->concurrency);
+            sendToBroker(MDPW_READY, d->service, &credit);
+        }
+        else
+            sendToBroker(MDPW_READY, d->service, NULL);
         d->liveness = HEARTBEAT_LIVENESS;
         d->heartbeat_at = QTime::currentTime().addMSecs(d->heartbeat);
     }
@@ -303,15 +757,38 @@ bool MdpWorker::sendToBroker(const QString &command, const QString &option, Mess
         qDebug("I: sending %s to broker",
                     mdpw_commands [command.toInt()]);
 
+    //  Broker takes any message as a heartbeat
+    if(rc == 0)
+        d->heartbeat_at = QTime::currentTime().addMSecs(d->heartbeat);
+
     return rc == 0;
 }
 
 bool MdpWorker::sendToClient(const QString &reply, Messages *report)
 {
     if(!report || reply.isNull()) return false;
+    Q_D(MdpWorker);
 
     Messages rep_p(*report);
-    rep_p.wrap(new Frame(reply.toLocal8Bit().data()));
+    //  A traced request gets its trailer back, at the end of the report
+    QHash<QString, QQueue<QByteArray> >::iterator trace = d->traces.find(reply);
+    if (trace != d->traces.end()) {
+        Frame *trailer = new Frame(trace->dequeue());
+        if (d->tracing)
+            Trace::stamp(trailer, Trace::WorkerReply);
+        rep_p.append(trailer);
+        if (trace->isEmpty())
+            d->traces.erase(trace);
+    }
+    rep_p.push("", 0);
+    //  A correlated request gets its id back in the envelope
+    QHash<QString, QQueue<QByteArray> >::iterator it = d->correlations.find(reply);
+    if (it != d->correlations.end()) {
+        rep_p.push(new Frame(it->dequeue()));
+        if (it->isEmpty())
+            d->correlations.erase(it);
+    }
+    rep_p.push(new Frame(reply.toLocal8Bit().data()));
     return sendToBroker(MDPW_REPORT, NULL, &rep_p);
 }
 
@@ -360,11 +837,23 @@ void MdpWorker::recv(QString &replyAdd, Messages &rmsg)
             QString command = msg.popstr();
             if (command == MDPW_REQUEST) {
                 //  We should pop and save as many addresses as there are
-                //  up to a null part, but for now, just save one...
-                Frame *reply_to = msg.unwrap();
+                //  up to a null part, but for now, just save one, and the
+                //  correlation id if the client sent one
+                Frame *correlation;
+                Frame *reply_to = s_unwrap_client(&msg, &correlation);
                 //emit replyTo(*reply);
                 replyAdd = reply_to->toString();
+                if (correlation)
+                    d->correlations [replyAdd].enqueue(correlation->bdata());
+                delete correlation;
                 delete reply_to;
+                Frame *trace = Trace::take(msg);
+                if (trace) {
+                    if (d->tracing)
+                        Trace::stamp(trace, Trace::WorkerReceive);
+                    d->traces [replyAdd].enqueue(trace->bdata());
+                    delete trace;
+                }
 
                 //  Here is where we actually have a message to process; we
                 //  return it to the caller application
@@ -401,111 +890,662 @@ void MdpWorker::startTest()
     QtConcurrent::run(this, &MdpWorker::testRun);
 }
 
+//  Default handler echoes the request
 
-/*
- * Broker implementation
- *
- * ************************************************/
+void MdpWorker::process(Messages &request, Messages &report)
+{
+    report = request;
+}
 
-class Worker_t;
-class Service_t {
+//  One request on the pool. The envelope is kept as frames, so binary
+//  client addresses and correlation ids go back untouched.
+
+class MdpTask : public QRunnable {
 public:
-    Service_t(MdpBrokerPrivate* b)
-    { broker = b; }
+    MdpTask(MdpWorker* w, MdpWorkerPrivate* d) {
+        worker = w;
+        d_ptr = d;
+        reply_to = correlation = trace = NULL;
+    }
+    ~MdpTask() {
+        delete reply_to;
+        delete correlation;
+        delete trace;
+    }
 
-    void dispatch();
-    void enableCommand(const QString& cmd);
-    void disableCommand(const QString& cmd);
-    bool isCommandEnabled(const QString& cmd);
+    void run() {
+        Messages report;
+        worker->process(request, report);
 
-    QString name;
-    MdpBrokerPrivate* broker;
+        //  Trace trailer goes back at the end of the report
+        if (trace) {
+            if (d_ptr->tracing)
+                Trace::stamp(trace, Trace::WorkerReply);
+            report.append(trace);
+            trace = NULL;
+        }
 
-    QList<Messages*> requests;
-    QList<Worker_t*> waiting;
-    QStringList blacklisted;
+        //  Report goes to the I/O thread wrapped in the client envelope
+        report.push("", 0);
+        if (correlation) {
+            report.push(correlation);
+            correlation = NULL;
+        }
+        report.push(reply_to);
+        reply_to = NULL;
+
+        if (!d_ptr->report_socket.hasLocalData()) {
+            Socket *socket = d_ptr->context->createSocket(ZMQ_PUSH, d_ptr->reports,
+                                                          d_ptr->tag);
+            socket->connect("%s", d_ptr->reports.toLatin1().data());
+            d_ptr->report_socket.setLocalData(socket);
+        }
+        report.send(*d_ptr->report_socket.localData());
+    }
+
+    MdpWorker* worker;
+    MdpWorkerPrivate* d_ptr;
+    Frame* reply_to;
+    Frame* correlation;
+    Frame* trace;
+    Messages request;
 };
 
-class Worker_t {
-public:
-    Worker_t(MdpBrokerPrivate* b) { broker = b; }
+//  ---------------------------------------------------------------------
+//  Event-driven mode. The calling thread does all broker I/O and
+//  heartbeats, requests run through process() on concurrency threads,
+//  and the broker is told it may send that many at once. Returns when
+//  stop() is called or the socket is interrupted.
 
-    void remove(bool disconnect);
-    bool send(const QString& command, const QString& option, Messages* msgs);
+void MdpWorker::serve()
+{
+    Q_D(MdpWorker);
+    d->terminated = 0;
+    d->pool.setMaxThreadCount(d->concurrency);
 
-    MdpBrokerPrivate* broker;
-    QString identity;           //  Identity of worker
-    QString address;            //  Address frame to route to
-    Service_t *service;         //  Owning service, if known
-    QTime expiry;             //  Expires at unless heartbeat
-};
+    //  Same endpoint and tag as the pushing ends, so they share a context
+    d->reports = QString("inproc://mdpworker-%1").arg(quintptr(d), 0, 16);
+    Socket *reports = d->context->createSocket(ZMQ_PULL, d->reports, d->tag);
+    reports->bind("%s", d->reports.toLatin1().data());
 
-/*
- *
- * */
+    connectToBroker();
+    int generation = 0;
+    while (!d->terminated) {
+        zmq_pollitem_t items [] = {
+            { d->worker->resolve(), 0, ZMQ_POLLIN, 0 },
+            { reports->resolve(), 0, ZMQ_POLLIN, 0 }
+        };
+        int rc = zmq_poll(items, 2, d->heartbeat);
+        if (rc == -1)
+            break;              //  Interrupted
 
-class MdpBrokerPrivate {
-public:
-    MdpBrokerPrivate(Context* ctx) {
-        if(ctx)
-            broker = ctx->createSocket(ZMQ_ROUTER);
-        else broker = srnet->createSocket(ZMQ_ROUTER);
+        if (items [0].revents & ZMQ_POLLIN) {
+            Messages msg;
+            msg.recv(*d->worker);
+            if (msg.size() == 0)
+                break;          //  Interrupted
+            d->liveness = HEARTBEAT_LIVENESS;
 
-        verbose = false;
-        heartbeat_at = QTime::currentTime().addMSecs(HEARTBEAT_INTERVAL);
-    }
-    ~MdpBrokerPrivate() {
-        delete broker;
-        foreach (Service_t* s, ls_services.values()) {
-            delete s;
+            //  Don't try to handle errors, just assert noisily
+            assert (msg.size() >= 3);
+            msg.popstr();
+            QString header = msg.popstr();
+            assert (header == QMDPW);
+
+            QString command = msg.popstr();
+            if (command == MDPW_REQUEST) {
+                MdpTask *task = new MdpTask(this, d);
+                task->reply_to = s_unwrap_client(&msg, &task->correlation);
+                task->trace = Trace::take(msg);
+                if (task->trace && d->tracing)
+                    Trace::stamp(task->trace, Trace::WorkerReceive);
+                task->request = msg;
+                d->pool.start(task);
+            }
+            else
+            if (command == MDPW_HEARTBEAT)
+                ;               //  Do nothing for heartbeats
+            else
+            if (command == MDPW_DISCONNECT)
+                connectToBroker();
+            else {
+                qDebug("E: invalid input message");
+            }
+        }
+        else
+        if (rc == 0 && --d->liveness == 0) {
+            if (d->verbose)
+                qDebug("W: disconnected from broker - retrying...");
+            QThread::msleep(d->reconnect);
+            connectToBroker();
         }
 
-        foreach (Worker_t* w, ls_workers) {
-            delete w;
+        //  Forward finished reports
+        while (reports->events() & ZMQ_POLLIN) {
+            Messages report;
+            report.recv(*reports);
+            sendToBroker(MDPW_REPORT, NULL, &report);
+        }
+
+        //  Send HEARTBEAT if it's time
+        if (QTime::currentTime() > d->heartbeat_at) {
+            sendToBroker(MDPW_HEARTBEAT, NULL, NULL);
+            d->heartbeat_at = QTime::currentTime().addMSecs(d->heartbeat);
+        }
+
+        if (QMNet::configChanged(generation)) {
+            srnet->applyConfig(d->worker);
+            srnet->applyConfig(reports);
         }
     }
-    Service_t* requireService(const QString& name);
-    Worker_t* requireWorker(Frame *ident);
 
-    void workerMessage(Frame* sender, Messages* msgs);
-    //  Process a request coming from a client. We implement MMI requests
-    //  directly here (at present, we implement only the mmi.service request)
+    //  Let running handlers finish, and send what they report
+    d->pool.waitForDone();
+    while (reports->events() & ZMQ_POLLIN) {
+        Messages report;
+        report.recv(*reports);
+        sendToBroker(MDPW_REPORT, NULL, &report);
+    }
+    context->closeSocket(reports);
+    delete reports;
+}
 
-    void clientMessage(Frame *sender, Messages *msg);
+void MdpWorker::stop()
+{
+    Q_D(MdpWorker);
+    d->terminated = 1;
+}
 
-    //  The purge method deletes any idle workers that haven't pinged us in a
-    //  while. We hold workers from oldest to most recent, so we can stop
-    //  scanning whenever we find a live worker. This means we'll mainly stop
-    //  at the first worker, which is essential when we have large numbers of
-    //  workers (since we call this method in our critical path)
-    void purge();
 
-    Socket* broker;
+/*
+ * Broker implementation
+ *
+ * ************************************************/
+
+//  Protocol frames are built once. They are small enough for zmq to keep
+//  inline, so QFRAME_REUSE sends a copy of a few bytes, with no allocation,
+//  and several broker threads can share them.
+
+static Frame s_empty_frame;
+static Frame s_mdpc_frame(QMDPC, 7);
+static Frame s_mdpcx_frame(QMDPCX, 7);
+static Frame s_mdpw_frame(QMDPW, 7);
+static Frame s_mdpc_command [] = {
+    Frame(), Frame(MDPC_REQUEST, 1), Frame(MDPC_REPORT, 1), Frame(MDPC_NAK, 1)
+};
+static Frame s_mdpw_command [] = {
+    Frame(), Frame(MDPW_READY, 1), Frame(MDPW_REQUEST, 1), Frame(MDPW_REPORT, 1),
+    Frame(MDPW_HEARTBEAT, 1), Frame(MDPW_DISCONNECT, 1)
+};
+
+class MdpShard;
+class Worker_t;
+
+//  Link of a worker in one intrusive list; a worker has one link for
+//  each list it can be on, so taking it off a list is O(1)
+class WorkerLink {
+public:
+    WorkerLink() { prev = next = 0; linked = false; }
+
+    Worker_t *prev;
+    Worker_t *next;
+    bool linked;
+};
+
+class WorkerList {
+public:
+    WorkerList(WorkerLink Worker_t::*l) {
+        link = l;
+        first = last = 0;
+        count = 0;
+    }
+
+    void append(Worker_t* worker);
+    void remove(Worker_t* worker);
+    Worker_t* takeFirst();
+    Worker_t* next(Worker_t* worker) const;
+
+    WorkerLink Worker_t::*link;     //  Which link of worker we use
+    Worker_t *first;
+    Worker_t *last;
+    int count;
+};
+
+//  Queued client request, msg is wrapped in the client envelope
+class Request_t {
+public:
+    Messages* msg;
+    int priority;               //  0 .. MDP_PRIORITIES - 1, higher first
+    qint64 queued_at;           //  When it came in, clock_mono
+    qint64 deadline;            //  NAK if not dispatched by then, 0 = never
+};
+
+class Service_t {
+public:
+    Service_t(MdpShard* b);
+    ~Service_t();
+
+    void dispatch();
+    void offer(Worker_t* worker);
+    void withdraw(Worker_t* worker);
+    Worker_t* leastLoaded();
+    bool enqueue(Request_t* request);
+    void nak(Request_t* request);
+    qint64 expire(qint64 now);
+    qint64 oldest(qint64 now);
+
+    void enableCommand(const QString& cmd);
+    void disableCommand(const QString& cmd);
+    bool isCommandEnabled(const QString& cmd);
+
+    QString name;
+    QByteArray name_data;       //  Service name as sent on the wire
+    MdpShard* broker;
+
+    QQueue<Request_t*> requests [MDP_PRIORITIES];   //  Queue per priority
+    int queued;                 //  Requests in all queues
+    int hwm;                    //  Most requests we queue, 0 = no limit
+    int dropped;                //  Requests shed because queue was full
+    int expired;                //  Requests past deadline
+    //  Workers with free credit, idle [n] holds those with n requests
+    //  to go, least recently used first; idle [0] stays empty
+    QList<WorkerList*> idle;
+    int top;                    //  No worker has more free credit
+    int available;              //  Workers with free credit
+    int workers;                //  Workers of this service
+    QStringList blacklisted;
+};
+
+class Worker_t {
+public:
+    Worker_t(MdpShard* b) {
+        broker = b;
+        service = 0;
+        expiry = 0;
+        sent_at = 0;
+        dispatched_at = 0;
+        credit = 1;
+        inflight = 0;
+    }
+
+    void remove(bool disconnect);
+    bool expired(qint64 now) const;
+    bool send(const char* command, const QString& option, Messages* msgs);
+
+    MdpShard* broker;
+    QString identity;           //  Identity of worker, printable
+    QByteArray address;         //  Address frame to route to
+    Service_t *service;         //  Owning service, if known
+    qint64 expiry;              //  Expires at unless heartbeat, clock_mono
+    qint64 sent_at;             //  Last message to it, clock_mono
+    qint64 dispatched_at;       //  Last request to it, clock_mono
+    int credit;                 //  Requests it takes at once, from READY
+    int inflight;               //  Requests sent and not reported yet
+    WorkerLink expiry_link;     //  In broker expiry list
+    WorkerLink waiting_link;    //  In broker waiting list
+    WorkerLink service_link;    //  In service idle list
+};
+
+void WorkerList::append(Worker_t *worker)
+{
+    WorkerLink &l = worker->*link;
+    if (l.linked)
+        return;
+    l.prev = last;
+    l.next = 0;
+    if (last)
+        (last->*link).next = worker;
+    else
+        first = worker;
+    last = worker;
+    l.linked = true;
+    count++;
+}
+
+void WorkerList::remove(Worker_t *worker)
+{
+    WorkerLink &l = worker->*link;
+    if (!l.linked)
+        return;
+    if (l.prev)
+        (l.prev->*link).next = l.next;
+    else
+        first = l.next;
+    if (l.next)
+        (l.next->*link).prev = l.prev;
+    else
+        last = l.prev;
+    l.prev = l.next = 0;
+    l.linked = false;
+    count--;
+}
+
+Worker_t *WorkerList::takeFirst()
+{
+    Worker_t *worker = first;
+    if (worker)
+        remove(worker);
+    return worker;
+}
+
+Worker_t *WorkerList::next(Worker_t *worker) const
+{
+    return (worker->*link).next;
+}
+
+/*
+ *
+ * */
+
+//  A shard owns a set of services and their workers. With one shard it
+//  works on the broker ROUTER itself. With more, each shard runs in its
+//  own thread behind a PAIR: the front thread passes whole messages in,
+//  and sends whatever comes back out of the ROUTER.
+
+class MdpShard : public QThread {
+public:
+    MdpShard(Socket* sock, bool thr)
+        : ls_waitings(&Worker_t::waiting_link),
+          ls_expiry(&Worker_t::expiry_link) {
+        socket = sock;
+        threaded = thr;
+        verbose = false;
+        heartbeat_at = clock_mono() + HEARTBEAT_INTERVAL;
+        deadline_at = 0;
+        queue_hwm = MDP_QUEUE_HWM;
+        request_timeout = 0;
+        tracing = 0;
+    }
+    ~MdpShard() {
+        if (threaded)
+            delete socket;
+        foreach (Service_t* s, ls_services.values()) {
+            delete s;
+        }
+
+        foreach (Worker_t* w, ls_workers) {
+            delete w;
+        }
+    }
+    Service_t* requireService(const QString& name);
+    Worker_t* requireWorker(Frame *ident);
+
+    //  Process one message from the ROUTER, takes ownership of msgs
+    void process(Messages* msgs);
+
+    //  Both take ownership of sender and msgs
+    void workerMessage(Frame* sender, Messages* msgs);
+    //  Process a request coming from a client. We implement MMI requests
+    //  directly here (at present, we implement only the mmi.service request)
+
+    void clientMessage(Frame *sender, Messages *msg, bool extended);
+
+    //  Reply to mmi.stats for one service
+    void serviceStats(const QString& name, Messages* reply);
+
+    //  NAK requests past deadline, when the earliest deadline is due
+    void expireRequests();
+
+    //  Time until next heartbeat or request deadline, for poll
+    long timeout();
+
+    //  Send report or NAK to client: envelope and protocol frames go out
+    //  as they are, then the body
+    int sendClient(Frame* client, const char* command,
+                   const QByteArray& service, Messages* body,
+                   Frame* correlation = NULL);
+
+    //  The purge method deletes any idle workers that haven't pinged us in a
+    //  while. Every expiry is now + HEARTBEAT_EXPIRY, so moving a worker to
+    //  the newest end when it pings keeps the list ordered by expiry, and
+    //  purge stops at the first live worker.
+    void purge();
+    void touchWorker(Worker_t* worker);
+
+    //  Purge and send heartbeats to idle workers, if it is time
+    void heartbeat();
+
+    //  Tell front thread a worker is gone, so it can drop its route
+    void forget(const QByteArray& address);
+
+    //  Shard thread, until front sends $TERM
+    void run();
+
+    Socket* socket;             //  Broker ROUTER, or PAIR to front thread
+    bool threaded;              //  Running in own thread
     QHash<QString, Service_t*> ls_services;
-    QHash<QString, Worker_t*> ls_workers;
-    QList<Worker_t*> ls_waitings;
-    QTime heartbeat_at;
+    QHash<QByteArray, Worker_t*> ls_workers;    //  Workers, by address
+    WorkerList ls_waitings;     //  Ready workers, get heartbeats
+    WorkerList ls_expiry;       //  Ready workers, oldest expiry first
+    qint64 heartbeat_at;
+    qint64 deadline_at;         //  Earliest request deadline, 0 = none
+    int queue_hwm;              //  Queue limit of new services
+    QHash<QString, int> service_hwm;    //  Queue limit per service
+    int request_timeout;        //  Deadline for requests without one
+    volatile bool *tracing;     //  Stamp broker hops, owned by broker
+    bool verbose;
+};
+
+class MdpBrokerPrivate {
+public:
+    MdpBrokerPrivate(Context* ctx) {
+        context = ctx ? ctx : srnet;
+        broker = context->createSocket(ZMQ_ROUTER);
+        bound = false;
+        shard_count = 1;
+        queue_hwm = MDP_QUEUE_HWM;
+        request_timeout = 0;
+        tracing = false;
+        verbose = false;
+    }
+    ~MdpBrokerPrivate() {
+        future.waitForFinished();
+        foreach (MdpShard* shard, shards) {
+            shard->wait();
+            delete shard;
+        }
+        qDeleteAll(pipes);
+        delete broker;
+    }
+
+    void createShards();
+    void configure(MdpShard* shard);
+    int shardOf(Frame* service) const;
+    void route(Messages& msgs);
+    void runFront(volatile bool* terminated);
+
+    Context* context;
+    QString tag;                //  Placement tag
+    Socket* broker;
+    bool bound;                 //  Placed by first endpoint
+    int shard_count;            //  Shards asked for
+    int queue_hwm;              //  Queue limit, for shards
+    QHash<QString, int> service_hwm;
+    int request_timeout;
+    QList<MdpShard*> shards;
+    QList<Socket*> pipes;       //  Front ends of shard PAIRs
+    QHash<QByteArray, int> worker_shards;   //  Shard of each worker
+    QFuture<void> future;       //  Broker thread
+    volatile bool tracing;      //  Shared by all shards
     bool verbose;
 };
 
 // service
 
+Service_t::Service_t(MdpShard *b)
+{
+    broker = b;
+    queued = 0;
+    hwm = MDP_QUEUE_HWM;
+    dropped = expired = 0;
+    idle.append(new WorkerList(&Worker_t::service_link));
+    top = 0;
+    available = workers = 0;
+}
+
+Service_t::~Service_t()
+{
+    qDeleteAll(idle);
+    for (int priority = 0; priority < MDP_PRIORITIES; priority++) {
+        foreach (Request_t* request, requests [priority]) {
+            delete request->msg;
+            delete request;
+        }
+    }
+}
+
 void Service_t::dispatch()
 {
-    broker->purge();
-    if(waiting.size() == 0) return;
+    //  No purge here; a worker that expired since the last purge is
+    //  dropped when its turn comes
+    qint64 now = clock_mono();
+    int priority = MDP_PRIORITIES - 1;
+    while(queued > 0 && available > 0) {
+        while (requests [priority].isEmpty())
+            priority--;
+        Request_t* request = requests [priority].dequeue();
+        queued--;
+        if (request->deadline && request->deadline <= now) {
+            nak(request);
+            expired++;
+            continue;
+        }
 
-    while(requests.size() > 0) {
-        Worker_t* worker = waiting.takeFirst();
-        waiting.removeOne(worker);
-        Messages* msg = requests.takeFirst();
-        worker->send(MDPW_REQUEST, NULL, msg);
-        //  Workers are scheduled in the round-robin fashion
-        waiting.append(worker);
-        delete msg;
+        Worker_t* worker = leastLoaded();
+        if(worker->expired(now)) {
+            if (broker->verbose)
+                qDebug() << "I: deleting expired worker: " << worker->identity;
+            worker->remove(false);
+            requests [priority].prepend(request);
+            queued++;
+            continue;
+        }
+        if (*broker->tracing)
+            Trace::stamp(*request->msg, Trace::BrokerDispatch);
+        worker->send(MDPW_REQUEST, NULL, request->msg);
+        worker->dispatched_at = now;
+        //  Back in line with one credit less; workers with the same
+        //  free credit take turns
+        worker->inflight++;
+        offer(worker);
+        delete request->msg;
+        delete request;
     }
 }
 
+//  Put worker in line by its free credit, if it has any
+
+void Service_t::offer(Worker_t *worker)
+{
+    int free = worker->credit - worker->inflight;
+    if (free <= 0)
+        return;
+    while (idle.size() <= free)
+        idle.append(new WorkerList(&Worker_t::service_link));
+    idle [free]->append(worker);
+    if (free > top)
+        top = free;
+    available++;
+}
+
+void Service_t::withdraw(Worker_t *worker)
+{
+    if (!worker->service_link.linked)
+        return;
+    idle [worker->credit - worker->inflight]->remove(worker);
+    available--;
+}
+
+//  Take the worker with most free credit, NULL if all are busy
+
+Worker_t *Service_t::leastLoaded()
+{
+    while (top > 0 && idle [top]->count == 0)
+        top--;
+    if (top == 0)
+        return NULL;
+    available--;
+    return idle [top]->takeFirst();
+}
+
+//  Queue a request. When the queue is full we shed the newest request
+//  of the lowest priority below this one, or else this one, with a NAK.
+//  Returns false if the request was refused.
+
+bool Service_t::enqueue(Request_t *request)
+{
+    if (hwm > 0 && queued >= hwm) {
+        int lowest;
+        for (lowest = 0; lowest < request->priority; lowest++)
+            if (!requests [lowest].isEmpty())
+                break;
+        if (lowest == request->priority) {
+            nak(request);
+            dropped++;
+            return false;
+        }
+        nak(requests [lowest].takeLast());
+        queued--;
+        dropped++;
+    }
+    requests [request->priority].enqueue(request);
+    queued++;
+    if (request->deadline
+    && (!broker->deadline_at || request->deadline < broker->deadline_at))
+        broker->deadline_at = request->deadline;
+    return true;
+}
+
+//  Send NAK for a request we won't serve, and destroy it
+
+void Service_t::nak(Request_t *request)
+{
+    Frame *correlation;
+    Frame *client = s_unwrap_client(request->msg, &correlation);
+    broker->sendClient(client, MDPC_NAK, name_data, request->msg, correlation);
+    delete correlation;
+    delete client;
+    delete request->msg;
+    delete request;
+}
+
+//  NAK requests past deadline, returns earliest deadline left or 0
+
+qint64 Service_t::expire(qint64 now)
+{
+    qint64 next = 0;
+    for (int priority = 0; priority < MDP_PRIORITIES; priority++) {
+        QMutableListIterator<Request_t*> it(requests [priority]);
+        while (it.hasNext()) {
+            Request_t* request = it.next();
+            if (!request->deadline)
+                continue;
+            if (request->deadline <= now) {
+                it.remove();
+                queued--;
+                expired++;
+                nak(request);
+            }
+            else
+            if (!next || request->deadline < next)
+                next = request->deadline;
+        }
+    }
+    return next;
+}
+
+//  Age of oldest queued request, msecs
+
+qint64 Service_t::oldest(qint64 now)
+{
+    qint64 age = 0;
+    for (int priority = 0; priority < MDP_PRIORITIES; priority++) {
+        if (!requests [priority].isEmpty())
+            age = qMax(age, now - requests [priority].head()->queued_at);
+    }
+    return age;
+}
+
 void Service_t::enableCommand(const QString &cmd)
 {
     blacklisted.removeOne(cmd);
@@ -529,75 +1569,132 @@ void Worker_t::remove(bool disconnect)
     if(disconnect)
         send(MDPW_DISCONNECT, NULL, NULL);
 
-    if(service)
-        service->waiting.removeOne(this);
+    if(service) {
+        service->withdraw(this);
+        service->workers--;
+    }
 
-    broker->ls_waitings.removeOne(this);
-    broker->ls_workers.remove(identity);
+    broker->ls_waitings.remove(this);
+    broker->ls_expiry.remove(this);
+    broker->ls_workers.remove(address);
+    broker->forget(address);
     delete this;
 }
 
-bool Worker_t::send(const QString &command, const QString &option, Messages *msgs)
-{
-    msgs = msgs ? msgs : new Messages;
-    if(!option.isNull())
-        msgs->push(option);
+//  Envelope and protocol frames go straight to the socket, then msgs,
+//  which is emptied but stays owned by the caller
 
-    msgs->push(command);
-    msgs->push(QMDPW);
-    msgs->wrap(new Frame(address.toLocal8Bit()));
+bool Worker_t::send(const char *command, const QString &option, Messages *msgs)
+{
+    Socket* socket = broker->socket;
+    int rc = socket->sendmem(address.constData(), address.size(), QFRAME_MORE);
+    if (rc == 0)
+        rc = s_empty_frame.send(*socket, QFRAME_MORE | QFRAME_REUSE);
+    if (rc == 0)
+        rc = s_mdpw_frame.send(*socket, QFRAME_MORE | QFRAME_REUSE);
+
+    bool more = !option.isNull() || (msgs && msgs->size());
+    if (rc == 0)
+        rc = s_mdpw_command [(int) command [0]].send(*socket,
+                    (more ? QFRAME_MORE : 0) | QFRAME_REUSE);
+    if (rc == 0 && !option.isNull())
+        rc = socket->sendstr(option, msgs && msgs->size());
+    if (rc == 0 && msgs && msgs->size())
+        rc = msgs->send(*socket);
+
+    if(rc == 0 && broker->verbose)
+        qDebug("I: sending %s to worker",
+                mdpw_commands [(int) command [0]]);
 
-    int rc = msgs->send(*broker->broker);
     if(rc == 0)
-        qDebug("I: sending %s to broker",
-                mdpw_commands [command.toInt()]);
-
+        sent_at = clock_mono();
     return rc == 0;
 }
 
-Service_t* MdpBrokerPrivate::requireService(const QString &name) {
+//  A worker with requests may not beat while it works on them, it has
+//  HEARTBEAT_BUSY from the last one before we give up on it
+
+bool Worker_t::expired(qint64 now) const
+{
+    if(expiry > now)
+        return false;
+    return inflight == 0 || dispatched_at + HEARTBEAT_BUSY <= now;
+}
+
+Service_t* MdpShard::requireService(const QString &name) {
     Service_t* service = ls_services.value(name, 0);
     if(!service)
     {
         service = new Service_t(this);
         service->name = name;
+        service->name_data = name.toLatin1();
+        service->hwm = service_hwm.value(name, queue_hwm);
         ls_services.insert(name, service);
     }
 
     return service;
 }
 
-Worker_t *MdpBrokerPrivate::requireWorker(Frame *ident)
+Worker_t *MdpShard::requireWorker(Frame *ident)
 {
-    Worker_t* worker = ls_workers.value(ident->hexString(), 0);
+    QByteArray address = ident->bdata();
+    Worker_t* worker = ls_workers.value(address, 0);
     if(!worker)
     {
         worker = new Worker_t(this);
         worker->identity = ident->hexString();
-        worker->address = ident->toString();
-        ls_workers.insert(worker->identity, worker);
+        worker->address = address;
+        ls_workers.insert(address, worker);
         if(verbose)
             qDebug() << "I: registering new worker: " << worker->identity;
     }
     return worker;
 }
 
+//  Correlated replies go with the extended header, and the correlation
+//  id in front of the body
+
+int MdpShard::sendClient(Frame *client, const char *command,
+                         const QByteArray &service, Messages *body,
+                         Frame *correlation)
+{
+    int rc = client->send(*socket, QFRAME_MORE);
+    if (rc == 0)
+        rc = s_empty_frame.send(*socket, QFRAME_MORE | QFRAME_REUSE);
+    if (rc == 0)
+        rc = (correlation ? s_mdpcx_frame : s_mdpc_frame).send(*socket,
+                    QFRAME_MORE | QFRAME_REUSE);
+    if (rc == 0)
+        rc = s_mdpc_command [(int) command [0]].send(*socket, QFRAME_MORE | QFRAME_REUSE);
+    if (rc == 0)
+        rc = socket->sendmem(service.constData(), service.size(),
+                             correlation || body->size() ? QFRAME_MORE : 0);
+    if (rc == 0 && correlation)
+        rc = correlation->send(*socket, body->size() ? QFRAME_MORE : 0);
+    if (rc == 0)
+        rc = body->send(*socket);
+    return rc;
+}
+
 /*
  *
  * *****/
 
-void MdpBrokerPrivate::workerMessage(Frame *sender, Messages *msgs)
+void MdpShard::workerMessage(Frame *sender, Messages *msgs)
 {
     assert(msgs->size() >= 1);
 
-    QString command = msgs->popstr();
-    QString ident = sender->hexString();
-    bool worker_ready = ls_workers.value(ident, 0) != 0;
+    Frame *command_frame = msgs->pop();
+    char command = command_frame->size() == 1
+                 ? *(const char *) command_frame->constData() : 0;
+    delete command_frame;
+    bool worker_ready = ls_workers.contains(QByteArray::fromRawData(
+                (const char *) sender->constData(), sender->size()));
     Worker_t* worker = requireWorker(sender);
 
-    if(command == MDPW_READY) {
-        if(worker_ready)
-            delete worker;
+    if(command == MDPW_READY [0]) {
+        if(worker_ready)            //  Not first command in session
+            worker->remove(true);
         else if(sender->size() >= 4  //  Reserved service name
                 && memcmp (sender->data(), "mmi.", 4) == 0)
             worker->remove(true);
@@ -605,66 +1702,114 @@ void MdpBrokerPrivate::workerMessage(Frame *sender, Messages *msgs)
         {
             QString service_frame = msgs->popstr();
             worker->service = requireService(service_frame);
+            //  Optional credit frame says how many requests the worker
+            //  takes before it reports, one if not given
+            if (msgs->size())
+                worker->credit = qBound(1, msgs->popstr().toInt(), MDP_MAX_CREDIT);
             ls_waitings.append(worker);
-            worker->service->waiting.append(worker);
+            worker->service->workers++;
+            worker->service->offer(worker);
 
-            worker->expiry = QTime::currentTime().addMSecs(HEARTBEAT_EXPIRY);
+            touchWorker(worker);
             worker->service->dispatch();
-            qDebug("worker created");
+            if (verbose)
+                qDebug("I: worker ready for '%s'", service_frame.toLatin1().data());
         }
     }
     else
-    if (command == MDPW_REPORT) {
+    if (command == MDPW_REPORT [0]) {
         if (worker_ready) {
-            //  Remove & save client return envelope and insert the
-            //  protocol header and service name, then rewrap envelope.
-            Frame *client = msgs->unwrap();
-            msgs->push(worker->service->name);
-            msgs->push(MDPC_REPORT);
-            msgs->push(QMDPC);
-            msgs->wrap(client);
-            msgs->send(*broker);
+            //  Remove client return envelope, then send it back with the
+            //  protocol header and service name; the frame is not copied
+            Frame *correlation;
+            Frame *client = s_unwrap_client(msgs, &correlation);
+            if (*tracing)
+                Trace::stamp(*msgs, Trace::BrokerReport);
+            sendClient(client, MDPC_REPORT, worker->service->name_data,
+                       msgs, correlation);
+            delete correlation;
+            delete client;
+
+            //  Any traffic from a worker is as good as a heartbeat
+            touchWorker(worker);
+
+            //  Each report gives one credit back
+            if (worker->inflight > 0) {
+                worker->service->withdraw(worker);
+                worker->inflight--;
+                worker->service->offer(worker);
+                worker->service->dispatch();
+            }
         }
         else
             worker->remove(true);
     }
     else
-    if (command == MDPW_HEARTBEAT) {
-        if (worker_ready) {
-            if (ls_waitings.size() > 1) {
-                // Move worker to the end of the waiting queue,
-                // so purge will only check old worker(s)
-                ls_waitings.removeOne(worker);
-                ls_waitings.append(worker);
-            }
-            worker->expiry = QTime::currentTime().addMSecs(HEARTBEAT_EXPIRY);
-        }
+    if (command == MDPW_HEARTBEAT [0]) {
+        if (worker_ready)
+            touchWorker(worker);
         else
             worker->remove(true);
     }
     else
-    if (command == MDPW_DISCONNECT)
+    if (command == MDPW_DISCONNECT [0])
         worker->remove(false);
     else {
         qDebug ("E: invalid input message");
         qDebug() << msgs->toStringList();
     }
+    delete msgs;
+    delete sender;
 }
 
-void MdpBrokerPrivate::clientMessage(Frame *sender, Messages *msg)
+void MdpShard::clientMessage(Frame *sender, Messages *msg, bool extended)
 {
     assert (msg->size() >= 2);     //  Service name + body
 
     QString service_frame = msg->popstr();
     Service_t *service = requireService(service_frame);
 
+    //  Extended header has an options frame: priority, 1 byte, timeout
+    //  in msecs, 4 bytes, zero takes broker default, then an optional
+    //  correlation id that comes back with the reply
+    int priority = 0;
+    int timeout = request_timeout;
+    Frame *correlation = NULL;
+    if (extended) {
+        Frame *options = msg->pop();
+        const byte *data = (const byte *) options->constData();
+        if (options->size() >= 1)
+            priority = qMin(int(data [0]), MDP_PRIORITIES - 1);
+        if (options->size() >= 5) {
+            int value = (data [1] << 24) | (data [2] << 16) | (data [3] << 8) | data [4];
+            if (value > 0)
+                timeout = value;
+        }
+        if (options->size() > 5)
+            correlation = new Frame(data + 5, options->size() - 5);
+        delete options;
+    }
+
     //  If we got a MMI service request, process that internally
     if (service_frame.size() >= 4 && service_frame.startsWith("mmi.")) {
         QString return_code;
         if (service_frame == "mmi.service") {
             QString name = msg->lastStr();
             Service_t *service = ls_services.value(name, 0);
-            return_code = service && service->waiting.size() ? "200": "404";
+            return_code = service && service->workers ? "200": "404";
+        }
+        else
+        if (service_frame == "mmi.stats") {
+            //  Reply is return code, then queue depth, age of oldest
+            //  request in msecs, waiting workers, dropped and expired
+            QString name = msg->lastStr();
+            msg->clear();
+            serviceStats(name, msg);
+            sendClient(sender, MDPC_REPORT, service->name_data, msg, correlation);
+            delete correlation;
+            delete msg;
+            delete sender;
+            return;
         }
         else
             // The filter service that can be used to manipulate
@@ -698,46 +1843,327 @@ void MdpBrokerPrivate::clientMessage(Frame *sender, Messages *msg)
         msg->last()->reset(return_code.toLocal8Bit().data(), strlen (return_code.toLocal8Bit().data()));
 
         //  Insert the protocol header and service name, then rewrap envelope.
-        msg->push(service_frame);
-        msg->push(MDPC_REPORT);
-        msg->push(QMDPC);
-        msg->wrap(new Frame(*sender));
-        msg->send(*broker);
+        sendClient(sender, MDPC_REPORT, service->name_data, msg, correlation);
+        delete correlation;
+        delete msg;
+        delete sender;
     }
     else {
+        //  The command filter looks at the first body frame; skip it
+        //  unless there is a filter, as the body can be large
         bool enabled = true;
-        if (msg->size() >= 1) {
+        if (msg->size() >= 1 && !service->blacklisted.isEmpty()) {
             QString cmd_frame = msg->firstStr();
             enabled = service->isCommandEnabled(cmd_frame);
         }
 
-        //  Forward the message to the worker.
+        //  Forward the message to the worker, the request keeps the
+        //  sender frame as its envelope
         if (enabled) {
-            msg->wrap(new Frame(*sender));
-            service->requests.append(msg);
-            service->dispatch();
+            if (*tracing)
+                Trace::stamp(*msg, Trace::BrokerReceive);
+            msg->push("", 0);
+            if (correlation)
+                msg->push(correlation);
+            msg->push(sender);
+            Request_t *request = new Request_t;
+            request->msg = msg;
+            request->priority = priority;
+            request->queued_at = clock_mono();
+            request->deadline = timeout > 0 ? request->queued_at + timeout : 0;
+            if (service->enqueue(request))
+                service->dispatch();
         }
         //  Send a NAK message back to the client.
         else {
-            msg->push(service_frame);
-            msg->push(MDPC_NAK);
-            msg->push(QMDPC);
-            msg->wrap(new Frame(*sender));
-            msg->send(*broker);
+            sendClient(sender, MDPC_NAK, service->name_data, msg, correlation);
+            delete correlation;
+            delete msg;
+            delete sender;
         }
     }
 }
 
-void MdpBrokerPrivate::purge()
+void MdpShard::serviceStats(const QString &name, Messages *reply)
+{
+    Service_t *service = ls_services.value(name, 0);
+    if (!service) {
+        reply->append(QString("404"));
+        return;
+    }
+    reply->append(QString("200"));
+    reply->append("%d", service->queued);
+    reply->append("%d", int(service->oldest(clock_mono())));
+    reply->append("%d", service->available);
+    reply->append("%d", service->dropped);
+    reply->append("%d", service->expired);
+}
+
+void MdpShard::expireRequests()
 {
-    foreach (Worker_t* w, ls_workers) {
-        if (QTime::currentTime() < w->expiry)
-            break;                  //  Worker is alive, we're done here
+    qint64 now = clock_mono();
+    if (!deadline_at || deadline_at > now)
+        return;
+
+    deadline_at = 0;
+    foreach (Service_t *service, ls_services) {
+        if (!service->queued)
+            continue;
+        qint64 next = service->expire(now);
+        if (next && (!deadline_at || next < deadline_at))
+            deadline_at = next;
+    }
+}
+
+long MdpShard::timeout()
+{
+    qint64 wake_at = heartbeat_at;
+    if (deadline_at && deadline_at < wake_at)
+        wake_at = deadline_at;
+    long timeout = long(wake_at - clock_mono());
+    return timeout > 0 ? timeout : 0;
+}
+
+void MdpShard::purge()
+{
+    qint64 now = clock_mono();
+    while (ls_expiry.first && ls_expiry.first->expiry <= now) {
+        Worker_t *worker = ls_expiry.first;
+        if (!worker->expired(now)) {
+            touchWorker(worker);    //  Busy, look again later
+            continue;
+        }
         if (verbose)
-            qDebug() << "I: deleting expired worker: " << w->identity;
+            qDebug() << "I: deleting expired worker: " << worker->identity;
+
+        worker->remove(false);
+    }
+}
+
+//  Refresh worker expiry and move it to the newest end of the list
+
+void MdpShard::touchWorker(Worker_t *worker)
+{
+    ls_expiry.remove(worker);
+    worker->expiry = clock_mono() + HEARTBEAT_EXPIRY;
+    ls_expiry.append(worker);
+}
+
+void MdpShard::process(Messages *msgs)
+{
+    if (verbose) {
+        qDebug("I: received message:\n");
+        qDebug() << msgs->toStringList();
+    }
+    //  Envelope and header are the only frames we look into; the body
+    //  is forwarded as the frames we received, never copied
+    Frame *sender = msgs->pop();
+    delete msgs->pop();         //  Empty delimiter
+    Frame *header = msgs->pop();
+
+    if (s_frame_is(header, QMDPC, 7) || s_frame_is(header, QMDPCX, 7))
+        clientMessage(sender, msgs, s_frame_is(header, QMDPCX, 7));
+    else
+    if (s_frame_is(header, QMDPW, 7))
+        workerMessage(sender, msgs);
+    else {
+        qDebug("E: invalid message:");
+        delete msgs;
+        delete sender;
+    }
+    delete header;
+}
+
+void MdpShard::heartbeat()
+{
+    expireRequests();
+
+    //  Disconnect and delete any expired workers
+    //  Send heartbeats to idle workers if needed; a worker that got
+    //  anything from us in the last interval takes that as one
+    qint64 now = clock_mono();
+    if (now > heartbeat_at) {
+        purge();
+        Worker_t *worker;
+        for (worker = ls_waitings.first; worker;
+             worker = ls_waitings.next(worker)) {
+            if (worker->sent_at + HEARTBEAT_INTERVAL <= now)
+                worker->send(MDPW_HEARTBEAT, NULL, NULL);
+        }
+        heartbeat_at = now + HEARTBEAT_INTERVAL;
+    }
+}
+
+//  Forget notice is an empty frame and the worker address; the ROUTER
+//  never gives us an empty address, so front can tell it apart
+
+void MdpShard::forget(const QByteArray &address)
+{
+    if (!threaded)
+        return;
+    socket->sendmem("", 0, QFRAME_MORE);
+    socket->sendmem(address.constData(), address.size(), 0);
+}
+
+void MdpShard::run()
+{
+    int generation = 0;
+    while (true) {
+        zmq_pollitem_t items [] = {
+            { socket->resolve(),  0, ZMQ_POLLIN, 0 } };
+        if (zmq_poll (items, 1, timeout()) == -1)
+            break;              //  Interrupted
+
+        if (items [0].revents & ZMQ_POLLIN) {
+            Messages* msgs = new Messages;
+            msgs->recv(*socket);
+            if (msgs->size() == 1) {
+                delete msgs;    //  $TERM from front thread
+                break;
+            }
+            process(msgs);
+        }
+        heartbeat();
+        if (QMNet::configChanged(generation))
+            srnet->applyConfig(socket);
+    }
+}
+
+/*
+ * Front thread of a sharded broker
+ *
+ * *****/
+
+void MdpBrokerPrivate::createShards()
+{
+    if (shard_count <= 1) {
+        MdpShard *shard = new MdpShard(broker, false);
+        configure(shard);
+        shards.append(shard);
+        return;
+    }
+    for (int index = 0; index < shard_count; index++) {
+        QString endpoint = QString("inproc://mdp-shard-%1-%2")
+                .arg(quintptr(this), 0, 16).arg(index);
+        Socket *front = context->createSocket(ZMQ_PAIR, endpoint, tag);
+        Socket *back = context->createSocket(ZMQ_PAIR, endpoint, tag);
+        front->bind("%s", endpoint.toLatin1().constData());
+        back->connect("%s", endpoint.toLatin1().constData());
+        pipes.append(front);
+
+        MdpShard *shard = new MdpShard(back, true);
+        configure(shard);
+        shards.append(shard);
+    }
+}
+
+void MdpBrokerPrivate::configure(MdpShard *shard)
+{
+    shard->verbose = verbose;
+    shard->queue_hwm = queue_hwm;
+    shard->service_hwm = service_hwm;
+    shard->request_timeout = request_timeout;
+    shard->tracing = &tracing;
+}
+
+int MdpBrokerPrivate::shardOf(Frame *service) const
+{
+    return int(qHash(QByteArray::fromRawData((const char *) service->constData(),
+                                             service->size())) % shards.size());
+}
+
+//  Pick the shard for a message from the ROUTER and pass it on whole.
+//  Clients go by service name, MMI requests by the service they ask
+//  about, workers by the service of their READY.
 
-        w->remove(false);
+void MdpBrokerPrivate::route(Messages &msgs)
+{
+    //  Frame 1: sender, 2: empty, 3: header, 4: service or command
+    if (msgs.size() < 4) {
+        qDebug("E: invalid message:");
+        return;
+    }
+    Frame *header = msgs.at(2);
+    int shard = 0;
+    bool extended = s_frame_is(header, QMDPCX, 7);
+    if (extended || s_frame_is(header, QMDPC, 7)) {
+        int options = extended ? 1 : 0;
+        Frame *service = msgs.at(3);
+        if (s_frame_is(service, "mmi.service", 11)
+        ||  s_frame_is(service, "mmi.stats", 9))
+            service = msgs.last();
+        else
+        if (s_frame_is(service, "mmi.filter", 10) && msgs.size() == 7 + options)
+            service = msgs.at(5 + options);
+        shard = shardOf(service);
     }
+    else
+    if (s_frame_is(header, QMDPW, 7)) {
+        QByteArray address = msgs.first()->bdata();
+        Frame *command = msgs.at(3);
+        if (s_frame_is(command, MDPW_READY, 1) && msgs.size() >= 5) {
+            shard = shardOf(msgs.at(4));
+            worker_shards.insert(address, shard);
+        }
+        else {
+            //  Unknown workers go to any shard, which disconnects them
+            shard = worker_shards.value(address, 0);
+            if (s_frame_is(command, MDPW_DISCONNECT, 1))
+                worker_shards.remove(address);
+        }
+    }
+    else {
+        qDebug("E: invalid message:");
+        return;
+    }
+    msgs.send(*pipes [shard]);
+}
+
+void MdpBrokerPrivate::runFront(volatile bool *terminated)
+{
+    foreach (MdpShard *shard, shards)
+        shard->start();
+
+    int count = pipes.size();
+    int generation = 0;
+    QVector<zmq_pollitem_t> items(count + 1);
+    zmq_pollitem_t router = { broker->resolve(), 0, ZMQ_POLLIN, 0 };
+    items [0] = router;
+    for (int index = 0; index < count; index++) {
+        zmq_pollitem_t pipe = { pipes [index]->resolve(), 0, ZMQ_POLLIN, 0 };
+        items [index + 1] = pipe;
+    }
+
+    while (!*terminated) {
+        if (zmq_poll (items.data(), items.size(), HEARTBEAT_INTERVAL) == -1)
+            break;              //  Interrupted
+
+        if (items [0].revents & ZMQ_POLLIN) {
+            Messages msgs;
+            msgs.recv(*broker);
+            route(msgs);
+        }
+        for (int index = 0; index < count; index++) {
+            if (!(items [index + 1].revents & ZMQ_POLLIN))
+                continue;
+            Messages msgs;
+            msgs.recv(*pipes [index]);
+            if (msgs.size() == 2 && msgs.first()->size() == 0) {
+                QByteArray address = msgs.last()->bdata();
+                if (worker_shards.value(address, -1) == index)
+                    worker_shards.remove(address);
+            }
+            else
+                msgs.send(*broker);
+        }
+        if (QMNet::configChanged(generation)) {
+            srnet->applyConfig(broker);
+            foreach (Socket *pipe, pipes)
+                srnet->applyConfig(pipe);
+        }
+    }
+    foreach (Socket *pipe, pipes)
+        pipe->sendx("$TERM", NULL);
 }
 
 MdpBroker::MdpBroker(Context *cntx, QObject *parent) : d_ptr(new MdpBrokerPrivate(cntx)), QObject(parent)
@@ -745,21 +2171,88 @@ MdpBroker::MdpBroker(Context *cntx, QObject *parent) : d_ptr(new MdpBrokerPrivat
 
 MdpBroker::~MdpBroker()
 {
+    Q_D(MdpBroker);
     terminated = true;
+    d->future.waitForFinished();
 
     delete d_ptr;
 }
 
+void MdpBroker::setShards(int count)
+{
+    Q_D(MdpBroker);
+    d->shard_count = count > 0 ? count : 1;
+}
+
+int MdpBroker::shards() const
+{
+    Q_D(const MdpBroker);
+    return d->shard_count;
+}
+
+void MdpBroker::setVerbose(bool v)
+{
+    Q_D(MdpBroker);
+    d->verbose = v;
+}
+
+void MdpBroker::setQueueLimit(int hwm, const QString &service)
+{
+    Q_D(MdpBroker);
+    if (service.isNull())
+        d->queue_hwm = hwm;
+    else
+        d->service_hwm.insert(service, hwm);
+}
+
+void MdpBroker::setRequestTimeout(int ms)
+{
+    Q_D(MdpBroker);
+    d->request_timeout = ms;
+}
+
+void MdpBroker::setTracing(bool enable)
+{
+    Q_D(MdpBroker);
+    d->tracing = enable;
+}
+
+bool MdpBroker::tracing() const
+{
+    Q_D(const MdpBroker);
+    return d->tracing;
+}
+
+void MdpBroker::setTag(const QString &tag)
+{
+    Q_D(MdpBroker);
+    d->tag = tag;
+}
+
+QString MdpBroker::tag() const
+{
+    Q_D(const MdpBroker);
+    return d->tag;
+}
+
 int MdpBroker::bind(const char *endpoint)
 {
     Q_D(MdpBroker);
+    if (!d->bound) {
+        delete d->broker;
+        d->broker = d->context->createSocket(ZMQ_ROUTER, endpoint, d->tag);
+        d->bound = true;
+    }
     return d->broker->bind("%s", endpoint);
 }
 
 void MdpBroker::start()
 {
+    Q_D(MdpBroker);
+    if (d->shards.isEmpty())
+        d->createShards();
     terminated = false;
-    QtConcurrent::run(this, &MdpBroker::run);
+    d->future = QtConcurrent::run(this, &MdpBroker::run);
 }
 
 void MdpBroker::stop()
@@ -767,36 +2260,375 @@ void MdpBroker::stop()
     terminated = true;
 }
 
-void MdpBroker::test()
+void MdpBroker::test(bool verbose)
 {
+    printf (" * mdp: ");
+    if (verbose)
+        printf ("\n");
+
+    //  @selftest
     MdpBroker broker(srnet);
-    broker.bind("tcp://*:5555");
+    broker.setVerbose(verbose);
+    broker.setQueueLimit(4, "queued");
+    int rc = broker.bind("inproc://mdp.test");
+    assert (rc == 0);
     broker.start();
 
-
-    MdpClient client1(srnet);
-    client1.setVerbose(true);
-    client1.setBrokerAddress("tcp://127.0.0.1:5555");
-    client1.connectToBroker();
-
+    //  Echo worker with two handlers, so requests overlap
     MdpWorker worker(srnet);
-    worker.setVerbose(true);
-    worker.setBrokerAddress("tcp://127.0.0.1:5555");
+    worker.setVerbose(verbose);
+    worker.setBrokerAddress("inproc://mdp.test");
     worker.setServiceName("echo");
-    worker.connectToBroker();
+    worker.setConcurrency(2);
+    QFuture<void> serving = QtConcurrent::run(&worker, &MdpWorker::serve);
+
+    MdpClient client(srnet);
+    client.setVerbose(verbose);
+    client.setBrokerAddress("inproc://mdp.test");
+    client.connectToBroker();
+
+    //  All requests in flight at once, each reply comes back with the
+    //  id and body of its own request
+    QList<MdpReply*> replies;
+    int request_nbr;
+    for (request_nbr = 0; request_nbr < 100; request_nbr++) {
+        Messages request;
+        request.append("Request %d", request_nbr);
+        replies.append(client.request("echo", &request, request_nbr % MDP_PRIORITIES));
+    }
+    assert (client.pending() == 100);
+    while (client.pending() > 0) {
+        rc = client.process();
+        assert (rc > 0);
+    }
+    for (request_nbr = 0; request_nbr < 100; request_nbr++) {
+        MdpReply *reply = replies [request_nbr];
+        assert (reply->status() == MdpReply::Finished);
+        assert (reply->id() == quint32(request_nbr + 1));
+        assert (reply->service() == "echo");
+        Messages report = reply->messages();
+        assert (report.size() == 1);
+        assert (report.popstr() == QString("Request %1").arg(request_nbr));
+    }
+    qDeleteAll(replies);
+    replies.clear();
+
+    //  A filtered command is rejected by the broker, with its id
+    Messages filter;
+    filter.append(QString("disable"));
+    filter.append(QString("echo"));
+    filter.append(QString("STOP"));
+    MdpReply *reply = client.request("mmi.filter", &filter);
+    reply->waitForFinished(&client);
+    assert (reply->status() == MdpReply::Finished);
+    Messages report = reply->messages();
+    assert (report.popstr() == "200");
+    delete reply;
+
+    Messages stop;
+    stop.append(QString("STOP"));
+    reply = client.request("echo", &stop);
+    reply->waitForFinished(&client);
+    assert (reply->status() == MdpReply::Rejected);
+    assert (reply->id() == 102);
+    delete reply;
+
+    //  Nobody serves this one; it is resent once, then times out
+    client.setTimeOut(100);
+    client.setRetries(1);
+    Messages lost;
+    lost.append(QString("Hello"));
+    reply = client.request("nobody", &lost);
+    qint64 sent_at = clock_mono();
+    reply->waitForFinished(&client);
+    assert (reply->status() == MdpReply::TimedOut);
+    assert (clock_mono() - sent_at >= 200);
+    assert (client.pending() == 0);
+    delete reply;
+
+    //  A running broker picks up new runtime settings
+    int sndhwm = srnet->config().value("sndhwm");
+    srnet->configure("sndhwm", sndhwm + 100);
+    Messages lookup;
+    lookup.append(QString("echo"));
+    reply = client.request("mmi.service", &lookup);
+    reply->waitForFinished(&client);
+    assert (reply->status() == MdpReply::Finished);
+    delete reply;
+
+    //  Past its queue limit a service sheds the newest request of the
+    //  lowest priority below the new one, or else the new one
+    client.setTimeOut(2500);
+    client.setRetries(0);
+    for (request_nbr = 0; request_nbr < 6; request_nbr++) {
+        Messages request;
+        request.append("Queued %d", request_nbr);
+        int priority = request_nbr < 4 ? 1 : request_nbr == 4 ? 2 : 0;
+        replies.append(client.request("queued", &request, priority));
+    }
+    replies [3]->waitForFinished(&client, 1000);
+    replies [5]->waitForFinished(&client, 1000);
+    for (request_nbr = 0; request_nbr < 6; request_nbr++) {
+        if (request_nbr == 3 || request_nbr == 5) {
+            assert (replies [request_nbr]->status() == MdpReply::Rejected);
+            report = replies [request_nbr]->messages();
+            assert (report.popstr() == QString("Queued %1").arg(request_nbr));
+        }
+        else
+            assert (replies [request_nbr]->status() == MdpReply::Pending);
+    }
+
+    //  Requests not taken by their deadline are NAKed too
+    Messages expiring;
+    expiring.append(QString("Hello"));
+    client.send("expiring", &expiring, 0, 50);
+    QString command, service;
+    Messages nak = client.recv(command, service);
+    assert (command == MDPC_NAK);
+    assert (service == "expiring");
+    assert (nak.popstr() == "Hello");
+
+    //  Stats: code, queued, oldest, waiting workers, dropped, expired
+    Messages stats;
+    stats.append(QString("queued"));
+    reply = client.request("mmi.stats", &stats);
+    reply->waitForFinished(&client);
+    assert (reply->status() == MdpReply::Finished);
+    report = reply->messages();
+    assert (report.size() == 6);
+    assert (report.popstr() == "200");
+    assert (report.popstr() == "4");
+    assert (report.popstr().toInt() >= 0);
+    assert (report.popstr() == "0");
+    assert (report.popstr() == "2");
+    assert (report.popstr() == "0");
+    delete reply;
+
+    stats.clear();
+    stats.append(QString("expiring"));
+    reply = client.request("mmi.stats", &stats);
+    reply->waitForFinished(&client);
+    report = reply->messages();
+    assert (report.popstr() == "200");
+    assert (report.popstr() == "0");
+    report.popstr();
+    report.popstr();
+    assert (report.popstr() == "0");
+    assert (report.popstr() == "1");
+    delete reply;
+    qDeleteAll(replies);
+    replies.clear();
+
+    worker.stop();
+    serving.waitForFinished();
+    broker.stop();
+    broker.d_func()->future.waitForFinished();
+    assert (broker.d_func()->broker->sndhwm() == sndhwm + 100);
+    srnet->configure("sndhwm", sndhwm);
+
+    //  Sockets made through a context follow its placement rules: the
+    //  tagged client goes to bulk, and a PULL type rule leaves the inproc
+    //  report sockets of serve() together with their pushing handlers
+    {
+        QMNet control;
+        QMNet bulk;
+        control.placeTag("bulk", &bulk);
+        control.placeType(ZMQ_PULL, &bulk);
+
+        MdpBroker placed(&control);
+        int port = placed.bind("tcp://127.0.0.1:*[5000-]");
+        assert (port > 0);
+        placed.start();
+        QString endpoint = QString("tcp://127.0.0.1:%1").arg(port);
+
+        MdpWorker handler(&control);
+        handler.setBrokerAddress(endpoint);
+        handler.setServiceName("echo");
+        handler.setConcurrency(2);
+        QFuture<void> handling = QtConcurrent::run(&handler, &MdpWorker::serve);
+
+        MdpClient tagged(&control);
+        tagged.setTag("bulk");
+        tagged.setBrokerAddress(endpoint);
+        tagged.connectToBroker();
+        assert (tagged.socket()->context() == &bulk);
+
+        for (request_nbr = 0; request_nbr < 4; request_nbr++) {
+            Messages request;
+            request.append("Placed %d", request_nbr);
+            replies.append(tagged.request("echo", &request));
+        }
+        while (tagged.pending() > 0) {
+            rc = tagged.process();
+            assert (rc > 0);
+        }
+        foreach (MdpReply* placed_reply, replies) {
+            assert (placed_reply->status() == MdpReply::Finished);
+        }
+        assert (handler.socket()->context() == &control);
+        qDeleteAll(replies);
+        replies.clear();
+
+        handler.stop();
+        handling.waitForFinished();
+        placed.stop();
+        placed.d_func()->future.waitForFinished();
+    }
 
-    client1.startTest();
-    worker.startTest();
+    //  Sharded broker: services spread over shard threads by name, each
+    //  shard gets the workers and requests of its own services only
+    {
+        QThreadPool *pool = QThreadPool::globalInstance();
+        int threads = pool->maxThreadCount();
+        pool->setMaxThreadCount(qMax(threads, 8));
+
+        MdpBroker sharded(srnet);
+        sharded.setVerbose(verbose);
+        sharded.setShards(2);
+        rc = sharded.bind("inproc://mdp.shards");
+        assert (rc == 0);
+        sharded.start();
+        MdpBrokerPrivate *front = sharded.d_func();
+        assert (front->shards.size() == 2);
+
+        //  One service on each shard, a third one on either
+        QStringList names;
+        QList<int> homes;
+        int index;
+        for (index = 0; names.size() < 3; index++) {
+            QString name = QString("shard.%1").arg(index);
+            Frame frame(name.toLatin1());
+            int home = front->shardOf(&frame);
+            if (names.size() < 2 && homes.contains(home))
+                continue;
+            names.append(name);
+            homes.append(home);
+        }
+
+        QList<MdpWorker*> echoes;
+        QList<QFuture<void> > servings;
+        foreach (const QString& name, names) {
+            MdpWorker *echo = new MdpWorker(srnet);
+            echo->setVerbose(verbose);
+            echo->setBrokerAddress("inproc://mdp.shards");
+            echo->setServiceName(name);
+            echoes.append(echo);
+            servings.append(QtConcurrent::run(echo, &MdpWorker::serve));
+        }
+
+        MdpClient sender(srnet);
+        sender.setVerbose(verbose);
+        sender.setBrokerAddress("inproc://mdp.shards");
+        sender.connectToBroker();
+        for (request_nbr = 0; request_nbr < 30; request_nbr++) {
+            Messages request;
+            request.append("Sharded %d", request_nbr);
+            replies.append(sender.request(names [request_nbr % 3], &request));
+        }
+        while (sender.pending() > 0) {
+            rc = sender.process();
+            assert (rc > 0);
+        }
+        for (request_nbr = 0; request_nbr < 30; request_nbr++) {
+            reply = replies [request_nbr];
+            assert (reply->status() == MdpReply::Finished);
+            assert (reply->service() == names [request_nbr % 3]);
+            report = reply->messages();
+            assert (report.popstr() == QString("Sharded %1").arg(request_nbr));
+        }
+        qDeleteAll(replies);
+        replies.clear();
+
+        //  Stop workers, then the front thread, which stops every shard
+        foreach (MdpWorker *echo, echoes)
+            echo->stop();
+        for (index = 0; index < servings.size(); index++)
+            servings [index].waitForFinished();
+        sharded.stop();
+        front->future.waitForFinished();
+        foreach (MdpShard *shard, front->shards) {
+            shard->wait();
+            assert (shard->isFinished());
+        }
+
+        //  Each service, and its worker, lives on its home shard only
+        assert (front->worker_shards.size() == 3);
+        for (index = 0; index < names.size(); index++) {
+            MdpShard *home = front->shards [homes [index]];
+            MdpShard *other = front->shards [1 - homes [index]];
+            assert (home->ls_services.contains(names [index]));
+            assert (home->ls_services.value(names [index])->workers == 1);
+            assert (!other->ls_services.contains(names [index]));
+        }
+        assert (front->worker_shards.values().contains(0));
+        assert (front->worker_shards.values().contains(1));
+
+        qDeleteAll(echoes);
+        pool->setMaxThreadCount(threads);
+    }
+
+    //  Purge keeps a silent worker that holds requests, up to
+    //  HEARTBEAT_BUSY after the last one, and the heartbeat round skips
+    //  workers that got anything from us in the last interval
+    {
+        Socket *router = srnet->createSocket(ZMQ_ROUTER);
+        MdpShard shard(router, false);
+        qint64 now = clock_mono();
+        const char *names [] = { "idle", "held", "stuck" };
+        Worker_t *workers [3];
+        int index;
+        for (index = 0; index < 3; index++) {
+            Worker_t *worker = new Worker_t(&shard);
+            worker->address = names [index];
+            worker->identity = names [index];
+            worker->expiry = now - 1;
+            shard.ls_workers.insert(worker->address, worker);
+            shard.ls_expiry.append(worker);
+            workers [index] = worker;
+        }
+        workers [1]->inflight = 1;
+        workers [1]->dispatched_at = now;
+        workers [2]->inflight = 1;
+        workers [2]->dispatched_at = now - HEARTBEAT_BUSY;
+        shard.purge();
+        assert (shard.ls_workers.size() == 1);
+        assert (shard.ls_workers.contains("held"));
+        assert (workers [1]->expiry > now);
+
+        Worker_t *recent = new Worker_t(&shard);
+        recent->address = "recent";
+        recent->expiry = now + HEARTBEAT_EXPIRY;
+        recent->sent_at = now - 10;
+        shard.ls_workers.insert(recent->address, recent);
+        shard.ls_expiry.append(recent);
+        shard.ls_waitings.append(recent);
+        shard.ls_waitings.append(workers [1]);
+        workers [1]->sent_at = 0;
+        shard.heartbeat_at = 0;
+        shard.heartbeat();
+        assert (recent->sent_at == now - 10);
+        assert (workers [1]->sent_at >= now);
+        delete router;
+    }
+    //  @end
+    printf ("OK\n");
 }
 
 void MdpBroker::run()
 {
     Q_D(MdpBroker);
+    if (d->pipes.size()) {
+        d->runFront(&terminated);
+        return;
+    }
+
+    MdpShard *shard = d->shards.first();
+    int generation = 0;
     //  Get and process messages forever or until interrupted
     while (!terminated) {
         zmq_pollitem_t items [] = {
             { d->broker->resolve(),  0, ZMQ_POLLIN, 0 } };
-        int rc = zmq_poll (items, 1, HEARTBEAT_INTERVAL);
+        int rc = zmq_poll (items, 1, shard->timeout());
         if (rc == -1)
             break;              //  Interrupted
 
@@ -804,37 +2636,10 @@ void MdpBroker::run()
         if (items [0].revents & ZMQ_POLLIN) {
             Messages* msgs = new Messages;
             msgs->recv(*d->broker);
-            if (d->verbose) {
-                qDebug("I: received message:\n");
-                qDebug() << msgs->toStringList();
-            }
-            Frame *sender = msgs->pop();
-            QString empty  = msgs->popstr();
-            QString header = msgs->popstr();
-
-            if (header == QMDPC)
-                d->clientMessage(sender, msgs);
-            if (header == QMDPW)
-                d->workerMessage(sender, msgs);
-            else {
-                qDebug("E: invalid message:");
-                delete msgs;
-            }
-            delete sender;
-        }
-        //  Disconnect and delete any expired workers
-        //  Send heartbeats to idle workers if needed
-        if (QTime::currentTime() > d->heartbeat_at) {
-            d->purge();
-            foreach (Worker_t *worker, d->ls_waitings) {
-                worker->send(MDPW_HEARTBEAT, NULL, NULL);
-            }
-            d->heartbeat_at = QTime::currentTime().addMSecs(HEARTBEAT_INTERVAL);
+            shard->process(msgs);
         }
+        shard->heartbeat();
+        if (QMNet::configChanged(generation))
+            srnet->applyConfig(d->broker);
     }
 }
-
-
-
-
-
@@ -5,6 +5,9 @@
 
 #define QMDPC "QMDPC01"
 
+//  Extended client header, an options frame follows the service name
+#define QMDPCX "QMDPCX1"
+
 //  MDP/Client commands, as strings
 #define MDPC_REQUEST        "\001"
 #define MDPC_REPORT         "\002"
@@ -29,6 +32,44 @@ static char *mdpw_commands [] = {
 };
 
 class Messages;
+class MdpClient;
+
+/// handle to an asynchronous request, finished once the reply, a NAK
+/// or the last timeout comes in; the caller owns it
+class MdpReplyPrivate;
+class QMQ_EXPORT MdpReply : public QObject
+{
+    Q_OBJECT
+public:
+    enum Status { Pending, Finished, Rejected, TimedOut, Failed };
+
+    MdpReply();
+    ~MdpReply();
+
+    Status status() const;
+    bool isFinished() const;
+    quint32 id() const;
+    QString service() const;
+    Messages messages() const;
+
+    /// trace trailer of a traced request, with every hop up to the client
+    /// receive; empty if the request was not traced
+    QByteArray trace() const;
+
+    /// runs client until this reply is finished, or msecs pass
+    bool waitForFinished(MdpClient* client, int msecs = -1);
+
+signals:
+    void finished();
+
+protected:
+    MdpReplyPrivate* const d_ptr;
+
+private:
+    friend class MdpClient;
+    friend class MdpClientPrivate;
+    Q_DECLARE_PRIVATE(MdpReply)
+};
 
 class MdpClientPrivate;
 class QMQ_EXPORT MdpClient : public QObject
@@ -45,17 +86,39 @@ public:
     void setTimeOut(int ms);
     int timeOut() const;
 
+    /// times a request is resent after timeOut before it times out
+    void setRetries(int count);
+    int retries() const;
+
+    /// requests get a trace trailer, see Trace; replies of request() give
+    /// it back in MdpReply::trace, recv() leaves it as the last frame
+    void setTracing(bool enable);
+    bool tracing() const;
+
+    /// placement tag of the broker socket, see QMNet::placement;
+    /// takes effect on the next connectToBroker
+    void setTag(const QString& tag);
+    QString tag() const;
+
     void setVerbose(bool);
     Messages recv(QString& command, QString& service);
 
+    /// send without waiting for the reply; any number can be in flight
+    MdpReply* request(const QString& service, Messages* request, int priority = 0);
+    /// deliver replies and handle timeouts for up to timeout msecs
+    int process(int timeout = -1);
+    int pending() const;
+
     void startTest();
     void testRun();
 signals:
     void receiveCommand(const QString& command, const QString& service);
+    void replied(MdpReply* reply);
 
 public slots:
     bool connectToBroker();
     bool send(const QString& service, Messages* request);
+    bool send(const QString& service, Messages* request, int priority, int timeout);
 
 protected:
     MdpClientPrivate* const d_ptr;
@@ -90,9 +153,30 @@ public:
 
     int liveness() const;
 
+    /// handler threads for serve(), also the number of requests the
+    /// broker may send before we report
+    void setConcurrency(int threads);
+    int concurrency() const;
+
+    /// stamp worker hops on trace trailers; traced requests have the
+    /// trailer taken off before process() and put back on the report
+    /// either way
+    void setTracing(bool enable);
+    bool tracing() const;
+
+    /// placement tag of the broker socket and of the serve() report
+    /// sockets, see QMNet::placement; takes effect on the next
+    /// connectToBroker
+    void setTag(const QString& tag);
+    QString tag() const;
+
     void setVerbose(bool);
     void recv(QString& replyAdd, Messages& rmsg);
 
+    /// handles one request, called on a pool thread by serve();
+    /// default echoes the request
+    virtual void process(Messages& request, Messages& report);
+
     void startTest();
     void testRun();
 
@@ -100,6 +184,9 @@ signals:
     void replyTo(const QString& address);
 
 public slots:
+    /// event-driven mode, runs until stop()
+    void serve();
+    void stop();
     bool connectToBroker();
     bool sendToBroker(const QString& command = QString(), const QString& option = QString(),
               Messages* msgs = 0);
@@ -116,6 +203,11 @@ private:
 #define HEARTBEAT_LIVENESS  3       //  3-5 is reasonable
 #define HEARTBEAT_INTERVAL  2500    //  msecs
 #define HEARTBEAT_EXPIRY    HEARTBEAT_INTERVAL * HEARTBEAT_LIVENESS
+#define HEARTBEAT_BUSY      (HEARTBEAT_EXPIRY * 4)  //  Busy worker may be silent
+
+#define MDP_PRIORITIES      4       //  Request priorities, 0 is normal
+#define MDP_QUEUE_HWM       10000   //  Requests queued per service
+#define MDP_MAX_CREDIT      1024    //  Most requests a worker may hold
 
 //  The broker class defines a single broker instance and just a sample
 // you can use yourself broker
@@ -127,12 +219,35 @@ public:
     MdpBroker(Context* cntx, QObject* parent=0);
     ~MdpBroker();
 
+    /// the first endpoint, with the tag, places the broker socket
     int bind(const char* endpoint);
 
+    /// placement tag of the broker and shard sockets, see
+    /// QMNet::placement; set before the first bind
+    void setTag(const QString& tag);
+    QString tag() const;
+
+    /// spread services over count threads, each with its own workers,
+    /// heartbeats and purge; set before start, default 1 runs inline
+    void setShards(int count);
+    int shards() const;
+
+    void setVerbose(bool);
+
+    /// most requests queued per service, for all services or one;
+    /// when full, lower priority requests are shed with NAK
+    void setQueueLimit(int hwm, const QString& service = QString());
+    /// deadline for requests that don't bring their own, 0 = none
+    void setRequestTimeout(int ms);
+
+    /// stamp broker hops on trace trailers, can change while running
+    void setTracing(bool enable);
+    bool tracing() const;
+
     void start();
     void stop();
 
-    static void test();
+    static void test(bool verbose);
 
 protected:
     MdpBrokerPrivate* const d_ptr;
@@ -1,4 +1,5 @@
 #include "msg_p.hpp"
+#include "socket_p.hpp"
 #include <QIODevice>
 #include <QDataStream>
 #include <QDebug>
@@ -127,6 +128,9 @@ int Frame::send(SocketBase &socket, int flags)
     void* handle = socket.resolve();
     int send_flags = (flags & QFRAME_MORE) ? ZMQ_SNDMORE : 0;
     send_flags |= (flags & QFRAME_DONTWAIT) ? ZMQ_DONTWAIT : 0;
+    SocketStats* stats = STATS_OF(socket.d_func());
+    qint64 size = stats ? zmq_msg_size(&(d->msg)) : 0;
+    qint64 started = stats ? SocketStats::clock() : 0;
     if (flags & QFRAME_REUSE) {
         zmq_msg_t copy;
         zmq_msg_init (&copy);
@@ -143,6 +147,8 @@ int Frame::send(SocketBase &socket, int flags)
         if (rc == -1)
             return rc;
     }
+    if (stats)
+        stats->sentMessage(size, SocketStats::clock() - started);
 
     return 0;
 }
@@ -151,10 +157,14 @@ bool Frame::recv(SocketBase &socket)
 {
     Q_D(Frame);
     void* handle = socket.resolve();
+    SocketStats* stats = STATS_OF(socket.d_func());
+    qint64 started = stats ? SocketStats::clock() : 0;
     if (zmq_recvmsg(handle, &(d->msg), 0) < 0) {
         zmq_msg_close(&(d->msg));
         return false;
     }
+    if (stats)
+        stats->receivedMessage(zmq_msg_size(&(d->msg)), SocketStats::clock() - started);
     d->more = socket.receiveMore();
     return true;
 }
@@ -163,9 +173,14 @@ int Frame::recvnowait(SocketBase &socket)
 {
     Q_D(Frame);
     void* handle = socket.resolve();
+    SocketStats* stats = STATS_OF(socket.d_func());
+    qint64 started = stats ? SocketStats::clock() : 0;
     if (zmq_recvmsg(handle, &(d->msg), ZMQ_DONTWAIT) < 0) {
         zmq_msg_close(&(d->msg));
     }
+    else
+    if (stats)
+        stats->receivedMessage(zmq_msg_size(&(d->msg)), SocketStats::clock() - started);
     d->more = socket.receiveMore();
     return d->more;
 }
@@ -301,13 +316,15 @@ bool Messages::recv(SocketBase &socket)
 {
     clear();
 
+    //  Frames are received in place, so large bodies are never copied
     while (true) {
-        Frame frame;
-        if (!frame.recv(socket)) {
+        Frame *frame = new Frame;
+        if (!frame->recv(socket)) {
+            delete frame;
             break;              //  Interrupted or terminated
         }
         append(frame);
-        if (!frame.hasMore())
+        if (!frame->hasMore())
             break;              //  Last message frame
     }
 
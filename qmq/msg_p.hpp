@@ -47,8 +47,7 @@ public:
         contentsize = 0;
     }
     ~MessagesPrivate() {
-        if(frames.count() > 1)
-            qDeleteAll(frames);
+        qDeleteAll(frames);
     }
 
     QQueue<Frame*> frames;
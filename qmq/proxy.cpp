@@ -2,6 +2,20 @@
 
 #include <QDebug>
 
+//  Replace a trace trailer with a copy that has one more hop; other
+//  frames, and so the body of traced messages, are left alone
+
+static void s_stamp(zmq_msg_t *msg)
+{
+    QByteArray trace = Trace::stamped(zmq_msg_data (msg), int(zmq_msg_size (msg)),
+                                      Trace::ProxySwitch);
+    if (trace.isEmpty())
+        return;
+    zmq_msg_close (msg);
+    zmq_msg_init_size (msg, trace.size());
+    memcpy (zmq_msg_data (msg), trace.constData(), trace.size());
+}
+
 class ProxyHandler {
 public:
     ProxyHandler(Socket* pip) {
@@ -10,6 +24,7 @@ public:
 
         terminated = false;
         verbose = false;
+        tracing = false;
 
         frontend = 0; backend = 0; capture = 0;
     }
@@ -59,6 +74,7 @@ public:
     Socket *capture;         //  Capture socket
     bool terminated;         //  Did caller ask us to quit?
     bool verbose;            //  Verbose logging enabled?
+    bool tracing;            //  Stamp trace trailers?
 };
 
 
@@ -123,6 +139,12 @@ int ProxyHandler::handlePipe()
         pipe->signal(0);
     }
     else
+    if (command == "TRACE") {
+        //  ON adds a proxy hop to trace trailers, OFF passes them as they are
+        tracing = request.popstr() == "ON";
+        pipe->signal(0);
+    }
+    else
     if (command == "$TERM")
         terminated = true;
     else {
@@ -144,6 +166,8 @@ void ProxyHandler::s_switch(Socket *in, Socket *out)
         if (zmq_recvmsg (zmq_input, &msg, ZMQ_DONTWAIT) == -1)
             break;      //  Presumably EAGAIN
         int send_flags = in->receiveMore() ? ZMQ_SNDMORE : 0;
+        if (tracing && !send_flags)
+            s_stamp (&msg);
         if (zmq_capture) {
             zmq_msg_t dup;
             zmq_msg_init (&dup);
@@ -163,6 +187,7 @@ void qproxy(Socket *pipe, void *)
     ProxyHandler ph(pipe);
     pipe->signal(0);
 
+    int generation = 0;
     while (!ph.terminated) {
         Socket* witch = (Socket*)ph.poller.wait(-1);
         if(ph.poller.terminated())
@@ -173,6 +198,12 @@ void qproxy(Socket *pipe, void *)
             ph.s_switch(ph.frontend, ph.backend);
         else if(witch == ph.backend)
             ph.s_switch(ph.backend, ph.frontend);
+
+        if (QMNet::configChanged(generation)) {
+            srnet->applyConfig(ph.frontend);
+            srnet->applyConfig(ph.backend);
+            srnet->applyConfig(ph.capture);
+        }
     }
 }
 
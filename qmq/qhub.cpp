@@ -3,6 +3,7 @@
 #include "helper.h"
 
 
+#include <QUuid>
 #include <QTimer>
 #include <QDebug>
 // hub implementaion version 1.00
@@ -11,16 +12,315 @@
 #define SRCLHD "SRCL010"
 #define SRWOHD "SRWO010"
 
+// version 2 headers, followed by one binary frame:
+//  client or worker to hub:
+//      version 1, command 1, address s, name s, value S
+//  hub to client, CMD_REQ:
+//      version 1, command 1, notify port 2
+//  hub to client, CMD_FIND and CMD_WORKER_ADDR:
+//      version 1, command 1, found 1, endpoint s
+//  hub to worker, CMD_REG:
+//      version 1, command 1, pong port 2, ping port 2, hubid s, worker id s
+//  numbers are in network order, s is a 1-byte length then the bytes,
+//  S a 4-byte length then the bytes, as in the bsend/brecv picture codec
+#define SRCLHD2 "SRCL020"
+#define SRWOHD2 "SRWO020"
+
+// clients and workers open with a version 1 CMD_REQ or CMD_REG whose value
+// is HUB_UPGRADE and their version. A version 1 hub ignores the value and
+// answers in text; a version 2 hub answers in binary and both go on in it
+#define HUB_UPGRADE "protocol "
+
+// hub to hub on the registrar, followed by one binary frame:
+//  snapshot request:
+//      version 1, command 1
+//  snapshot reply, also to a client CMD_DIRECTORY:
+//      version 1, command 1, uuid s, sequence 8, count 4,
+//      then count times worker id s, name s, address s
+#define SRHBHD2 "SRHB020"
+
+// worker deltas, one binary frame:
+//      sequence 8, type 1, ADD: worker id s, name s, address s
+//                          REMOVE: worker id s
+//  a beat repeats the last sequence, so a lost last delta is seen too.
+//  On the federation publisher after a uuid frame, on the notifier
+//  after a HUB_DIRECTORY frame
+#define HUB_DIRECTORY      "QDIR"
+#define HUB_DELTA_ADD      1
+#define HUB_DELTA_REMOVE   2
+#define HUB_DELTA_BEAT     3
+
+// hub beacon: "QHUB", version 1, registrar port 2, federation port 2, uuid 16
+#define HUB_BEACON         "QHUB"
+#define HUB_BEACON_SIZE    25
+
+// pongs taken in one go before the registrar gets its turn
+#define HUB_PONG_BATCH     1024
+
+// msecs a client leaves a worker it couldn't connect to to the hub
+#define HUB_DIRECT_BACKOFF 2000
+
 //
 #include "hub_p.h"
 
-QHubPrivate::QHubPrivate(QHub *parent): q_ptr(parent), QThread(parent)
+//  Network data encoding macros
+#define PUT_NUMBER1(host) { \
+    *(byte *) needle = (byte) (host); \
+    needle++; \
+    }
+
+#define PUT_NUMBER2(host) { \
+    needle [0] = (byte) (((host) >> 8)  & 255); \
+    needle [1] = (byte) (((host))       & 255); \
+    needle += 2; \
+    }
+
+#define PUT_NUMBER4(host) { \
+    needle [0] = (byte) (((host) >> 24) & 255); \
+    needle [1] = (byte) (((host) >> 16) & 255); \
+    needle [2] = (byte) (((host) >> 8)  & 255); \
+    needle [3] = (byte) (((host))       & 255); \
+    needle += 4; \
+    }
+
+#define PUT_NUMBER8(host) { \
+    needle [0] = (byte) (((host) >> 56) & 255); \
+    needle [1] = (byte) (((host) >> 48) & 255); \
+    needle [2] = (byte) (((host) >> 40) & 255); \
+    needle [3] = (byte) (((host) >> 32) & 255); \
+    needle [4] = (byte) (((host) >> 24) & 255); \
+    needle [5] = (byte) (((host) >> 16) & 255); \
+    needle [6] = (byte) (((host) >> 8)  & 255); \
+    needle [7] = (byte) (((host))       & 255); \
+    needle += 8; \
+    }
+
+#define PUT_STRING(host) { \
+    int string_size = qMin((host).size(), 255); \
+    PUT_NUMBER1 (string_size); \
+    memcpy (needle, (host).constData(), string_size); \
+    needle += string_size; \
+    }
+
+#define GET_NUMBER1(host) { \
+    if (needle + 1 > ceiling) \
+        return false; \
+    (host) = *(byte *) needle; \
+    needle++; \
+    }
+
+#define GET_NUMBER2(host) { \
+    if (needle + 2 > ceiling) \
+        return false; \
+    (host) = ((uint16_t) (needle [0]) << 8) \
+           +  (uint16_t) (needle [1]); \
+    needle += 2; \
+    }
+
+#define GET_NUMBER4(host) { \
+    if (needle + 4 > ceiling) \
+        return false; \
+    (host) = ((uint32_t) (needle [0]) << 24) \
+           + ((uint32_t) (needle [1]) << 16) \
+           + ((uint32_t) (needle [2]) << 8) \
+           +  (uint32_t) (needle [3]); \
+    needle += 4; \
+    }
+
+#define GET_NUMBER8(host) { \
+    if (needle + 8 > ceiling) \
+        return false; \
+    (host) = ((uint64_t) (needle [0]) << 56) \
+           + ((uint64_t) (needle [1]) << 48) \
+           + ((uint64_t) (needle [2]) << 40) \
+           + ((uint64_t) (needle [3]) << 32) \
+           + ((uint64_t) (needle [4]) << 24) \
+           + ((uint64_t) (needle [5]) << 16) \
+           + ((uint64_t) (needle [6]) << 8) \
+           +  (uint64_t) (needle [7]); \
+    needle += 8; \
+    }
+
+//  Strings are not copied, host points into the frame
+#define GET_STRING(host, size) { \
+    GET_NUMBER1 (size); \
+    if (needle + (size) > ceiling) \
+        return false; \
+    (host) = (const char *) needle; \
+    needle += (size); \
+    }
+
+#define GET_LONGSTR(host, size) { \
+    GET_NUMBER4 (size); \
+    if ((size) < 0 || needle + (size) > ceiling) \
+        return false; \
+    (host) = (const char *) needle; \
+    needle += (size); \
+    }
+
+static bool s_frame_is(Frame *frame, const char *data)
+{
+    int size = (int) strlen (data);
+    return frame && frame->size() == size
+        && memcmp (frame->constData(), data, size) == 0;
+}
+
+//  Encode a version 2 command from a client or worker
+
+static QByteArray s_encode_command(int command, const QByteArray &address,
+                                   const QByteArray &name, const QByteArray &value)
+{
+    QByteArray body;
+    body.resize(2 + 1 + qMin(address.size(), 255) + 1 + qMin(name.size(), 255)
+                + 4 + value.size());
+    byte *needle = (byte *) body.data();
+    PUT_NUMBER1 (HUB_PROTOCOL);
+    PUT_NUMBER1 (command);
+    PUT_STRING (address);
+    PUT_STRING (name);
+    PUT_NUMBER4 (value.size());
+    memcpy (needle, value.constData(), value.size());
+    return body;
+}
+
+//  Hub reply to CMD_REG, version 2
+
+class HubRegistration {
+public:
+    bool decode(Frame* frame);
+
+    int version;
+    int command;
+    int pong_port;
+    int ping_port;
+    const char* hubid;
+    int hubid_size;
+    const char* wid;
+    int wid_size;
+};
+
+bool HubRegistration::decode(Frame *frame)
 {
-    registrar = srnet->createSocket(ZMQ_ROUTER);
-    ping = srnet->createSocket(ZMQ_PUB);
-    pong = srnet->createSocket(ZMQ_ROUTER);
-    monitor = srnet->createSocket(ZMQ_SUB);
-    notifier = srnet->createSocket(ZMQ_PUB);
+    const byte *needle = (const byte *) frame->constData();
+    const byte *ceiling = needle + frame->size();
+    GET_NUMBER1 (version);
+    GET_NUMBER1 (command);
+    GET_NUMBER2 (pong_port);
+    GET_NUMBER2 (ping_port);
+    GET_STRING (hubid, hubid_size);
+    GET_STRING (wid, wid_size);
+    return true;
+}
+
+bool HubCommand::decode(Frame *frame)
+{
+    const byte *needle = (const byte *) frame->constData();
+    const byte *ceiling = needle + frame->size();
+    GET_NUMBER1 (version);
+    GET_NUMBER1 (command);
+    GET_STRING (address, address_size);
+    GET_STRING (name, name_size);
+    GET_LONGSTR (value, value_size);
+    return version >= 2;
+}
+
+//  Snapshot of a hub, workers are copied out of the frame; on error the
+//  directory is left half loaded
+
+bool WorkerDirectory::load(Frame *frame, int expected, QByteArray *uuid)
+{
+    const byte *needle = (const byte *) frame->constData();
+    const byte *ceiling = needle + frame->size();
+    int version, command, size;
+    quint32 count;
+    const char *str;
+    GET_NUMBER1 (version);
+    GET_NUMBER1 (command);
+    if (command != expected)
+        return false;
+    GET_STRING (str, size);
+    if (uuid)
+        *uuid = QByteArray(str, size);
+    GET_NUMBER8 (sequence);
+    GET_NUMBER4 (count);
+
+    workers.clear();
+    names.clear();
+    for (quint32 index = 0; index < count; index++) {
+        GET_STRING (str, size);
+        QByteArray wid(str, size);
+        RemoteWorker &w = workers [wid];
+        GET_STRING (str, size);
+        w.name = QString::fromUtf8(str, size);
+        GET_STRING (str, size);
+        w.address = QString::fromLatin1(str, size);
+        names [w.name].append(wid);
+    }
+    return true;
+}
+
+static bool s_decode_delta(const QByteArray &delta, quint64 &sequence, int &type,
+                           QByteArray &wid, RemoteWorker &worker)
+{
+    const byte *needle = (const byte *) delta.constData();
+    const byte *ceiling = needle + delta.size();
+    int size;
+    const char *str;
+    GET_NUMBER8 (sequence);
+    GET_NUMBER1 (type);
+    if (type == HUB_DELTA_BEAT)
+        return true;
+    GET_STRING (str, size);
+    wid = QByteArray(str, size);
+    if (type == HUB_DELTA_REMOVE)
+        return true;
+    GET_STRING (str, size);
+    worker.name = QString::fromUtf8(str, size);
+    GET_STRING (str, size);
+    worker.address = QString::fromLatin1(str, size);
+    return type == HUB_DELTA_ADD;
+}
+
+WorkerDirectory::Result WorkerDirectory::apply(const QByteArray &delta)
+{
+    quint64 seq;
+    int type;
+    QByteArray wid;
+    RemoteWorker worker;
+    if(!s_decode_delta(delta, seq, type, wid, worker))
+        return Invalid;
+
+    if(seq <= sequence)
+        return Stale;           // in our table already
+    if(type == HUB_DELTA_BEAT || seq != sequence + 1)
+        return Gap;             // we lost deltas
+
+    sequence = seq;
+    QHash<QByteArray, RemoteWorker>::iterator it = workers.find(wid);
+    if(it != workers.end())
+    {
+        QList<QByteArray> &ids = names [it->name];
+        ids.removeOne(wid);
+        if(ids.isEmpty())
+            names.remove(it->name);
+        workers.erase(it);
+    }
+    if(type == HUB_DELTA_ADD)
+    {
+        workers.insert(wid, worker);
+        names [worker.name].append(wid);
+    }
+    return Applied;
+}
+
+QHubPrivate::QHubPrivate(QHub *parent, const QString &tag): q_ptr(parent), QThread(parent)
+{
+    this->tag = tag;
+    registrar = srnet->createSocket(ZMQ_ROUTER, "tcp://*", tag);
+    ping = srnet->createSocket(ZMQ_PUB, "tcp://*", tag);
+    pong = srnet->createSocket(ZMQ_ROUTER, "tcp://*", tag);
+    monitor = srnet->createSocket(ZMQ_SUB, "tcp://*", tag);
+    notifier = srnet->createSocket(ZMQ_PUB, "tcp://*", tag);
 
     hport = registrar->bind("tcp://*:*[5000-]");
     Q_ASSERT_X(hport != -1, "HUB create", "registrar binding");
@@ -40,17 +340,28 @@ QHubPrivate::QHubPrivate(QHub *parent): q_ptr(parent), QThread(parent)
     terminate = true;
     heartbeat = 2000; // 2 sec
     liveness = 2; // 4 sec and then remove worker
-    heartbeat_at = QDateTime::currentDateTime().addMSecs(heartbeat);
+    heartbeat_at = clock_mono() + heartbeat;
 
     m_timer = new QTimer(this);
     m_timer->setInterval(heartbeat / 2);
     connect(m_timer, SIGNAL(timeout()), this, SLOT(pubPing()));
     hubid = QString("hub1:%1").arg(hport);
+    hubid_data = hubid.toLatin1();
+
+    m_pick = 0;
+    beacon_port = 0;
+    fport = 0;
+    uuid = QUuid::createUuid().toRfc4122();
+    sequence = 0;
+    beacon = 0;
+    feed = 0;
+    peers = 0;
 }
 
 QHubPrivate::~QHubPrivate() {
     terminate = true;
     wait();
+    stopFederation();
 
     if(m_workers.values().count() > 0)
     {
@@ -67,23 +378,100 @@ QHubPrivate::~QHubPrivate() {
     delete notifier;
 }
 
+void WorkerHeap::place(int index, Worker_t *w)
+{
+    heap [index] = w;
+    w->heap_index = index;
+}
+
+void WorkerHeap::siftUp(int index)
+{
+    Worker_t* w = heap [index];
+    while(index > 0) {
+        int parent = (index - 1) / 2;
+        if(heap [parent]->expiry <= w->expiry)
+            break;
+        place(index, heap [parent]);
+        index = parent;
+    }
+    place(index, w);
+}
+
+void WorkerHeap::siftDown(int index)
+{
+    Worker_t* w = heap [index];
+    int count = heap.size();
+    while(true) {
+        int child = 2 * index + 1;
+        if(child >= count)
+            break;
+        if(child + 1 < count && heap [child + 1]->expiry < heap [child]->expiry)
+            child++;
+        if(w->expiry <= heap [child]->expiry)
+            break;
+        place(index, heap [child]);
+        index = child;
+    }
+    place(index, w);
+}
+
+void WorkerHeap::push(Worker_t *w)
+{
+    heap.append(w);
+    siftUp(heap.size() - 1);
+}
+
+void WorkerHeap::remove(Worker_t *w)
+{
+    int index = w->heap_index;
+    if(index < 0 || index >= heap.size() || heap [index] != w)
+        return;
+    Worker_t* last = heap.last();
+    heap.removeLast();
+    w->heap_index = -1;
+    if(last != w) {
+        place(index, last);
+        siftUp(index);
+        siftDown(last->heap_index);
+    }
+}
+
+void WorkerHeap::update(Worker_t *w)
+{
+    if(w->heap_index < 0)
+        return;
+    siftUp(w->heap_index);
+    siftDown(w->heap_index);
+}
+
+//  Only expired workers are looked at. One we heard from since its expiry
+//  was set, or that is busy, gets a new one; one that missed its pong
+//  loses a life and is looked at again a heartbeat later.
+
 void QHubPrivate::purge()
 {
-    QMap<QString, Worker_t*>::iterator bit = m_workers.begin();
-    for(;bit != m_workers.end();) {
-        Worker_t* w = bit.value();
-        if(w->expiry < QDateTime::currentDateTime())
+    qint64 now = clock_mono();
+    Worker_t* w;
+    while((w = m_expiry.top()) && w->expiry < now) {
+        if(w->seen > w->expiry - heartbeat || w->busy_until > now)
         {
-            if(w->liveness-- <= 0)
-            {
-                m_workers.erase(bit++);
-                removeWorkerFromHash(w);
-                delete w;
-            }
-            else
-                ++bit;
+            w->expiry = qMax(w->seen, w->busy_until) + heartbeat;
+            w->liveness = liveness;
+            m_expiry.update(w);
+        }
+        else if(w->liveness-- <= 0)
+        {
+            m_expiry.remove(w);
+            m_workers.remove(w->id);
+            removeWorkerFromHash(w);
+            workerRemoved(w);
+            delete w;
+        }
+        else
+        {
+            w->expiry = now + heartbeat;
+            m_expiry.update(w);
         }
-        else ++bit;
     }
 }
 
@@ -111,7 +499,9 @@ bool QHubPrivate::removeWorker(Worker_t *w, bool d)
     if(rw)
     {
         removeWorkerFromHash(rw, d);
+        m_expiry.remove(rw);
         m_workers.remove(rw->id);
+        workerRemoved(rw);
         delete rw;
         return true;
     }
@@ -149,7 +539,12 @@ bool QHubPrivate::removeWorkerFromHash(Worker_t *w, bool d)
 void QHubPrivate::appendWorker(Client_t *c, Worker_t *w)
 {
     if(!m_clients.contains(c->id)) m_clients.insert(c->id, c);
-    if(!m_workers.contains(w->id)) m_workers.insert(w->id, w);
+    if(!m_workers.contains(w->id)) {
+        m_workers.insert(w->id, w);
+        w->heap_index = -1;
+        m_expiry.push(w);
+        workerAdded(w);
+    }
 
     if(!m_cw.keys().contains(c))
     {
@@ -164,6 +559,30 @@ void QHubPrivate::appendWorker(const Worker_t &w)
 {
     Worker_t* nw = new Worker_t(w);
     m_workers.insert(nw->id, nw);
+    m_expiry.push(nw);
+    workerAdded(nw);
+}
+
+void QHubPrivate::workerAdded(Worker_t *w)
+{
+    if(!w->identity.isEmpty())
+        m_identities.insert(w->identity, w);
+    m_names [w->name]++;
+    if(w->address.startsWith("tcp://"))
+        m_direct [w->name].append(w);
+    publishDelta(HUB_DELTA_ADD, w);
+}
+
+void QHubPrivate::workerRemoved(Worker_t *w)
+{
+    if(m_identities.value(w->identity) == w)
+        m_identities.remove(w->identity);
+    if(--m_names [w->name] <= 0)
+        m_names.remove(w->name);
+    QHash<QString, QList<Worker_t*> >::iterator it = m_direct.find(w->name);
+    if(it != m_direct.end() && it->removeOne(w) && it->isEmpty())
+        m_direct.erase(it);
+    publishDelta(HUB_DELTA_REMOVE, w);
 }
 
 void QHubPrivate::appendClient(const Client_t &c)
@@ -172,119 +591,606 @@ void QHubPrivate::appendClient(const Client_t &c)
     m_clients.insert(nc->id, nc);
 }
 
+//  Version 1 commands are "command-value" with sender info "address%name";
+//  they are turned into a HubCommand and handled as version 2 ones
+
+static bool s_parse_v1(HubCommand &cmd, const QByteArray &command,
+                       const QByteArray &senderinfo)
+{
+    int split = senderinfo.indexOf('%');
+    int dash = command.indexOf('-');
+    if (split < 0 || dash < 0)
+        return false;
+
+    cmd.version = 1;
+    cmd.command = command.left(dash).toInt();
+    cmd.address = senderinfo.constData();
+    cmd.address_size = split;
+    cmd.name = senderinfo.constData() + split + 1;
+    cmd.name_size = senderinfo.size() - split - 1;
+    cmd.value = command.constData() + dash + 1;
+    cmd.value_size = command.size() - dash - 1;
+    return true;
+}
+
+//  Version a text CMD_REQ or CMD_REG asks to go on in, 1 if it doesn't
+
+static int s_upgrade(HubCommand &cmd)
+{
+    int size = (int) strlen (HUB_UPGRADE);
+    if((cmd.command != CMD_REQ && cmd.command != CMD_REG)
+            || cmd.value_size <= size
+            || memcmp (cmd.value, HUB_UPGRADE, size) != 0)
+        return 1;
+
+    int version = QByteArray(cmd.value + size, cmd.value_size - size).toInt();
+    cmd.version = qBound(1, version, HUB_PROTOCOL);
+    cmd.value_size = 0;
+    return cmd.version;
+}
+
 void QHubPrivate::clientQuery(Frame *command, Frame *senderinfo, Frame* sender)
 {
-    QString sinf = senderinfo->toString();
-    QStringList info = sinf.split('%');
+    QByteArray info = senderinfo->bdata();
+    QByteArray cmds = command->bdata();
+    HubCommand cmd;
+    if(!s_parse_v1(cmd, cmds, info))
+    {
+        qWarning() << "Command isnt Client Valid: " << cmds << info;
+        return;
+    }
+    clientCommand(cmd, sender, s_upgrade(cmd));
+}
+
+void QHubPrivate::workerRequest(Frame *command, Frame *senderinfo, Frame* sender)
+{
+    QByteArray info = senderinfo->bdata();
+    QByteArray cmds = command->bdata();
+    HubCommand cmd;
+    if(!s_parse_v1(cmd, cmds, info))
+    {
+        qWarning() << "Command isn't Worker Valid: " << cmds << info;
+        return;
+    }
+    workerCommand(cmd, sender, s_upgrade(cmd));
+}
+
+//  Version 2 reply: envelope, header and one binary frame
+
+void QHubPrivate::sendReply(Frame *sender, const char *header, const void *body, int size)
+{
+    sender->send(*registrar, QFRAME_MORE | QFRAME_REUSE);
+    registrar->sendmem("", 0, QFRAME_MORE);
+    registrar->sendmem(header, strlen (header), QFRAME_MORE);
+    registrar->sendmem(body, size, 0);
+}
 
-    if(info.count() < 2)
+void QHubPrivate::sendEndpoint(Frame *sender, int version, int command,
+                               bool found, const QByteArray &endpoint)
+{
+    byte body [4 + 256];
+    byte *needle = body;
+    PUT_NUMBER1 (qMin(version, HUB_PROTOCOL));
+    PUT_NUMBER1 (command);
+    PUT_NUMBER1 (found);
+    PUT_STRING (endpoint);
+    sendReply(sender, SRCLHD2, body, needle - body);
+}
+
+//  Clients and workers are looked up by their router identity as is, only
+//  a new one pays for a copy
+
+void QHubPrivate::clientCommand(const HubCommand &cmd, Frame *sender, int version)
+{
+    Client_t* client = m_clients.value(QByteArray::fromRawData(
+                    (const char *) sender->constData(), sender->size()), NULL);
+
+    if(cmd.command == CMD_FIND && version >= 2)
     {
-        qWarning() << "Sender info isnt Client Valid: " << info;
+        // we don't proxy, client asks the hub we name itself
+        bool found;
+        QByteArray endpoint = nearestHub(QString::fromUtf8(cmd.value, cmd.value_size),
+                                         &found).toLatin1();
+        sendEndpoint(sender, cmd.version, CMD_FIND, found, endpoint);
         return;
     }
-    Client_t c; c.id = sender->hexString(); c.address = info.at(0); c.name = info.at(1);
 
-    QStringList cmds = command->toString().split('-');
-    if(cmds.count() < 1)
+    if(cmd.command == CMD_WORKER_ADDR && version >= 2)
     {
-        qWarning() << "Commands isnt Client Valid: " << cmds;
+        // only the introduction, payloads go to the worker itself
+        QString name = QString::fromUtf8(cmd.value, cmd.value_size);
+        QList<Worker_t*> direct = m_direct.value(name);
+        QByteArray endpoint;
+        if(!direct.isEmpty())
+            endpoint = direct [m_pick++ % direct.size()]->address.toLatin1();
+        sendEndpoint(sender, cmd.version, CMD_WORKER_ADDR, !direct.isEmpty(), endpoint);
         return;
     }
 
-    if(!m_clients.contains(c.id) && cmds.at(0).toInt() == CMD_REQ)
+    if(cmd.command == CMD_DIRECTORY && version >= 2)
+    {
+        QByteArray reply = snapshot(CMD_DIRECTORY);
+        sendReply(sender, SRCLHD2, reply.constData(), reply.size());
+        return;
+    }
+
+    if(!client && cmd.command == CMD_REQ)
     {
         // send to client needed port numbers, non blocking
         registrar->setSndtimeo(0);
 
-        Messages msg;
-        msg.push(QString::number(nport));
-        msg.push(QString::number(CMD_REQ)); // command
-        msg.push(SRCLHD);
-        msg.wrap(new Frame(*sender));
-        msg.send(*registrar);
+        if(version >= 2)
+        {
+            byte body [4];
+            byte *needle = body;
+            PUT_NUMBER1 (qMin(cmd.version, HUB_PROTOCOL));
+            PUT_NUMBER1 (CMD_REQ);
+            PUT_NUMBER2 (nport);
+            sendReply(sender, SRCLHD2, body, needle - body);
+        }
+        else
+        {
+            Messages msg;
+            msg.push(QString::number(nport));
+            msg.push(QString::number(CMD_REQ)); // command
+            msg.push(SRCLHD);
+            msg.wrap(new Frame(*sender));
+            msg.send(*registrar);
+        }
 
+        Client_t c;
+        c.id = sender->bdata();
+        c.address = QString::fromLatin1(cmd.address, cmd.address_size);
+        c.name = QString::fromUtf8(cmd.name, cmd.name_size);
         appendClient(c);
         return;
     }
 
-    if(cmds.at(0).toInt() == CMD_STATE)
+    if(cmd.command == CMD_STATE && cmd.value_size == 12
+            && memcmp (cmd.value, "Disconnected", 12) == 0)
+    {
+        if(client)
+            removeClient(client);
+        return;
+    }
+
+    if(client)
+        client->requests.insert(cmd.command, QString::fromUtf8(cmd.value, cmd.value_size));
+}
+
+void QHubPrivate::workerCommand(const HubCommand &cmd, Frame *sender, int version)
+{
+    Worker_t* known = m_identities.value(QByteArray::fromRawData(
+                    (const char *) sender->constData(), sender->size()), NULL);
+    QByteArray id = known ? known->id : sender->bdata().toHex().toUpper();
+
+    if(cmd.command == CMD_REG)
+    {
+        if(version >= 2)
+        {
+            const QByteArray &hid = hubid_data;
+            const QByteArray &wid = id;
+            byte body [6 + 2 * 256];
+            byte *needle = body;
+            PUT_NUMBER1 (qMin(cmd.version, HUB_PROTOCOL));
+            PUT_NUMBER1 (CMD_REG);
+            PUT_NUMBER2 (poport);
+            PUT_NUMBER2 (pport);
+            PUT_STRING (hid);
+            PUT_STRING (wid);
+            sendReply(sender, SRWOHD2, body, needle - body);
+        }
+        else
+        {
+            Messages msg;
+            msg.push(id.constData(), id.size());
+            msg.push(hubid);
+            msg.push(QString::number(pport));
+            msg.push(QString::number(poport));
+            msg.push(QString::number(CMD_REG)); // command
+            msg.push(SRWOHD);
+            msg.wrap(new Frame(*sender));
+            msg.send(*registrar);
+        }
+
+        notifyClients("Connected Worker: " + QString::fromUtf8(cmd.name, cmd.name_size)
+                      + " | Worker State: avail");
+    }
+
+
+    // first initialization of heartbeat
+    if(m_workers.count() == 0)
+        heartbeat_at = clock_mono() + heartbeat;
+
+    qint64 now = clock_mono();
+    if(known)
     {
-        if(cmds.at(1) == "Disconnected")
+        // any command is as good as a pong
+        known->seen = now;
+        if(cmd.command == CMD_BUSY)
         {
-            removeClient(&c);
-            return;
+            // worker won't pong for value msecs, 0 when it is idle again
+            QByteArray value(cmd.value, cmd.value_size);
+            known->busy_until = now + qMax(value.toInt(), 0);
         }
     }
+    else
+    {
+        Worker_t w;
+        w.id = id;
+        w.identity = sender->bdata();
+        w.address = QString::fromLatin1(cmd.address, cmd.address_size);
+        w.name = QString::fromUtf8(cmd.name, cmd.name_size);
+        w.expiry = now + heartbeat;
+        w.seen = now;
+        w.busy_until = 0;
+        w.liveness = liveness;
+        w.heap_index = -1;
+        appendWorker(w);
+    }
+}
 
-    m_clients.value(c.id)->requests.insert(cmds.at(0).toInt(), cmds.at(1));
+//  Pong identity is the worker id we gave it, looked up as is; purge
+//  does the rest
+
+void QHubPrivate::workerPong(Frame *sender, qint64 now)
+{
+    Worker_t* w = m_workers.value(QByteArray::fromRawData(
+                    (const char *) sender->constData(), sender->size()), NULL);
+    if(w)
+        w->seen = now;
 }
 
-void QHubPrivate::workerRequest(Frame *command, Frame *senderinfo, Frame* sender)
+//  Federation: hubs find each other by beacon on beacon_port, each one
+//  publishes its worker changes as numbered deltas and answers snapshot
+//  requests on its registrar. Started in the hub thread.
+
+void QHubPrivate::startFederation()
 {
-    QString sinfo = senderinfo->toString();
-    QStringList info = sinfo.split('%');
+    if(!beacon_port || beacon)
+        return;
 
-    if(info.count() < 2)
+    beacon = new ActorSocket(qbeacon, NULL);
+    beacon->send("si", "CONFIGURE", beacon_port);
+    if(beacon->recvstr().isEmpty())
     {
-        qWarning() << "Sender info isn't Worker Valid: " << info;
+        qWarning("QHub: no UDP broadcasting, federation is off");
+        delete beacon;
+        beacon = 0;
         return;
     }
-    Worker_t w; w.id = sender->hexString(); w.address = info.at(0); w.name = info.at(1);
-    w.expiry = QDateTime::currentDateTime().addMSecs(heartbeat);
-    w.liveness = liveness;
 
-    QStringList cmds = command->toString().split('-');
-    if(cmds.count() < 2)
+    feed = srnet->createSocket(ZMQ_PUB, "tcp://*", tag);
+    fport = feed->bind("tcp://*:*[%d-]", nport);
+    Q_ASSERT_X(fport != -1, "HUB federation", "feed binding");
+
+    peers = srnet->createSocket(ZMQ_SUB, "tcp://", tag);
+    peers->setSubscribe("");
+
+    byte payload [HUB_BEACON_SIZE];
+    byte *needle = payload;
+    memcpy (needle, HUB_BEACON, 4);
+    needle += 4;
+    PUT_NUMBER1 (HUB_PROTOCOL);
+    PUT_NUMBER2 (hport);
+    PUT_NUMBER2 (fport);
+    memcpy (needle, uuid.constData(), 16);
+
+    beacon->send("si", "TRACK", heartbeat * (liveness + 1));
+    beacon->send("sbi", "PUBLISH", payload, HUB_BEACON_SIZE, heartbeat / 2);
+    beacon->send("sb", "SUBSCRIBE", HUB_BEACON, 4);
+}
+
+void QHubPrivate::stopFederation()
+{
+    foreach (RemoteHub* r, m_remotes) {
+        delete r->dealer;
+        delete r;
+    }
+    m_remotes.clear();
+    m_beacons.clear();
+
+    delete peers;
+    delete feed;
+    delete beacon;
+    peers = 0;
+    feed = 0;
+    beacon = 0;
+}
+
+void QHubPrivate::publishDelta(int type, Worker_t *w)
+{
+    if(type != HUB_DELTA_BEAT)
+        sequence++;
+
+    byte body [9 + 3 * 256];
+    byte *needle = body;
+    PUT_NUMBER8 (sequence);
+    PUT_NUMBER1 (type);
+    if(type != HUB_DELTA_BEAT)
+        PUT_STRING (w->id);
+    if(type == HUB_DELTA_ADD)
+    {
+        QByteArray name = w->name.toUtf8();
+        QByteArray address = w->address.toLatin1();
+        PUT_STRING (name);
+        PUT_STRING (address);
+    }
+
+    // clients keep their directory from these
+    notifier->sendmem(HUB_DIRECTORY, strlen (HUB_DIRECTORY), QFRAME_MORE);
+    notifier->sendmem(body, needle - body, 0);
+
+    if(feed)
     {
-        qWarning() << "Commands isnt Worker Valid: " << cmds;
+        feed->sendmem(uuid.constData(), uuid.size(), QFRAME_MORE);
+        feed->sendmem(body, needle - body, 0);
+    }
+}
+
+//  Beacon events are JOIN, UPDATE or EXPIRE, peer address, peer key,
+//  payload. The key names the beacon, so a hub keeps it while it lives;
+//  an UPDATE with other ports or uuid is a hub restarted in its place.
+
+void QHubPrivate::beaconEvent()
+{
+    Messages event;
+    event.recv(*beacon);
+    if(event.size() != 4)
+        return;
+
+    Frame* payload = event.last();
+    const byte *needle = (const byte *) payload->constData();
+    if(payload->size() < HUB_BEACON_SIZE
+            || memcmp (needle, HUB_BEACON, 4) != 0
+            || needle [4] < 2)
+        return;
+
+    int hubport = (needle [5] << 8) | needle [6];
+    int feedport = (needle [7] << 8) | needle [8];
+    QByteArray id((const char *) needle + 9, 16);
+
+    QString address = event.at(1)->toString();
+    QByteArray key = event.at(2)->toByteArray();
+    RemoteHub* known = m_beacons.value(key, NULL);
+    if(s_frame_is(event.first(), "EXPIRE"))
+    {
+        if(known)
+            removeRemote(known);
         return;
     }
+    if(known && (known->uuid != id
+            || known->endpoint != QString("tcp://%1:%2").arg(address).arg(hubport)
+            || known->feed != QString("tcp://%1:%2").arg(address).arg(feedport)))
+        removeRemote(known);
 
-    if(cmds.at(0).toInt() == CMD_REG)
+    RemoteHub* r = m_remotes.value(id, NULL);
+    if(!r)
     {
-        Messages msg;
-        msg.push(w.id);
-        msg.push(hubid);
-        msg.push(QString::number(pport));
-        msg.push(QString::number(poport));
-        msg.push(QString::number(CMD_REG)); // command
-        msg.push(SRWOHD);
-        msg.wrap(new Frame(*sender));
-        msg.send(*registrar);
+        addRemote(id, address, hubport, feedport);
+        r = m_remotes.value(id, NULL);
+    }
+    // a hub heard under another key is known by the latest one
+    if(r->beacon != key)
+    {
+        m_beacons.remove(r->beacon);
+        r->beacon = key;
+        m_beacons.insert(key, r);
+    }
+}
 
-        notifyClients("Connected Worker: " + w.name + " | Worker State: avail");
+void QHubPrivate::addRemote(const QByteArray &id, const QString &address,
+                            int hubport, int feedport)
+{
+    RemoteHub* r = new RemoteHub;
+    r->uuid = id;
+    r->endpoint = QString("tcp://%1:%2").arg(address).arg(hubport);
+    r->feed = QString("tcp://%1:%2").arg(address).arg(feedport);
+    r->dealer = srnet->createSocket(ZMQ_DEALER, r->endpoint, tag);
+    r->dealer->setSndtimeo(0);
+    r->dealer->connect("%s", r->endpoint.toLatin1().constData());
+    r->syncing = false;
+    r->asked_at = 0;
+    r->rtt = 0;
+    r->expiry = clock_mono() + heartbeat * (liveness + 1);
+
+    peers->connect("%s", r->feed.toLatin1().constData());
+    m_remotes.insert(id, r);
+    requestSnapshot(r);
+}
+
+void QHubPrivate::removeRemote(RemoteHub *r)
+{
+    peers->disconnect("%s", r->feed.toLatin1().constData());
+    m_remotes.remove(r->uuid);
+    if(m_beacons.value(r->beacon, NULL) == r)
+        m_beacons.remove(r->beacon);
+    delete r->dealer;
+    delete r;
+}
+
+//  Drop hubs that went silent, and ask again for snapshots not answered
+//  in a heartbeat
+
+void QHubPrivate::purgeRemotes()
+{
+    qint64 now = clock_mono();
+    foreach (RemoteHub* r, m_remotes.values()) {
+        if(r->expiry < now)
+            removeRemote(r);
+        else if(r->syncing && now - r->asked_at > heartbeat)
+            requestSnapshot(r);
     }
+}
 
+void QHubPrivate::requestSnapshot(RemoteHub *r)
+{
+    byte body [2];
+    byte *needle = body;
+    PUT_NUMBER1 (HUB_PROTOCOL);
+    PUT_NUMBER1 (CMD_HUB_SNAPSHOT);
+
+    r->dealer->sendmem("", 0, QFRAME_MORE);
+    r->dealer->sendmem(SRHBHD2, strlen (SRHBHD2), QFRAME_MORE);
+    r->dealer->sendmem(body, needle - body, 0);
+    r->syncing = true;
+    r->asked_at = clock_mono();
+}
 
-    // first initialization of heartbeat
-    if(m_workers.count() == 0)
-        heartbeat_at = QDateTime::currentDateTime().addMSecs(heartbeat);
+//  Snapshot request from another hub
 
-    if(!m_workers.contains(w.id))
-        appendWorker(w);
+void QHubPrivate::hubCommand(Frame *body, Frame *sender)
+{
+    const byte *data = (const byte *) body->constData();
+    if(body->size() < 2 || data [1] != CMD_HUB_SNAPSHOT)
+        return;
+
+    QByteArray reply = snapshot(CMD_HUB_SNAPSHOT);
+    sendReply(sender, SRHBHD2, reply.constData(), reply.size());
 }
 
-void QHubPrivate::workerPong(Frame *sender)
+//  All our workers and the sequence of our last delta
+
+QByteArray QHubPrivate::snapshot(int command)
 {
-    QString id = sender->toString(); // must be so carefull here
-    Worker_t* w = m_workers.value(id, NULL);
-    if(w)
+    QList<QByteArray> fields;
+    int size = 2 + 1 + uuid.size() + 8 + 4;
+    foreach (Worker_t* w, m_workers) {
+        fields << w->id << w->name.toUtf8() << w->address.toLatin1();
+    }
+    foreach (const QByteArray& field, fields) {
+        size += 1 + qMin(field.size(), 255);
+    }
+
+    QByteArray reply;
+    reply.resize(size);
+    byte *needle = (byte *) reply.data();
+    PUT_NUMBER1 (HUB_PROTOCOL);
+    PUT_NUMBER1 (command);
+    PUT_STRING (uuid);
+    PUT_NUMBER8 (sequence);
+    PUT_NUMBER4 (m_workers.count());
+    foreach (const QByteArray& field, fields) {
+        PUT_STRING (field);
+    }
+    return reply;
+}
+
+void QHubPrivate::snapshotReply(RemoteHub *r)
+{
+    Messages reply;
+    reply.recv(*r->dealer);
+
+    // empty, header, body
+    QByteArray id;
+    WorkerDirectory directory;
+    if(reply.size() != 3
+            || !s_frame_is(reply.at(1), SRHBHD2)
+            || !directory.load(reply.last(), CMD_HUB_SNAPSHOT, &id)
+            || id != r->uuid
+            || !r->syncing)
+        return;
+
+    qint64 now = clock_mono();
+    r->directory = directory;
+    r->syncing = false;
+    r->rtt = now - r->asked_at;
+    r->expiry = now + heartbeat * (liveness + 1);
+
+    // deltas newer than the snapshot, in the order they came
+    QList<QByteArray> pending = r->pending;
+    r->pending.clear();
+    foreach (const QByteArray& delta, pending) {
+        applyDelta(r, delta);
+    }
+}
+
+void QHubPrivate::feedMessage()
+{
+    Messages msg;
+    msg.recv(*peers);
+    if(msg.size() != 2)
+        return;
+
+    // a hub whose beacon we didn't see yet is learned on its beacon
+    Frame* id = msg.first();
+    RemoteHub* r = m_remotes.value(QByteArray::fromRawData(
+                    (const char *) id->constData(), id->size()), NULL);
+    if(!r)
+        return;
+
+    r->expiry = clock_mono() + heartbeat * (liveness + 1);
+    applyDelta(r, msg.last()->bdata());
+}
+
+void QHubPrivate::applyDelta(RemoteHub *r, const QByteArray &delta)
+{
+    if(r->syncing)
     {
-        w->expiry = QDateTime::currentDateTime().addMSecs(heartbeat);
-        w->liveness = liveness;
+        r->pending.append(delta);
+        return;
+    }
+
+    if(r->directory.apply(delta) == WorkerDirectory::Gap)
+    {
+        requestSnapshot(r);
+        r->pending.append(delta);
     }
 }
 
+//  Hub to ask for a worker: empty endpoint for us, else the hub with the
+//  shortest snapshot round trip that has one
+
+QString QHubPrivate::nearestHub(const QString &name, bool *found)
+{
+    *found = true;
+    if(m_names.contains(name))
+        return QString("");
+
+    RemoteHub* best = 0;
+    foreach (RemoteHub* r, m_remotes) {
+        if(r->directory.names.contains(name) && (!best || r->rtt < best->rtt))
+            best = r;
+    }
+    *found = best != 0;
+    return best ? best->endpoint : QString();
+}
+
 void QHubPrivate::run()
 {
     Q_Q(QHub);
 
+    startFederation();
+
+    // registrar, pong, then with federation beacon, peers and a
+    // dealer for each remote hub
+    QVector<zmq_pollitem_t> items;
+    QList<RemoteHub*> polled;
+    int generation = 0;
+
     while(!terminate) {
-        // add another sockets too
-        zmq_pollitem_t items[] = { { registrar->resolve(), 0, ZMQ_POLLIN, 0 },
-                                   { pong->resolve(), 0, ZMQ_POLLIN, 0} };
+        zmq_pollitem_t item = { 0, 0, ZMQ_POLLIN, 0 };
+        items.clear();
+        polled.clear();
+        item.socket = registrar->resolve();
+        items.append(item);
+        item.socket = pong->resolve();
+        items.append(item);
+        if(beacon)
+        {
+            item.socket = beacon->resolve();
+            items.append(item);
+            item.socket = peers->resolve();
+            items.append(item);
+            foreach (RemoteHub* r, m_remotes) {
+                item.socket = r->dealer->resolve();
+                items.append(item);
+                polled.append(r);
+            }
+        }
 
-        int rc = zmq_poll(items, 2, heartbeat);
+        long timeout = long(heartbeat_at - clock_mono());
+        int rc = zmq_poll(items.data(), items.size(), timeout > 0 ? timeout : 0);
         if(rc == -1) {
             // add error handling
             break;
@@ -295,60 +1201,100 @@ void QHubPrivate::run()
             Messages command;
             command.recv(*registrar);
 
-            if(command.size() <=4)
-                break;
-
-            // first sender identity
+            // first sender identity, then delimiter and header; version 2
+            // has one binary frame after the header, version 1 has two
             Frame* sender = command.pop();
-            QString empty = command.popstr();
-            if(empty != "") break;
-            QString header = command.popstr();
-
-            Frame* senderinfo = command.pop();
-            Frame* cmdinfo = command.pop();
-
-            if(header == SRCLHD)
-                clientQuery(cmdinfo, senderinfo, sender);
-            else if(header == SRWOHD)
-                workerRequest(cmdinfo, senderinfo, sender);
+            Frame* empty = command.pop();
+            Frame* header = command.pop();
+            HubCommand cmd;
+
+            if(!header || empty->size() != 0 || command.size() < 1)
+                qCritical() << "Invalid message";
+            else if(s_frame_is(header, SRCLHD2) && cmd.decode(command.first()))
+                clientCommand(cmd, sender, 2);
+            else if(s_frame_is(header, SRWOHD2) && cmd.decode(command.first()))
+                workerCommand(cmd, sender, 2);
+            else if(s_frame_is(header, SRHBHD2))
+                hubCommand(command.first(), sender);
+            else if(command.size() >= 2) {
+                Frame* senderinfo = command.pop();
+                Frame* cmdinfo = command.pop();
+
+                if(s_frame_is(header, SRCLHD))
+                    clientQuery(cmdinfo, senderinfo, sender);
+                else if(s_frame_is(header, SRWOHD))
+                    workerRequest(cmdinfo, senderinfo, sender);
+                else
+                    qCritical() << "Invalid message: " << header->toString();
+
+                delete cmdinfo;
+                delete senderinfo;
+            }
             else
-                qCritical() << "Invalid message: " << header;
+                qCritical() << "Invalid message: " << header->toString();
 
-            delete cmdinfo;
-            delete senderinfo;
+            delete header;
+            delete empty;
             delete sender;
         }
 
-        //  get pong to idle workers if needed
+        //  get pong to idle workers if needed, all that are queued
         if(items[1].revents & ZMQ_POLLIN) {
-            Messages msg;
-            msg.recv(*pong);
-
-            // worker pong identity
-            Frame* sender = msg.pop();
-            QString d = sender->toString();
-            QString empty = msg.popstr();
-            if(empty != "") break;
-
-            QString hid = msg.popstr();
-            assert(hid == hubid);
-
-            QString p = msg.popstr();
-            if(p != "Ping") break;
+            qint64 now = clock_mono();
+            int count = 0;
+            do {
+                Messages msg;
+                msg.recv(*pong);
+
+                // worker pong identity, empty, hub id, "Ping"
+                if(msg.size() == 4
+                        && msg.at(1)->size() == 0
+                        && s_frame_is(msg.at(2), hubid_data.constData())
+                        && s_frame_is(msg.at(3), "Ping"))
+                    workerPong(msg.first(), now);
+            } while(++count < HUB_PONG_BATCH && (pong->events() & ZMQ_POLLIN));
+        }
 
-            workerPong(sender);
-            delete sender;
+        if(beacon)
+        {
+            // snapshots first, a beacon event can remove a polled hub
+            for(int index = 0; index < polled.size(); index++) {
+                if(items [4 + index].revents & ZMQ_POLLIN)
+                    snapshotReply(polled [index]);
+            }
+            if(items [3].revents & ZMQ_POLLIN)
+                feedMessage();
+            if(items [2].revents & ZMQ_POLLIN)
+                beaconEvent();
         }
 
         //  Disconnect and delete any expired workers
-        if(QDateTime::currentDateTime() > heartbeat_at)
+        if(clock_mono() >= heartbeat_at)
         {
             purge(); // purge disconnected workers
             pubPing(); // publish ping to workers
-            heartbeat_at = QDateTime::currentDateTime().addMSecs(heartbeat);
+            publishDelta(HUB_DELTA_BEAT, 0); // tell peers our last delta
+            purgeRemotes(); // forget silent hubs
+            heartbeat_at = clock_mono() + heartbeat;
+        }
+
+        // retuned settings reach our sockets from this thread only
+        if(QMNet::configChanged(generation))
+        {
+            srnet->applyConfig(registrar);
+            srnet->applyConfig(ping);
+            srnet->applyConfig(pong);
+            srnet->applyConfig(monitor);
+            srnet->applyConfig(notifier);
+            srnet->applyConfig(feed);
+            srnet->applyConfig(peers);
+            foreach (RemoteHub* r, m_remotes) {
+                srnet->applyConfig(r->dealer);
+            }
         }
     }
 
+    stopFederation();
     terminate = true;
     emit q->finish();
 }
@@ -384,7 +1330,9 @@ void QHubPrivate::notifyClients(const QStringList &nmessage)
  *
  * **************************/
 
-QHub::QHub(QObject *parent) : d_ptr(new QHubPrivate(this)), QObject(parent){}
+QHub::QHub(QObject *parent) : d_ptr(new QHubPrivate(this, QString())), QObject(parent){}
+
+QHub::QHub(const QString &tag, QObject *parent) : d_ptr(new QHubPrivate(this, tag)), QObject(parent){}
 
 QHub::~QHub() { delete d_ptr; }
 
@@ -408,6 +1356,12 @@ int QHub::numberOfClients() const { Q_D(const QHub); return d->m_clients.count()
 
 int QHub::numberOfWorkers() const { Q_D(const QHub); return d->m_workers.count(); }
 
+void QHub::setFederation(int port) { Q_D(QHub); d->beacon_port = port; }
+
+int QHub::federationPort() const { Q_D(const QHub); return d->fport; }
+
+int QHub::numberOfPeers() const { Q_D(const QHub); return d->m_remotes.count(); }
+
 void QHub::startHUb()
 {
     Q_D(QHub);
@@ -423,6 +1377,262 @@ void QHub::stopHUb()
     d->wait();
 }
 
+static void s_sleep(int msecs)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+    QThread::msleep(msecs);
+#else
+    usleep(msecs * 1000);
+#endif
+}
+
+//  Answer one snapshot request on a fake hub registrar, with the given
+//  sequence and one worker of this name if any. False if none came.
+
+static bool s_fake_snapshot(Socket *registrar, const QByteArray &uuid,
+                            quint64 sequence, const QByteArray &name)
+{
+    Messages request;
+    if(!request.recv(*registrar))
+        return false;
+    assert (request.size() == 4);
+    assert (s_frame_is(request.at(2), SRHBHD2));
+    assert (request.last()->size() == 2);
+
+    QByteArray wid("FAKE");
+    QByteArray address("tcp://127.0.0.1:1");
+    byte body [64 + 3 * 256];
+    byte *needle = body;
+    PUT_NUMBER1 (HUB_PROTOCOL);
+    PUT_NUMBER1 (CMD_HUB_SNAPSHOT);
+    PUT_STRING (uuid);
+    PUT_NUMBER8 (sequence);
+    PUT_NUMBER4 (name.isEmpty() ? 0 : 1);
+    if(!name.isEmpty())
+    {
+        PUT_STRING (wid);
+        PUT_STRING (name);
+        PUT_STRING (address);
+    }
+    request.first()->send(*registrar, QFRAME_MORE);
+    registrar->sendmem("", 0, QFRAME_MORE);
+    registrar->sendmem(SRHBHD2, strlen (SRHBHD2), QFRAME_MORE);
+    registrar->sendmem(body, needle - body, 0);
+    return true;
+}
+
+void QHub::test(bool verbose)
+{
+    printf (" * qhub: ");
+    if (verbose)
+        printf ("\n");
+
+    //  @selftest
+    //  A busy worker outlives its liveness, and is purged once its busy
+    //  time is over
+    QHub *alone = new QHub;
+    alone->setHeartbeat(200);
+    alone->startHUb();
+    QWorker *busy = new QWorker("busy");
+    bool accepted = busy->registerToHub(
+                QString("tcp://127.0.0.1:%1").arg(alone->hubPort()), 1000);
+    assert (accepted);
+    busy->setBusy(1500);
+    s_sleep(100);
+    qint64 busy_at = clock_mono();
+    delete busy;
+    s_sleep(1000);              //  Three heartbeats would have done it
+    assert (alone->numberOfWorkers() == 1);
+    int attempt;
+    for (attempt = 0; attempt < 50; attempt++) {
+        if (alone->numberOfWorkers() == 0)
+            break;
+        s_sleep(100);
+    }
+    assert (alone->numberOfWorkers() == 0);
+    assert (clock_mono() - busy_at >= 1400);
+    delete alone;
+
+    //  Workers that stop ponging leave after liveness more heartbeats,
+    //  from wherever they sit in the expiry heap; the others stay
+    {
+        QHub table;
+        table.setHeartbeat(100);
+        QHubPrivate *d = table.d_func();
+        qint64 now = clock_mono();
+        int index;
+        for (index = 0; index < 16; index++) {
+            Worker_t w;
+            w.id = QByteArray::number(index);
+            w.name = "heap";
+            w.address = "127.0.0.1";
+            w.expiry = now + (index * 7) % 16;
+            w.seen = now;
+            w.busy_until = 0;
+            w.liveness = d->liveness;
+            w.heap_index = -1;
+            d->appendWorker(w);
+        }
+        //  One taken out by hand from the middle too
+        Worker_t *middle = d->m_workers.value("7");
+        assert (middle->heap_index > 0);
+        d->removeWorker(middle);
+
+        int round;
+        for (round = 0; round < d->liveness + 6; round++) {
+            s_sleep(110);
+            for (index = 1; index < 16; index += 2) {
+                Frame pong(QByteArray::number(index));
+                d->workerPong(&pong, clock_mono());
+            }
+            d->purge();
+        }
+        assert (d->m_workers.size() == 7);
+        Worker_t *top = d->m_expiry.top();
+        foreach (Worker_t* w, d->m_workers) {
+            assert (w->id.toInt() % 2 == 1);
+            assert (w->heap_index >= 0);
+            assert (top->expiry <= w->expiry);
+        }
+        assert (d->m_names.value("heap") == 7);
+
+        //  Commands find their worker by router identity as is, a new
+        //  identity is a new worker with its identity in hex as id
+        HubCommand cmd;
+        cmd.version = HUB_PROTOCOL;
+        cmd.command = CMD_BUSY;
+        cmd.address = "127.0.0.1";
+        cmd.address_size = 9;
+        cmd.name = "raw";
+        cmd.name_size = 3;
+        cmd.value = "500";
+        cmd.value_size = 3;
+        QByteArray raw_identity("\0raw", 4);
+        Frame identity(raw_identity);
+        d->workerCommand(cmd, &identity, HUB_PROTOCOL);
+        Worker_t *raw = d->m_identities.value(raw_identity);
+        assert (raw && raw->id == "00726177");
+        assert (raw->busy_until == 0);
+        d->workerCommand(cmd, &identity, HUB_PROTOCOL);
+        assert (raw->busy_until > 0);
+        assert (d->m_workers.size() == 8);
+        d->removeWorker(raw);
+        assert (d->m_identities.isEmpty());
+    }
+
+    ActorSocket *probe = new ActorSocket(qbeacon, NULL);
+    probe->send("si", "CONFIGURE", 5672);
+    QString hostname = probe->recvstr();
+    delete probe;
+    if (hostname.isEmpty()) {
+        printf ("OK (skipping test, no UDP broadcasting)\n");
+        return;
+    }
+
+    //  Two hubs federated on a test port find each other
+    QHub *first = new QHub;
+    first->setHeartbeat(500);
+    first->setFederation(5672);
+    first->startHUb();
+    QHub second;
+    second.setHeartbeat(500);
+    second.setFederation(5672);
+    second.startHUb();
+    for (attempt = 0; attempt < 50; attempt++) {
+        if (first->numberOfPeers() == 1 && second.numberOfPeers() == 1)
+            break;
+        s_sleep(100);
+    }
+    assert (first->numberOfPeers() == 1 && second.numberOfPeers() == 1);
+
+    //  A worker on the first hub is located through the second
+    QWorker *worker = new QWorker("echo");
+    bool registered = worker->registerToHub(
+                QString("tcp://127.0.0.1:%1").arg(first->hubPort()), 1000);
+    assert (registered);
+
+    QClient client(QString("tcp://127.0.0.1:%1").arg(second.hubPort()), "test");
+    bool connected = client.connectToHub(1000);
+    assert (connected);
+    QString endpoint;
+    for (attempt = 0; attempt < 50; attempt++) {
+        endpoint = client.locateWorker("echo");
+        if (!endpoint.isEmpty())
+            break;
+        s_sleep(100);
+    }
+    assert (endpoint.endsWith(QString(":%1").arg(first->hubPort())));
+    assert (client.locateWorker("nobody").isEmpty());
+    delete worker;
+    delete first;
+
+    //  A fake hub joins; the second hub asks it for a snapshot, then
+    //  asks again when a delta shows it lost one
+    Socket *registrar = srnet->createSocket(ZMQ_ROUTER);
+    int hubport = registrar->bind("tcp://*:*[5000-]");
+    assert (hubport != -1);
+    registrar->setRcvtimeo(5000);
+    Socket *feed = srnet->createSocket(ZMQ_PUB);
+    int feedport = feed->bind("tcp://*:*[%d-]", hubport);
+    assert (feedport != -1);
+
+    QByteArray uuid = QUuid::createUuid().toRfc4122();
+    byte payload [HUB_BEACON_SIZE];
+    byte *needle = payload;
+    memcpy (needle, HUB_BEACON, 4);
+    needle += 4;
+    PUT_NUMBER1 (HUB_PROTOCOL);
+    PUT_NUMBER2 (hubport);
+    PUT_NUMBER2 (feedport);
+    memcpy (needle, uuid.constData(), 16);
+    ActorSocket fake(qbeacon, NULL);
+    fake.send("si", "CONFIGURE", 5672);
+    fake.recvstr();
+    fake.send("sbi", "PUBLISH", payload, HUB_BEACON_SIZE, 100);
+
+    bool answered = s_fake_snapshot(registrar, uuid, 1, QByteArray());
+    assert (answered);
+
+    //  Delta 2 never comes, delta 3 adds a worker
+    byte delta [9 + 3 * 256];
+    needle = delta;
+    QByteArray wid("FAKE");
+    QByteArray name("lost");
+    QByteArray address("tcp://127.0.0.1:1");
+    quint64 sequence = 3;
+    PUT_NUMBER8 (sequence);
+    PUT_NUMBER1 (HUB_DELTA_ADD);
+    PUT_STRING (wid);
+    PUT_STRING (name);
+    PUT_STRING (address);
+    bool asked = false;
+    for (attempt = 0; attempt < 50 && !asked; attempt++) {
+        feed->sendmem(uuid.constData(), uuid.size(), QFRAME_MORE);
+        feed->sendmem(delta, needle - delta, 0);
+        zmq_pollitem_t items [] = { { registrar->resolve(), 0, ZMQ_POLLIN, 0 } };
+        asked = zmq_poll(items, 1, 100) == 1;
+    }
+    assert (asked);
+    answered = s_fake_snapshot(registrar, uuid, 3, name);
+    assert (answered);
+
+    //  The snapshot brings the worker of the lost delta
+    endpoint.clear();
+    for (attempt = 0; attempt < 50; attempt++) {
+        endpoint = client.locateWorker("lost");
+        if (!endpoint.isEmpty())
+            break;
+        s_sleep(100);
+    }
+    assert (endpoint.endsWith(QString(":%1").arg(hubport)));
+
+    fake.sendx("SILENCE", NULL);
+    delete feed;
+    delete registrar;
+    //  @end
+    printf ("OK\n");
+}
+
 //
 /*
  *
@@ -432,21 +1642,45 @@ void QHub::stopHUb()
  *
  * **********************************/
 
+//  Worker a client sends to directly, DEALER to the worker ROUTER
+class DirectPeer {
+public:
+    QString endpoint;
+    Socket* socket;
+};
+
 class QClientPrivate {
 public:
     QClientPrivate() {
         client = 0;
+        directory = 0;
+        synced = false;
+        version = HUB_PROTOCOL;
+        timeout = 3000;
     }
     ~QClientPrivate() {
+        foreach (const QString& name, peers.keys()) {
+            dropPeer(name);
+        }
+        delete directory;
         delete client;
     }
 
     int connectToHub();
+    DirectPeer* connectPeer(const QString& name, const QString& endpoint);
+    void dropPeer(const QString& name);
 
     Socket* client;
     Socket* iopub;
     Socket* task;
     Socket* control;
+    Socket* directory;  // SUB to hub notifier, worker deltas
+
+    WorkerDirectory table;
+    bool synced;        // table matches hub up to table.sequence
+    QHash<QString, DirectPeer*> peers;  // direct path by worker name
+    QHash<QString, qint64> backoff;     // no direct tries before, clock_mono
+    int timeout;        // msecs, as given to connectToHub
 
     int notifyport;
     int taskport;
@@ -454,6 +1688,8 @@ public:
     QString hubadd;
     QString id;
     QString name;
+    QString tag;        // placement of our sockets
+    int version;        // protocol version agreed with hub
 };
 
 int QClientPrivate::connectToHub()
@@ -465,7 +1701,7 @@ int QClientPrivate::connectToHub()
     }
 
     delete client;
-    client = srnet->createSocket(ZMQ_DEALER);
+    client = srnet->createSocket(ZMQ_DEALER, hubadd, tag);
 
     if(!id.isEmpty())
         client->setIdentity(id); // set identity for connect to router
@@ -474,6 +1710,62 @@ int QClientPrivate::connectToHub()
     return rc;
 }
 
+//  Connect and wait until the worker takes messages; with immediate set
+//  a send fails instead of queueing when the worker goes away
+
+DirectPeer* QClientPrivate::connectPeer(const QString &name, const QString &endpoint)
+{
+    Socket* socket = srnet->createSocket(ZMQ_DEALER, endpoint, tag);
+    socket->setImmediate(1);
+    socket->setSndtimeo(0);
+    if(socket->connect("%s", endpoint.toLatin1().constData()) != 0)
+    {
+        delete socket;
+        return NULL;
+    }
+
+    zmq_pollitem_t items [] = { { socket->resolve(), 0, ZMQ_POLLOUT, 0 } };
+    if(zmq_poll(items, 1, timeout) <= 0)
+    {
+        delete socket;
+        return NULL;
+    }
+
+    DirectPeer* peer = new DirectPeer;
+    peer->endpoint = endpoint;
+    peer->socket = socket;
+    peers.insert(name, peer);
+    return peer;
+}
+
+void QClientPrivate::dropPeer(const QString &name)
+{
+    DirectPeer* peer = peers.take(name);
+    if(peer)
+    {
+        delete peer->socket;
+        delete peer;
+    }
+}
+
+//  Reply to CMD_FIND or CMD_WORKER_ADDR:
+//  empty, header, version, command, found, endpoint
+
+static bool s_endpoint_reply(Messages &msgs, int command, QString &endpoint)
+{
+    if(msgs.size() != 3 || !s_frame_is(msgs.at(1), SRCLHD2))
+        return false;
+
+    Frame* body = msgs.last();
+    const byte *needle = (const byte *) body->constData();
+    if(body->size() < 4 || needle [1] != command || !needle [2]
+            || 4 + needle [3] > body->size())
+        return false;
+
+    endpoint = QString::fromLatin1((const char *) needle + 4, needle [3]);
+    return true;
+}
+
 
 QClient::QClient(QObject *parent) : d_ptr(new QClientPrivate), QObject(parent)
 {
@@ -511,6 +1803,12 @@ void QClient::setName(const QString &name)
     d->name = name;
 }
 
+void QClient::setTag(const QString &tag)
+{
+    Q_D(QClient);
+    d->tag = tag;
+}
+
 bool QClient::connectToHub(int timeout)
 {
     Q_D(QClient);
@@ -519,17 +1817,33 @@ bool QClient::connectToHub(int timeout)
     {
         d->client->setSndtimeo(timeout);
         d->client->setRcvtimeo(timeout);
+        d->timeout = timeout;
 
-        // request connect
-        queryToHub(CMD_REQ, "");
+        // request connect in version 1 text asking for an upgrade, any
+        // hub answers it; a binary reply tells the version we agreed on
+        d->version = 1;
+        queryToHub(CMD_REQ, HUB_UPGRADE + QString::number(HUB_PROTOCOL));
 
         Messages msgs;
-        if(msgs.recv(*d->client)) {
+        msgs.recv(*d->client);
+        if(msgs.size() >= 3) {
             QString emp = msgs.popstr();
             assert(emp == "");
 
-            QString header = msgs.popstr();
-            assert(header == SRCLHD);
+            Frame* header = msgs.pop();
+            bool binary = s_frame_is(header, SRCLHD2);
+            assert(binary || s_frame_is(header, SRCLHD));
+            delete header;
+
+            if(binary) {
+                Frame* body = msgs.first();
+                const byte *needle = (const byte *) body->constData();
+                if(body->size() < 4 || needle [1] != CMD_REQ)
+                    return false;
+                d->version = needle [0];
+                d->notifyport = (needle [2] << 8) | needle [3];
+                return true;
+            }
 
             QString command = msgs.popstr();
             if(command.toInt() != CMD_REQ)
@@ -562,19 +1876,291 @@ void QClient::queryToHub(int command, const QString &cval)
 
     Messages msg;
 
-    QString cmd= QString("%1-%2").arg(command).arg(cval);
-    msg.push(cmd);
-    msg.push("127.0.0.1%" + d->name);
-    msg.push(SRCLHD);
+    if(d->version >= 2)
+    {
+        QByteArray body = s_encode_command(command, "127.0.0.1", d->name.toUtf8(), cval.toUtf8());
+        msg.push(body.constData(), body.size());
+        msg.push(SRCLHD2);
+    }
+    else
+    {
+        QString cmd= QString("%1-%2").arg(command).arg(cval);
+        msg.push(cmd);
+        msg.push("127.0.0.1%" + d->name);
+        msg.push(SRCLHD);
+    }
     msg.push("");
     msg.send(*d->client);
 }
 
+QString QClient::locateWorker(const QString &name)
+{
+    Q_D(QClient);
+    if(!d->client || d->version < 2)
+        return QString();
+
+    queryToHub(CMD_FIND, name);
+
+    Messages msgs;
+    QString endpoint;
+    if(!msgs.recv(*d->client) || !s_endpoint_reply(msgs, CMD_FIND, endpoint))
+        return QString();
+    return endpoint.isEmpty() ? d->hubadd : endpoint;
+}
+
+QString QClient::workerEndpoint(const QString &name)
+{
+    Q_D(QClient);
+    if(d->directory)
+    {
+        foreach (const QString& address, workerAddresses(name)) {
+            if(address.startsWith("tcp://"))
+                return address;
+        }
+        return QString();
+    }
+
+    if(!d->client || d->version < 2)
+        return QString();
+
+    queryToHub(CMD_WORKER_ADDR, name);
+
+    Messages msgs;
+    QString endpoint;
+    if(!msgs.recv(*d->client) || !s_endpoint_reply(msgs, CMD_WORKER_ADDR, endpoint))
+        return QString();
+    return endpoint;
+}
+
+bool QClient::sendDirect(const QString &name, int command, const QString &cval)
+{
+    Q_D(QClient);
+
+    // worker is gone from the directory, so is our path to it
+    if(d->directory && updateDirectory() && !d->table.names.contains(name))
+        d->dropPeer(name);
+
+    // a worker we couldn't reach is left to the hub for a while, so
+    // every send doesn't wait for the connect to time out
+    DirectPeer* peer = d->peers.value(name, NULL);
+    if(!peer && d->backoff.value(name, 0) <= clock_mono())
+    {
+        QString endpoint = workerEndpoint(name);
+        if(!endpoint.isEmpty())
+            peer = d->connectPeer(name, endpoint);
+        if(peer)
+            d->backoff.remove(name);
+        else if(!endpoint.isEmpty())
+            d->backoff.insert(name, clock_mono() + HUB_DIRECT_BACKOFF);
+    }
+
+    if(peer)
+    {
+        // command, value
+        QByteArray cmd = QByteArray::number(command);
+        QByteArray value = cval.toUtf8();
+        Messages msg;
+        msg.appendmem(cmd.constData(), cmd.size());
+        msg.appendmem(value.constData(), value.size());
+        if(msg.send(*peer->socket) == 0)
+            return true;
+        d->dropPeer(name);
+    }
+
+    // no direct path, the hub takes it
+    sendToWorker(command, cval);
+    return false;
+}
+
+bool QClient::enableDirectory()
+{
+    Q_D(QClient);
+    if(!d->client || d->version < 2)
+        return false;
+
+    // subscribe before the snapshot, so no delta after it is missed
+    if(!d->directory)
+    {
+        QString endpoint = d->hubadd.mid(0, d->hubadd.lastIndexOf(":"))
+                + ":" + QString::number(d->notifyport);
+        d->directory = srnet->createSocket(ZMQ_SUB, endpoint, d->tag);
+        d->directory->setSubscribe(HUB_DIRECTORY);
+        if(d->directory->connect("%s", endpoint.toLatin1().constData()) != 0)
+        {
+            delete d->directory;
+            d->directory = 0;
+            return false;
+        }
+    }
+    return syncDirectory();
+}
+
+bool QClient::syncDirectory()
+{
+    Q_D(QClient);
+    if(!d->directory)
+        return false;
+
+    queryToHub(CMD_DIRECTORY, "");
+
+    // empty, header, snapshot
+    Messages msgs;
+    WorkerDirectory workers;
+    d->synced = msgs.recv(*d->client) && msgs.size() == 3
+            && s_frame_is(msgs.at(1), SRCLHD2)
+            && workers.load(msgs.last(), CMD_DIRECTORY, 0);
+    if(!d->synced)
+        return false;
+
+    d->table = workers;
+    emit workerList(d->table.names.keys());
+    return true;
+}
+
+bool QClient::updateDirectory()
+{
+    Q_D(QClient);
+    if(!d->directory)
+        return false;
+
+    // after a gap the rest is dropped, the snapshot is newer than it
+    bool changed = false;
+    while(d->directory->events() & ZMQ_POLLIN) {
+        Messages msg;
+        msg.recv(*d->directory);
+        if(!d->synced || msg.size() != 2)
+            continue;
+
+        WorkerDirectory::Result rc = d->table.apply(msg.last()->bdata());
+        if(rc == WorkerDirectory::Applied)
+            changed = true;
+        else if(rc == WorkerDirectory::Gap)
+            d->synced = false;
+    }
+
+    if(!d->synced)
+        return syncDirectory();
+    if(changed)
+        emit workerList(d->table.names.keys());
+    return true;
+}
+
+QStringList QClient::workerAddresses(const QString &name)
+{
+    Q_D(QClient);
+    updateDirectory();
+
+    QStringList addresses;
+    foreach (const QByteArray& wid, d->table.names.value(name)) {
+        addresses << d->table.workers.value(wid).address;
+    }
+    return addresses;
+}
+
 void QClient::sendToWorker(int command, const QString &cval)
 {
     queryToHub(CMD_WORKER_CMD, QString::number(command) + "|" + cval);
 }
 
+void QClient::test(bool verbose)
+{
+    printf (" * qclient: ");
+    if (verbose)
+        printf ("\n");
+
+    //  @selftest
+    QHub hub;
+    hub.setHeartbeat(500);
+    hub.startHUb();
+    QString hubaddress = QString("tcp://127.0.0.1:%1").arg(hub.hubPort());
+
+    //  A worker registered before the client comes with the snapshot
+    QWorker *first = new QWorker("dir");
+    bool registered = first->registerToHub(hubaddress, 1000);
+    assert (registered);
+
+    QClient client(hubaddress, "test");
+    bool connected = client.connectToHub(1000);
+    assert (connected);
+    bool enabled = client.enableDirectory();
+    assert (enabled);
+    assert (client.workerAddresses("dir").size() == 1);
+    assert (client.workerAddresses("nobody").isEmpty());
+
+    //  Deltas keep the table, lookups don't ask the hub
+    QClientPrivate *d = client.d_func();
+    d->client->setStatsEnabled(true);
+    qint64 sent = d->client->stats().sent;
+    QWorker *second = new QWorker("dir");
+    registered = second->registerToHub(hubaddress, 1000);
+    assert (registered);
+    int attempt;
+    for (attempt = 0; attempt < 50; attempt++) {
+        if (client.workerAddresses("dir").size() == 2)
+            break;
+        s_sleep(100);
+    }
+    assert (client.workerAddresses("dir").size() == 2);
+    assert (d->client->stats().sent == sent);
+
+    //  A lost delta shows as a gap, the client takes a new snapshot,
+    //  which no longer has the worker that went away
+    d->table.sequence--;
+    delete second;
+    for (attempt = 0; attempt < 100; attempt++) {
+        if (client.workerAddresses("dir").size() == 1)
+            break;
+        s_sleep(100);
+    }
+    assert (client.workerAddresses("dir").size() == 1);
+    assert (d->client->stats().sent > sent || !d->client->statsEnabled());
+    assert (d->synced);
+
+    //  A worker with a data endpoint takes commands straight from us
+    QWorker *direct = new QWorker("direct");
+    int port = direct->enableDirect();
+    assert (port > 0);
+    registered = direct->registerToHub(hubaddress, 1000);
+    assert (registered);
+    for (attempt = 0; attempt < 50; attempt++) {
+        if (!client.workerEndpoint("direct").isEmpty())
+            break;
+        s_sleep(100);
+    }
+    assert (client.workerEndpoint("direct").endsWith(QString(":%1").arg(port)));
+    bool straight = client.sendDirect("direct", CMD_WORKER_CMD, "hello");
+    assert (straight);
+    assert (d->peers.contains("direct"));
+
+    //  One without goes through the hub
+    straight = client.sendDirect("dir", CMD_WORKER_CMD, "hello");
+    assert (!straight);
+
+    //  A busy worker stays listed after it dies; once the send fails
+    //  the hub takes over, and after a failed connect we don't try the
+    //  worker again for a while
+    direct->setBusy(60000);
+    s_sleep(200);
+    delete direct;
+    for (attempt = 0; attempt < 50; attempt++) {
+        if (!client.sendDirect("direct", CMD_WORKER_CMD, "hello"))
+            break;
+        s_sleep(100);
+    }
+    assert (!d->peers.contains("direct"));
+    straight = client.sendDirect("direct", CMD_WORKER_CMD, "hello");
+    assert (!straight);
+    assert (d->backoff.contains("direct"));
+    qint64 started = clock_mono();
+    straight = client.sendDirect("direct", CMD_WORKER_CMD, "hello");
+    assert (!straight);
+    assert (clock_mono() - started < d->timeout);
+
+    delete first;
+    //  @end
+    printf ("OK\n");
+}
+
 
 /*
  *
@@ -589,12 +2175,22 @@ public:
     {
         worker = srnet->createSocket(ZMQ_DEALER);
         forwarder = new ActorSocket(qforwarder, NULL);
+        version = HUB_PROTOCOL;
+        address = "127.0.0.1";
+        data = 0;
+        dport = 0;
+        serving = false;
     }
     ~QWorkerPrivate() {
+        serving = false;
+        wait();
+        delete data;
         delete worker;
         delete forwarder;
     }
 
+    void run();
+
     void startHeartbeat();
     void pauseHeartbeat();
     void resumeHeartbeat();
@@ -608,11 +2204,44 @@ public:
 
     QString endpoint;
     int pport, poport;
+    int version;        // protocol version agreed with hub
+    QString tag;        // placement of our sockets
+
+    QString address;    // given to hub, tcp:// endpoint of data if direct
+    Socket* data;       // ROUTER, commands straight from clients
+    int dport;
+    volatile bool serving;
 
     QWorker* q_ptr;
     Q_DECLARE_PUBLIC(QWorker)
 };
 
+//  Direct commands: client identity, command, value
+
+void QWorkerPrivate::run()
+{
+    Q_Q(QWorker);
+
+    while(serving) {
+        zmq_pollitem_t items [] = { { data->resolve(), 0, ZMQ_POLLIN, 0 } };
+        if(zmq_poll(items, 1, 100) == -1)
+            break;
+
+        if(items [0].revents & ZMQ_POLLIN)
+        {
+            Messages msg;
+            msg.recv(*data);
+            if(msg.size() != 3)
+                continue;
+
+            QStringList commands;
+            commands << msg.at(1)->toString();
+            commands << QString::fromUtf8(msg.last()->bdata());
+            emit q->receivedCommand(commands);
+        }
+    }
+}
+
 void QWorkerPrivate::startHeartbeat()
 {
     QString eping = ">" + endpoint.mid(0, endpoint.lastIndexOf(":")) + ":" + QString::number(pport);
@@ -661,26 +2290,90 @@ void QWorker::setHubid(const QString &hid)
     d->hubid = hid;
 }
 
+void QWorker::setTag(const QString &tag)
+{
+    Q_D(QWorker);
+    d->tag = tag;
+}
+
+void QWorker::setBusy(int msecs)
+{
+    Q_D(QWorker);
+    requestToHub(CMD_BUSY, QString::number(msecs));
+    d->pauseHeartbeat();
+}
+
+void QWorker::setIdle()
+{
+    Q_D(QWorker);
+    d->resumeHeartbeat();
+    requestToHub(CMD_BUSY, "0");
+}
+
+int QWorker::enableDirect(const QString &address)
+{
+    Q_D(QWorker);
+    if(d->data)
+        return d->dport;
+
+    d->data = srnet->createSocket(ZMQ_ROUTER, "tcp://*", d->tag);
+    d->dport = d->data->bind("tcp://*:*[5000-]");
+    if(d->dport == -1)
+    {
+        delete d->data;
+        d->data = 0;
+        return -1;
+    }
+
+    d->address = QString("tcp://%1:%2").arg(address).arg(d->dport);
+    d->serving = true;
+    d->start();
+    return d->dport;
+}
+
 bool QWorker::registerToHub(const QString &endpoint, int timeou)
 {
     Q_D(QWorker);
     d->endpoint = endpoint;
+
+    // placed by the hub endpoint and our tag
+    delete d->worker;
+    d->worker = srnet->createSocket(ZMQ_DEALER, endpoint, d->tag);
     int rc = d->worker->connect(endpoint.toLatin1().data());
     if(rc == 0) {
         d->worker->setSndtimeo(timeou);
         d->worker->setRcvtimeo(timeou);
 
-        //
-        requestToHub(CMD_REG, "");
+        // register in version 1 text asking for an upgrade, any hub
+        // answers it; a binary reply tells the version we agreed on
+        d->version = 1;
+        requestToHub(CMD_REG, HUB_UPGRADE + QString::number(HUB_PROTOCOL));
 
         Messages msgs;
-        if(msgs.recv(*d->worker))
+        msgs.recv(*d->worker);
+        if(msgs.size() >= 3)
         {
             QString emp = msgs.popstr();
             assert(emp == "");
 
-            QString header = msgs.popstr();
-            assert(header == SRWOHD);
+            Frame* header = msgs.pop();
+            bool binary = s_frame_is(header, SRWOHD2);
+            assert(binary || s_frame_is(header, SRWOHD));
+            delete header;
+
+            if(binary)
+            {
+                HubRegistration reg;
+                if(!reg.decode(msgs.first()) || reg.command != CMD_REG)
+                    return false;
+                d->version = reg.version;
+                d->poport = reg.pong_port;
+                d->pport = reg.ping_port;
+                d->hubid = QString::fromLatin1(reg.hubid, reg.hubid_size);
+                d->wid = QString::fromLatin1(reg.wid, reg.wid_size);
+                d->startHeartbeat();
+                return true;
+            }
 
             QString command = msgs.popstr();
             if(command.toInt() != CMD_REG)
@@ -715,10 +2408,19 @@ void QWorker::requestToHub(int command, const QString &cval)
 
     Messages msg;
 
-    QString cmd= QString("%1-%2").arg(command).arg(cval);
-    msg.push(cmd);
-    msg.push("127.0.0.1%" + d->name);
-    msg.push(SRWOHD);
+    if(d->version >= 2)
+    {
+        QByteArray body = s_encode_command(command, d->address.toLatin1(), d->name.toUtf8(), cval.toUtf8());
+        msg.push(body.constData(), body.size());
+        msg.push(SRWOHD2);
+    }
+    else
+    {
+        QString cmd= QString("%1-%2").arg(command).arg(cval);
+        msg.push(cmd);
+        msg.push(d->address + "%" + d->name);
+        msg.push(SRWOHD);
+    }
     msg.push("");
     msg.send(*d->worker);
 }
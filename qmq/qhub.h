@@ -12,6 +12,7 @@
 =========================================================================*/
 
 #include <QObject>
+#include <QStringList>
 
 #ifndef QMQ_EXPORT
 #if defined LIBQMQ_STATIC
@@ -26,9 +27,14 @@
 #define HUBV "1.0.0"
 #define HUBID "Q_HUB_"
 
+//  Highest registration protocol version we speak; 1 is the text
+//  protocol, 2 is binary
+#define HUB_PROTOCOL 2
+
 #define CMD_HUB_REP 001
 #define CMD_HUB_NAK 002
 #define CMD_HUB_WOK 003
+#define CMD_HUB_SNAPSHOT 004
 
 class QHubPrivate;
 /// a HUB is a broker for connecting clients to workers
@@ -44,6 +50,8 @@ class QMQ_EXPORT QHub : public QObject
     Q_OBJECT
 public:
     explicit QHub(QObject *parent = 0);
+    /// sockets of this hub are placed by tag, see QMNet::placement
+    explicit QHub(const QString& tag, QObject *parent = 0);
     ~QHub();
 
     int hubPort() const;
@@ -59,6 +67,14 @@ public:
     int numberOfClients() const;
     int numberOfWorkers() const;
 
+    /// join the hubs announcing on this UDP port, before startHUb;
+    /// 0, the default, keeps the hub alone
+    void setFederation(int port);
+    int federationPort() const;
+    int numberOfPeers() const;
+
+    static void test(bool verbose);
+
 signals:
     void clientQuery(const QStringList& q); // client address, client id, client command
     void workerRegistration(const QStringList& wr); // a worker can connect to client
@@ -81,6 +97,9 @@ private:
 // client commands table
 #define CMD_REQ        001
 #define CMD_STATE      005
+#define CMD_FIND       006
+#define CMD_DIRECTORY  007
+#define CMD_WORKER_ADDR 010
 #define CMD_WORKER_CMD 003
 
 class QClientPrivate;
@@ -95,11 +114,36 @@ public:
     void setHubAddress(const QString& endpoint);
     void setIdentification(const QByteArray& id);
     void setName(const QString& name);
+    /// placement tag of sockets made after this, see QMNet::placement
+    void setTag(const QString& tag);
 
     bool connectToHub(int timeout);
 
     int notifyPort() const;
 
+    /// registrar of the nearest hub with a worker of this name, this
+    /// hub if it has one; empty if none is known
+    QString locateWorker(const QString& name);
+
+    /// keep a local copy of the hub worker table: a snapshot, then the
+    /// numbered deltas the hub publishes on its notify port
+    bool enableDirectory();
+    /// snapshot again, a round trip to the hub
+    bool syncDirectory();
+    /// apply the deltas received so far, no round trip unless one was lost
+    bool updateDirectory();
+    /// addresses of the workers of this name, from the local directory
+    QStringList workerAddresses(const QString& name);
+
+    /// data endpoint of a worker of this name that takes direct commands,
+    /// from the directory when enabled, else from the hub
+    QString workerEndpoint(const QString& name);
+    /// send straight to the worker, the hub only introduces it; falls
+    /// back to sendToWorker when there is no direct path or it is gone
+    bool sendDirect(const QString& name, int command, const QString& cval);
+
+    static void test(bool verbose);
+
 signals:
     void accepted(const QStringList& endpoints);
     void workerList(const QStringList& lst);
@@ -116,6 +160,7 @@ private:
 };
 
 #define CMD_REG 004
+#define CMD_BUSY 011
 
 class QWorkerPrivate;
 class QMQ_EXPORT QWorker : public QObject
@@ -126,6 +171,19 @@ public:
     ~QWorker();
 
     void setHubid(const QString& hid);
+    /// placement tag of our sockets, see QMNet::placement; call before
+    /// enableDirect and registerToHub
+    void setTag(const QString& tag);
+
+    /// take commands from clients on our own ROUTER, they arrive as
+    /// receivedCommand; call before registerToHub, address is the host
+    /// clients reach us at. Returns the port, -1 on error
+    int enableDirect(const QString& address = "127.0.0.1");
+
+    /// stop pongs for msecs, the hub keeps us meanwhile; setIdle()
+    /// starts them again
+    void setBusy(int msecs);
+    void setIdle();
 
     bool registerToHub(const QString& endpoint, int timeou=3000);
 
@@ -97,6 +97,8 @@ typedef unsigned char   byte;           //  Single unsigned byte = 8 bits
 
 #include "context.h"
 #include "socket.h"
+#include "stats.h"
+#include "trace.h"
 #include "message.h"
 #include "actor.h"
 #include "poller.h"
@@ -12,6 +12,9 @@ TEMPLATE = lib
 
 DEFINES += QMQ_LIBRARY _CRT_SECURE_NO_WARNINGS
 
+# qmake CONFIG+=qmq_nostats compiles socket stats out, the bench baseline
+qmq_nostats: DEFINES += QMQ_NO_STATS
+
 SOURCES += \
     context.cpp \
     socket.cpp \
@@ -22,6 +25,9 @@ SOURCES += \
     beacon.cpp \
     gossip.cpp \
     proxy.cpp \
+    replay.cpp \
+    stats.cpp \
+    trace.cpp \
     mdp.cpp \
     sevent.cpp \
     forwarder.cpp \
@@ -34,6 +40,8 @@ HEADERS += qmq.h \
     message.h \
     context_p.hpp \
     socket_p.hpp \
+    stats.h \
+    trace.h \
     msg_p.hpp \
     actor.h \
     poller.h \
@@ -0,0 +1,464 @@
+#include "helper.h"
+
+#include <QFile>
+#include <QQueue>
+#include <QMutex>
+#include <QThread>
+#include <QDataStream>
+#include <QWaitCondition>
+#include <QDebug>
+
+//  Number of records the reader thread keeps ahead of the sender
+#define REPLAY_PREFETCH     1024
+
+//  Journal format, one record after other:
+//      qint64      record time, msecs (monotonic clock of the recorder)
+//      QByteArray  message encoded by Messages::encode
+//  encode keeps empty frames, so envelopes survive the round trip.
+
+int qreplayRecord(QIODevice *journal, Messages &msg, qint64 stamp)
+{
+    assert (journal);
+    if (stamp < 0)
+        stamp = clock_mono();
+
+    QDataStream writer(journal);
+    writer << stamp << msg.encode();
+    return writer.status() == QDataStream::Ok ? 0 : -1;
+}
+
+class ReplayRecord {
+public:
+    qint64 stamp;               //  Record time, msecs
+    Messages msg;               //  Recorded message
+};
+
+/// the reader thread keeps a bounded queue of decoded records, so
+/// disk I/O and decoding never stall the sending actor
+class JournalReader : public QThread {
+public:
+    JournalReader(const QString& path) {
+        file.setFileName(path);
+        eof = false;
+        stopped = false;
+    }
+
+    ~JournalReader() {
+        stop();
+        wait();
+        qDeleteAll(queue);
+    }
+
+    bool open() {
+        return file.open(QFile::ReadOnly);
+    }
+
+    void stop() {
+        mutex.lock();
+        stopped = true;
+        not_full.wakeAll();
+        mutex.unlock();
+    }
+
+    //  Take next record without blocking, returns NULL if queue is empty
+    ReplayRecord* take() {
+        QMutexLocker lock(&mutex);
+        if (queue.isEmpty())
+            return NULL;
+        ReplayRecord* record = queue.dequeue();
+        not_full.wakeOne();
+        return record;
+    }
+
+    //  True when all records are read and taken
+    bool finished() {
+        QMutexLocker lock(&mutex);
+        return eof && queue.isEmpty();
+    }
+
+    void run() {
+        QDataStream reader(&file);
+        while (true) {
+            ReplayRecord* record = new ReplayRecord;
+            QByteArray buffer;
+            reader >> record->stamp >> buffer;
+            if (reader.status() != QDataStream::Ok) {
+                delete record;
+                break;              //  End of journal, or corrupt record
+            }
+            record->msg.decode(buffer);
+
+            QMutexLocker lock(&mutex);
+            while (queue.size() >= REPLAY_PREFETCH && !stopped)
+                not_full.wait(&mutex);
+            if (stopped) {
+                delete record;
+                break;
+            }
+            queue.enqueue(record);
+        }
+
+        mutex.lock();
+        eof = true;
+        mutex.unlock();
+        file.close();
+    }
+
+    QFile file;                         //  Journal file
+    QQueue<ReplayRecord*> queue;        //  Prefetched records
+    QMutex mutex;                       //  Protects queue and flags
+    QWaitCondition not_full;            //  Reader waits here on full queue
+    bool eof;                           //  Reader reached end of journal
+    bool stopped;                       //  Actor asked reader to quit
+};
+
+class ReplayHandler {
+public:
+    ReplayHandler(Socket* pip) {
+        pipe = pip;
+        output = 0;
+        reader = 0;
+        pending = 0;
+
+        speed = 1.0;
+        playing = false;
+        terminated = false;
+        verbose = false;
+        resetStats();
+    }
+
+    ~ReplayHandler() {
+        delete pending;
+        delete reader;
+        delete output;
+    }
+
+    Socket* createSocket(QString type, char* endpoint)
+    {
+        QString type_names [] = {
+                "PAIR", "PUB", "SUB", "REQ", "REP",
+                "DEALER", "ROUTER", "PULL", "PUSH",
+                "XPUB", "XSUB", type
+            };
+
+        int index;
+        for (index = 0; type != type_names[index]; index++) ;
+        if (index > ZMQ_XSUB) {
+            qFatal("qreplay: invalid socket type '%s'", type.toLatin1().data());
+            return NULL;
+        }
+
+        Socket* sock = (Socket*)pipe->context()->createSocket(index);
+        if(sock)
+        {
+            if(sock->attach(endpoint, true))
+            {
+                delete sock;
+                sock = NULL;
+                qFatal("qreplay: invalid endpoints '%s'", endpoint);
+            }
+        }
+        return sock;
+    }
+
+    void resetStats();
+    int load(const QString& path);
+    int handlePipe();
+    void sendStats();
+    long timeout();
+    void play();
+    QString state();
+
+    Socket *pipe;               //  Actor command pipe
+    Socket *output;             //  Socket we replay into
+    JournalReader *reader;      //  Prefetching journal reader
+    ReplayRecord *pending;      //  Next record waiting for its time
+    double speed;               //  Speed factor, 0 = as fast as possible
+    bool playing;               //  START received and not paused
+    bool terminated;            //  Did caller ask us to quit?
+    bool verbose;               //  Verbose logging enabled?
+
+    qint64 base_at;             //  Clock time the first record maps to
+    qint64 base_stamp;          //  Record time of first record
+    qint64 paused_at;           //  When we paused, to shift base_at
+    qint64 started_at;          //  When playing started
+    qint64 finished_at;         //  When last record was sent
+    qint64 sent;                //  Messages sent so far
+    qint64 lag;                 //  Lag of last message, msecs
+    qint64 max_lag;             //  Worst lag seen, msecs
+};
+
+void ReplayHandler::resetStats()
+{
+    base_at = base_stamp = -1;
+    paused_at = started_at = finished_at = 0;
+    sent = lag = max_lag = 0;
+}
+
+int ReplayHandler::load(const QString &path)
+{
+    delete pending;
+    pending = 0;
+    delete reader;
+
+    reader = new JournalReader(path);
+    if (!reader->open()) {
+        qWarning("qreplay: can't open journal '%s'", path.toLocal8Bit().data());
+        delete reader;
+        reader = 0;
+        return -1;
+    }
+    resetStats();
+    if (playing)
+        started_at = clock_mono();
+    reader->start();
+    return 0;
+}
+
+QString ReplayHandler::state()
+{
+    if (!reader)
+        return "IDLE";
+    if (!pending && reader->finished())
+        return "DONE";
+    return playing ? "PLAYING" : "PAUSED";
+}
+
+void ReplayHandler::sendStats()
+{
+    qint64 until = finished_at ? finished_at : clock_mono();
+    qint64 elapsed = started_at ? until - started_at : 0;
+    int rate = elapsed > 0 ? int(sent * 1000 / elapsed) : 0;
+
+    pipe->send("siiii", state().toLatin1().data(), int(sent), rate,
+               int(lag), int(max_lag));
+}
+
+int ReplayHandler::handlePipe()
+{
+    Messages request;
+    request.recv(*pipe);
+    if(request.size() <= 0) return -1;
+
+    QString command = request.popstr();
+    if (verbose)
+        qDebug("qreplay: API command=%s", command.toLatin1().data());
+
+    if (command == "OUTPUT") {
+        QString type = request.popstr();
+        QString endpoint = request.popstr();
+        delete output;
+        output = createSocket(type, endpoint.toLatin1().data());
+        pipe->signal(0);
+    }
+    else
+    if (command == "LOAD") {
+        QString path = request.popstr();
+        pipe->signal(load(path) == 0 ? 0 : 1);
+    }
+    else
+    if (command == "SPEED") {
+        //  Speed is a decimal string, "2" replays twice as fast and "0"
+        //  sends as fast as the output socket accepts
+        bool ok;
+        double factor = request.popstr().toDouble(&ok);
+        if (ok && factor >= 0) {
+            //  Keep position in the journal when changing speed on the fly
+            if (playing && speed > 0 && factor > 0 && base_at >= 0) {
+                qint64 now = clock_mono();
+                qint64 position = qint64((now - base_at) * speed);
+                base_at = now - qint64(position / factor);
+            }
+            else
+                base_at = -1;
+            speed = factor;
+        }
+        pipe->signal(ok && factor >= 0 ? 0 : 1);
+    }
+    else
+    if (command == "START") {
+        if (!playing) {
+            qint64 now = clock_mono();
+            if (!started_at)
+                started_at = now;
+            if (paused_at && base_at >= 0)
+                base_at += now - paused_at;
+            paused_at = 0;
+            playing = true;
+        }
+        pipe->signal(0);
+    }
+    else
+    if (command == "PAUSE") {
+        if (playing) {
+            paused_at = clock_mono();
+            playing = false;
+        }
+        pipe->signal(0);
+    }
+    else
+    if (command == "STATS")
+        sendStats();
+    else
+    if (command == "VERBOSE") {
+        verbose = true;
+        pipe->signal(0);
+    }
+    else
+    if (command == "$TERM")
+        terminated = true;
+    else {
+        qFatal("qreplay: - invalid command: %s", command.toLatin1().data());
+    }
+
+    return 0;
+}
+
+//  Time to wait in poll before next record is due
+
+long ReplayHandler::timeout()
+{
+    if (!playing || !reader || !output)
+        return -1;
+    if (!pending) {
+        if (reader->finished())
+            return -1;
+        return 1;       //  Reader is behind us, look again soon
+    }
+    if (speed == 0 || base_at < 0)
+        return 0;
+
+    qint64 due = base_at + qint64((pending->stamp - base_stamp) / speed);
+    long wait = long(due - clock_mono());
+    return wait < 0 ? 0 : wait;
+}
+
+//  Send every record that is due now
+
+void ReplayHandler::play()
+{
+    while (playing) {
+        if (!pending)
+            pending = reader->take();
+        if (!pending) {
+            if (reader->finished() && !finished_at) {
+                finished_at = clock_mono();
+                if (verbose)
+                    qDebug("qreplay: journal done, sent=%d", int(sent));
+            }
+            break;
+        }
+
+        qint64 now = clock_mono();
+        if (base_at < 0) {
+            //  First record, or speed changed: map its time to now
+            base_at = now;
+            base_stamp = pending->stamp;
+        }
+
+        if (speed > 0) {
+            qint64 due = base_at + qint64((pending->stamp - base_stamp) / speed);
+            if (due > now)
+                break;
+            lag = now - due;
+            if (lag > max_lag)
+                max_lag = lag;
+        }
+
+        if (pending->msg.send(*output) != 0)
+            break;              //  Output interrupted, try again later
+        sent++;
+        delete pending;
+        pending = 0;
+    }
+}
+
+void qreplay(Socket *pipe, void *)
+{
+    ReplayHandler self(pipe);
+    pipe->signal(0);
+
+    while (!self.terminated) {
+        zmq_pollitem_t items [] = { { pipe->resolve(), 0, ZMQ_POLLIN, 0 } };
+        if (zmq_poll(items, 1, self.timeout()) == -1)
+            break;              //  Interrupted
+
+        if (items [0].revents & ZMQ_POLLIN)
+            self.handlePipe();
+
+        if (self.playing && self.reader && self.output)
+            self.play();
+    }
+}
+
+void replayTest(bool verbose)
+{
+    printf (" * qreplay: ");
+    if (verbose)
+        printf ("\n");
+
+    //  @selftest
+    //  Record a small journal, each message has an empty frame in it
+    QFile journal("replay.test");
+    journal.open(QFile::WriteOnly);
+    int record_nbr;
+    for (record_nbr = 0; record_nbr < 10; record_nbr++) {
+        Messages msg;
+        msg.append(QString("ADDRESS"));
+        msg.appendmem(NULL, 0);
+        msg.append("Record %d", record_nbr);
+        int rc = qreplayRecord(&journal, msg, 1000 + record_nbr * 5);
+        assert (rc == 0);
+    }
+    journal.close();
+
+    ActorSocket replay(qreplay, NULL);
+    if (verbose) {
+        replay.sendx("VERBOSE", NULL);
+        replay.wait();
+    }
+    replay.sendx("OUTPUT", "PUSH", "inproc://replay", NULL);
+    replay.wait();
+    Socket *sink = Socket::createPull(">inproc://replay");
+    assert (sink);
+
+    replay.sendx("LOAD", "replay.test", NULL);
+    int rc = replay.wait();
+    assert (rc == 0);
+    replay.sendx("START", NULL);
+    replay.wait();
+
+    //  Journal is replayed in order and frame by frame
+    for (record_nbr = 0; record_nbr < 10; record_nbr++) {
+        Messages msg;
+        msg.recv(*sink);
+        assert (msg.size() == 3);
+        assert (msg.popstr() == "ADDRESS");
+        assert (msg.popstr() == "");
+        assert (msg.popstr() == QString("Record %1").arg(record_nbr));
+    }
+
+    QString state;
+    int sent, rate, lag, max_lag;
+    do {
+        replay.sendx("STATS", NULL);
+        replay.recv("siiii", &state, &sent, &rate, &lag, &max_lag);
+    } while (state != "DONE");
+    assert (sent == 10);
+
+    //  Same journal again, as fast as possible
+    replay.sendx("SPEED", "0", NULL);
+    replay.wait();
+    replay.sendx("LOAD", "replay.test", NULL);
+    replay.wait();
+    for (record_nbr = 0; record_nbr < 10; record_nbr++) {
+        Messages msg;
+        msg.recv(*sink);
+        assert (msg.size() == 3);
+    }
+
+    delete sink;
+    journal.remove();
+    //  @end
+    printf ("OK\n");
+}
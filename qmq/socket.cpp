@@ -179,13 +179,18 @@ int SocketBase::sendmem(const void *data, size_t size, int flags)
 
     zmq_msg_t msg;
     zmq_msg_init_size(&msg, size);
-    memcpy(zmq_msg_data(&msg), data, size);
+    if (size)
+        memcpy(zmq_msg_data(&msg), data, size);
 
-    if (zmq_msg_send(&msg, zocket, flags) == -1) {
+    SocketStats *stats = STATS_OF(d);
+    qint64 started = stats ? SocketStats::clock() : 0;
+    if (zmq_msg_send(&msg, zocket, snd_flags) == -1) {
+        zmq_msg_close(&msg);
         return -1;
     }
-    else
-        return 0;
+    if (stats)
+        stats->sentMessage(size, SocketStats::clock() - started);
+    return 0;
 }
 
 int SocketBase::sendstr(const QString &string, bool more)
@@ -196,12 +201,15 @@ int SocketBase::sendstr(const QString &string, bool more)
     zmq_msg_t message;
     zmq_msg_init_size (&message, len);
     memcpy (zmq_msg_data (&message), string.toLocal8Bit().data(), len);
+    SocketStats *stats = STATS_OF(d);
+    qint64 started = stats ? SocketStats::clock() : 0;
     if (zmq_sendmsg (d->handle, &message, more ? ZMQ_SNDMORE : 0) == -1) {
         zmq_msg_close (&message);
         return -1;
     }
-    else
-        return 0;
+    if (stats)
+        stats->sentMessage(len, SocketStats::clock() - started);
+    return 0;
 }
 
 int SocketBase::sendx(const char *string, ...)
@@ -224,10 +232,14 @@ QString SocketBase::recvstr()
 
     zmq_msg_t message;
     zmq_msg_init (&message);
+    SocketStats *stats = STATS_OF(d);
+    qint64 started = stats ? SocketStats::clock() : 0;
     if (zmq_recvmsg (d->handle, &message, 0) < 0)
         return QString();
 
     size_t size = zmq_msg_size (&message);
+    if (stats)
+        stats->receivedMessage(size, SocketStats::clock() - started);
     char *string = (char *) malloc (size + 1);
     if (string) {
         memcpy (string, zmq_msg_data (&message), size);
@@ -257,6 +269,53 @@ Context *SocketBase::context()
     return d->m_pcntxt;
 }
 
+void SocketBase::setStatsEnabled(bool enable, const QString &name)
+{
+    Q_D(SocketBase);
+#if defined (QMQ_NO_STATS)
+    Q_UNUSED(name);
+    enable = false;
+#endif
+    if (enable == (d->stats != 0))
+        return;
+
+    SocketStats *stats = 0;
+    if (enable) {
+        stats = new SocketStats;
+        stats->type = d->type;
+        stats->name = name.isEmpty()
+                ? QString("%1-%2").arg(type_str()).arg(quintptr(this), 0, 16)
+                : name;
+    }
+    //  Context::socketStats reads other sockets stats under context lock
+    ContextPrivate *cntx = d->m_pcntxt ? d->m_pcntxt->d_func() : 0;
+    if (cntx)
+        cntx->mutex.lock();
+    delete d->stats;
+    d->stats = stats;
+    if (cntx)
+        cntx->mutex.unlock();
+}
+
+bool SocketBase::statsEnabled()
+{
+    Q_D(SocketBase);
+    return d->stats != 0;
+}
+
+SocketStats SocketBase::stats()
+{
+    Q_D(SocketBase);
+    return d->stats ? d->stats->snapshot() : SocketStats();
+}
+
+void SocketBase::resetStats()
+{
+    Q_D(SocketBase);
+    if (d->stats)
+        d->stats->reset();
+}
+
 int SocketBase::wait()
 {
     QString message = recvstr();
@@ -1928,7 +1987,10 @@ int Socket::bsend(const char *picture, ...)
 
     //  Now send the data frame
     void *handle = resolve();
-    zmq_msg_send (&msg, handle, nbr_frames ? ZMQ_SNDMORE: 0);
+    SocketStats *stats = STATS_OF(d_func());
+    qint64 started = stats ? SocketStats::clock() : 0;
+    if (zmq_msg_send (&msg, handle, nbr_frames ? ZMQ_SNDMORE: 0) != -1 && stats)
+        stats->sentMessage(frame_size, SocketStats::clock() - started);
 
     //  Now send any additional frames
     unsigned int frame_nbr;
@@ -1949,8 +2011,12 @@ int Socket::brecv(const char *picture, ...)
 
     zmq_msg_t msg;
     zmq_msg_init (&msg);
+    SocketStats *stats = STATS_OF(d);
+    qint64 started = stats ? SocketStats::clock() : 0;
     if (zmq_msg_recv (&msg, resolve(), 0) == -1)
         return -1;              //  Interrupted
+    if (stats)
+        stats->receivedMessage(zmq_msg_size (&msg), SocketStats::clock() - started);
 
     //  If we don't have a string cache, create one now with arbitrary
     //  value; this will grow if needed. Do not use an initial size less
@@ -2340,7 +2406,7 @@ void Socket::test(bool verbose)
 
 Socket *Socket::createPub(const char *endpoints)
 {
-    Socket *sock = srnet->createSocket(ZMQ_PUB);
+    Socket *sock = srnet->createSocket(ZMQ_PUB, endpoints);
     if (sock)
         if(sock->attach(endpoints, true))
         {
@@ -2352,7 +2418,7 @@ Socket *Socket::createPub(const char *endpoints)
 
 Socket *Socket::createSub(const char *endpoints, const char *subscribe)
 {
-    Socket *sock = srnet->createSocket(ZMQ_SUB);
+    Socket *sock = srnet->createSocket(ZMQ_SUB, endpoints);
     if (sock) {
         if(sock->attach(endpoints, false) == 0)
         {
@@ -2369,7 +2435,7 @@ Socket *Socket::createSub(const char *endpoints, const char *subscribe)
 
 Socket *Socket::createReq(const char *endpoints)
 {
-    Socket *sock = srnet->createSocket(ZMQ_REQ);
+    Socket *sock = srnet->createSocket(ZMQ_REQ, endpoints);
     if (sock)
         if(sock->attach(endpoints, false))
         {
@@ -2381,7 +2447,7 @@ Socket *Socket::createReq(const char *endpoints)
 
 Socket *Socket::createRep(const char *endpoints)
 {
-    Socket *sock = srnet->createSocket(ZMQ_REP);
+    Socket *sock = srnet->createSocket(ZMQ_REP, endpoints);
     if (sock)
         if(sock->attach(endpoints, true))
         {
@@ -2393,7 +2459,7 @@ Socket *Socket::createRep(const char *endpoints)
 
 Socket *Socket::createDealer(const char *endpoints)
 {
-    Socket *sock = srnet->createSocket(ZMQ_DEALER);
+    Socket *sock = srnet->createSocket(ZMQ_DEALER, endpoints);
     if (sock)
         if(sock->attach(endpoints, false))
         {
@@ -2405,7 +2471,7 @@ Socket *Socket::createDealer(const char *endpoints)
 
 Socket *Socket::createRouter(const char *endpoints)
 {
-    Socket *sock = srnet->createSocket(ZMQ_ROUTER);
+    Socket *sock = srnet->createSocket(ZMQ_ROUTER, endpoints);
     if (sock)
         if(sock->attach(endpoints, true))
         {
@@ -2417,7 +2483,7 @@ Socket *Socket::createRouter(const char *endpoints)
 
 Socket *Socket::createPush(const char *endpoints)
 {
-    Socket *sock = srnet->createSocket(ZMQ_PUSH);
+    Socket *sock = srnet->createSocket(ZMQ_PUSH, endpoints);
     if (sock)
         if(sock->attach(endpoints, false))
         {
@@ -2429,7 +2495,7 @@ Socket *Socket::createPush(const char *endpoints)
 
 Socket *Socket::createPull(const char *endpoints)
 {
-    Socket *sock = srnet->createSocket(ZMQ_PULL);
+    Socket *sock = srnet->createSocket(ZMQ_PULL, endpoints);
     if (sock)
         if(sock->attach(endpoints, true))
         {
@@ -2442,7 +2508,7 @@ Socket *Socket::createPull(const char *endpoints)
 Socket *Socket::createXPub(const char *endpoints)
 {
 #if defined ZMQ_XPUB
-    Socket *sock = srnet->createSocket(ZMQ_XPUB);
+    Socket *sock = srnet->createSocket(ZMQ_XPUB, endpoints);
     if (sock)
         if(sock->attach(endpoints, true))
         {
@@ -2458,7 +2524,7 @@ Socket *Socket::createXPub(const char *endpoints)
 Socket *Socket::createXSub(const char *endpoints)
 {
 #if defined ZMQ_XSUB
-    Socket *sock = srnet->createSocket(ZMQ_XSUB);
+    Socket *sock = srnet->createSocket(ZMQ_XSUB, endpoints);
     if (sock)
         if(sock->attach(endpoints, false))
         {
@@ -2473,7 +2539,7 @@ Socket *Socket::createXSub(const char *endpoints)
 
 Socket *Socket::createPair(const char *endpoints)
 {
-    Socket *sock = srnet->createSocket(ZMQ_PAIR);
+    Socket *sock = srnet->createSocket(ZMQ_PAIR, endpoints);
     if (sock)
         if(sock->attach(endpoints, false))
         {
@@ -2486,7 +2552,7 @@ Socket *Socket::createPair(const char *endpoints)
 Socket *Socket::createStream(const char *endpoints)
 {
 #if defined ZMQ_STREAM
-    Socket *sock = srnet->createSocket(ZMQ_STREAM);
+    Socket *sock = srnet->createSocket(ZMQ_STREAM, endpoints);
     if (sock)
         if(sock->attach(endpoints, false))
         {
@@ -22,6 +22,7 @@ typedef void (zsocket_free_fn) (void *data, void *arg);
 
 
 class Context;
+class SocketStats;
 
 class SocketBasePrivate;
 
@@ -33,6 +34,7 @@ class QMQ_EXPORT SocketBase : public QObject
     friend class Context;
     friend class ContextPrivate;
     friend class QMNet;
+    friend class Frame;
 
 public:
     SocketBase(Context *parent = 0);
@@ -226,6 +228,20 @@ public:
     virtual void *resolve();
     Context* context();
 
+    //  --------------------------------------------------------------------------
+    //  Instrument the socket: count frames and bytes and record the time
+    //  blocked in every send and receive. Off by default, a disabled socket
+    //  pays one pointer test per call, a library built with QMQ_NO_STATS
+    //  never enables it. Call it from the thread that uses the socket. The
+    //  name is shown in Context::socketStats, default is socket type and
+    //  address.
+    void setStatsEnabled(bool enable, const QString& name = QString());
+    bool statsEnabled();
+
+    //  Snapshot of the socket stats, empty if stats are disabled
+    SocketStats stats();
+    void resetStats();
+
 protected:
     SocketBasePrivate* const d_ptr;
     SocketBase(SocketBasePrivate &d, Context *parent=0);
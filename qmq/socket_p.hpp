@@ -4,6 +4,15 @@
 #include "helper.h"
 
 #include <QString>
+//  Stats of a socket for the send and receive paths. Building with
+//  QMQ_NO_STATS makes it a constant NULL so the hooks compile away, that
+//  build is the baseline of the bench (see README).
+#if defined (QMQ_NO_STATS)
+#   define STATS_OF(d)      ((SocketStats *) 0)
+#else
+#   define STATS_OF(d)      ((d)->stats)
+#endif
+
 /*
  * socket private
  *
@@ -14,13 +23,16 @@ public:
     SocketBasePrivate() {
         handle = 0;
         m_pcntxt = 0;
+        stats = 0;
     }
     virtual ~SocketBasePrivate() {
+        delete stats;
     }
 
     void* handle;
     Context* m_pcntxt;
     int type;                   //  Socket type
+    SocketStats* stats;         //  Instrumentation, NULL when disabled
 };
 
 class SocketPrivate : public SocketBasePrivate {
@@ -0,0 +1,391 @@
+#include "helper.h"
+
+#include <QElapsedTimer>
+#include <QThread>
+#include <QtConcurrent>
+#include <QDebug>
+
+#define STATS_INTERVAL      1000    //  Default publish interval, msecs
+#define HIST_HIGHEST        ((Q_INT64_C(1) << 48) - 1)
+
+Histogram::Histogram()
+{
+    reset();
+}
+
+void Histogram::reset()
+{
+    memset(m_counts, 0, sizeof (m_counts));
+    m_count = m_sum = m_max = 0;
+}
+
+int Histogram::bucketOf(qint64 value)
+{
+    if (value < HIST_SUB_COUNT)
+        return value < 0 ? 0 : int(value);
+    if (value > HIST_HIGHEST)
+        value = HIST_HIGHEST;
+
+    quint64 bits = quint64(value);
+#if defined (Q_CC_GNU)
+    int msb = 63 - __builtin_clzll(bits);
+#else
+    int msb = HIST_SUB_BITS;
+    while (bits >> (msb + 1))
+        msb++;
+#endif
+    int shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + int((bits >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+qint64 Histogram::highestOf(int bucket)
+{
+    if (bucket < HIST_SUB_COUNT)
+        return bucket;
+    int shift = (bucket >> HIST_SUB_BITS) - 1;
+    qint64 lowest = qint64(HIST_SUB_COUNT + (bucket & (HIST_SUB_COUNT - 1))) << shift;
+    return lowest + (Q_INT64_C(1) << shift) - 1;
+}
+
+void Histogram::record(qint64 value)
+{
+    if (value < 0)
+        value = 0;
+    m_counts [bucketOf(value)]++;
+    m_count++;
+    m_sum += value;
+    if (value > m_max)
+        m_max = value;
+}
+
+void Histogram::add(const Histogram &other)
+{
+    for (int bucket = 0; bucket < HIST_BUCKETS; bucket++)
+        m_counts [bucket] += other.m_counts [bucket];
+    m_count += other.m_count;
+    m_sum += other.m_sum;
+    if (other.m_max > m_max)
+        m_max = other.m_max;
+}
+
+qint64 Histogram::count() const
+{
+    return m_count;
+}
+
+qint64 Histogram::max() const
+{
+    return m_max;
+}
+
+double Histogram::mean() const
+{
+    return m_count ? double(m_sum) / m_count : 0;
+}
+
+qint64 Histogram::percentile(double percent) const
+{
+    if (m_count == 0)
+        return 0;
+    qint64 rank = qint64(m_count * qBound(0.0, percent, 100.0) / 100.0 + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    qint64 seen = 0;
+    for (int bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+        seen += m_counts [bucket];
+        if (seen >= rank)
+            return qMin(highestOf(bucket), m_max);
+    }
+    return m_max;
+}
+
+SocketStats::SocketStats()
+{
+    type = -1;
+    reset();
+}
+
+void SocketStats::reset()
+{
+    m_sequence.fetchAndAddOrdered(1);
+    sent = received = 0;
+    bytes_sent = bytes_received = 0;
+    send_time.reset();
+    recv_time.reset();
+    m_sequence.fetchAndAddOrdered(1);
+}
+
+void SocketStats::sentMessage(qint64 bytes, qint64 nsecs)
+{
+    m_sequence.fetchAndAddOrdered(1);
+    sent++;
+    bytes_sent += bytes;
+    send_time.record(nsecs);
+    m_sequence.fetchAndAddOrdered(1);
+}
+
+void SocketStats::receivedMessage(qint64 bytes, qint64 nsecs)
+{
+    m_sequence.fetchAndAddOrdered(1);
+    received++;
+    bytes_received += bytes;
+    recv_time.record(nsecs);
+    m_sequence.fetchAndAddOrdered(1);
+}
+
+SocketStats SocketStats::snapshot() const
+{
+    SocketStats copy;
+    while (true) {
+        int sequence = m_sequence.fetchAndAddOrdered(0);
+        if (sequence & 1) {
+            QThread::yieldCurrentThread();
+            continue;
+        }
+        copy = *this;
+        if (m_sequence.fetchAndAddOrdered(0) == sequence)
+            break;
+    }
+    return copy;
+}
+
+//  Records while statsTest takes snapshots, every one must add up
+static void s_stats_writer(SocketStats *stats)
+{
+    for (int msg_nbr = 0; msg_nbr < 100000; msg_nbr++)
+        stats->sentMessage(5, msg_nbr);
+}
+
+//  Started once, on first use by any thread
+class StatsClock {
+public:
+    StatsClock() { timer.start(); }
+    QElapsedTimer timer;
+};
+
+qint64 SocketStats::clock()
+{
+    static StatsClock s_clock;
+    return s_clock.timer.nsecsElapsed();
+}
+
+//  Stats exporter, publishes the stats of every instrumented socket in
+//  its context once per interval, one message per socket:
+//      "STATS", name, type, sent, received, bytes sent, bytes received,
+//      send p50, p99, max, recv p50, p99, max
+//  numbers are decimal strings, times in nsecs.
+
+class StatsHandler {
+public:
+    StatsHandler(Socket* pip, Context* cntx) {
+        pipe = pip;
+        context = cntx;
+        publisher = 0;
+        interval = STATS_INTERVAL;
+        publish_at = clock_mono() + interval;
+        terminated = false;
+        verbose = false;
+    }
+
+    ~StatsHandler() {
+        delete publisher;
+    }
+
+    int handlePipe();
+    void publish();
+
+    Socket *pipe;               //  Actor command pipe
+    Context *context;           //  Context whose sockets we export
+    Socket *publisher;          //  PUB socket stats go out on
+    int interval;               //  Publish interval, msecs
+    qint64 publish_at;          //  Next publish time
+    bool terminated;            //  Did caller ask us to quit?
+    bool verbose;               //  Verbose logging enabled?
+};
+
+int StatsHandler::handlePipe()
+{
+    Messages request;
+    request.recv(*pipe);
+    if(request.size() <= 0) return -1;
+
+    QString command = request.popstr();
+    if (verbose)
+        qDebug("qstats: API command=%s", command.toLatin1().data());
+
+    if (command == "PUBLISH") {
+        QString endpoint = request.popstr();
+        delete publisher;
+        publisher = context->createSocket(ZMQ_PUB);
+        if (publisher && publisher->bind("%s", endpoint.toLatin1().data()) == -1) {
+            qWarning("qstats: can't bind '%s'", endpoint.toLatin1().data());
+            delete publisher;
+            publisher = 0;
+        }
+        pipe->signal(publisher ? 0 : 1);
+    }
+    else
+    if (command == "INTERVAL") {
+        int msecs = request.popstr().toInt();
+        if (msecs > 0) {
+            interval = msecs;
+            publish_at = clock_mono() + interval;
+        }
+        pipe->signal(msecs > 0 ? 0 : 1);
+    }
+    else
+    if (command == "VERBOSE") {
+        verbose = true;
+        pipe->signal(0);
+    }
+    else
+    if (command == "$TERM")
+        terminated = true;
+    else {
+        qFatal("qstats: - invalid command: %s", command.toLatin1().data());
+    }
+
+    return 0;
+}
+
+static void s_percentiles(Messages &msg, const Histogram &histogram)
+{
+    msg.append(QString::number(histogram.percentile(50)));
+    msg.append(QString::number(histogram.percentile(99)));
+    msg.append(QString::number(histogram.max()));
+}
+
+void StatsHandler::publish()
+{
+    publish_at = clock_mono() + interval;
+    if (!publisher)
+        return;
+
+    foreach (const SocketStats &stats, context->socketStats()) {
+        Messages msg;
+        msg.append(QString("STATS"));
+        msg.append(stats.name);
+        msg.append(QString::number(stats.type));
+        msg.append(QString::number(stats.sent));
+        msg.append(QString::number(stats.received));
+        msg.append(QString::number(stats.bytes_sent));
+        msg.append(QString::number(stats.bytes_received));
+        s_percentiles(msg, stats.send_time);
+        s_percentiles(msg, stats.recv_time);
+        msg.send(*publisher);
+    }
+}
+
+void qstats(Socket *pipe, void *args)
+{
+    StatsHandler self(pipe, args ? (Context*) args : pipe->context());
+    pipe->signal(0);
+
+    while (!self.terminated) {
+        long timeout = long(self.publish_at - clock_mono());
+        zmq_pollitem_t items [] = { { pipe->resolve(), 0, ZMQ_POLLIN, 0 } };
+        if (zmq_poll(items, 1, timeout < 0 ? 0 : timeout) == -1)
+            break;              //  Interrupted
+
+        if (items [0].revents & ZMQ_POLLIN)
+            self.handlePipe();
+
+        if (clock_mono() >= self.publish_at)
+            self.publish();
+    }
+}
+
+void statsTest(bool verbose)
+{
+    printf (" * qstats: ");
+    if (verbose)
+        printf ("\n");
+
+    //  @selftest
+    Histogram histogram;
+    assert (histogram.percentile(50) == 0);
+    for (qint64 value = 1; value <= 1000; value++)
+        histogram.record(value);
+    assert (histogram.count() == 1000);
+    assert (histogram.max() == 1000);
+    //  Buckets are at most 1/16 of their value wide
+    assert (qAbs(histogram.percentile(50) - 500) <= 500 / HIST_SUB_COUNT);
+    assert (histogram.percentile(100) == 1000);
+    int bucket;
+    for (bucket = 1; bucket < HIST_BUCKETS; bucket++)
+        assert (Histogram::bucketOf(Histogram::highestOf(bucket)) == bucket);
+
+    //  Snapshots taken while the owner writes are never torn
+    SocketStats shared;
+    QFuture<void> writing = QtConcurrent::run(s_stats_writer, &shared);
+    while (!writing.isFinished()) {
+        SocketStats snapshot = shared.snapshot();
+        assert (snapshot.bytes_sent == snapshot.sent * 5);
+        assert (snapshot.send_time.count() == snapshot.sent);
+    }
+    writing.waitForFinished();
+    assert (shared.snapshot().sent == 100000);
+
+#if !defined (QMQ_NO_STATS)
+    //  Instrumented pair, registered in its context
+    Socket *output = Socket::createPair("@inproc://stats.test");
+    Socket *input = Socket::createPair(">inproc://stats.test");
+    assert (output && input);
+    output->setStatsEnabled(true, "output");
+    input->setStatsEnabled(true, "input");
+
+    int msg_nbr;
+    for (msg_nbr = 0; msg_nbr < 10; msg_nbr++) {
+        Frame frame("Hello", 5);
+        frame.send(*output, 0);
+    }
+    for (msg_nbr = 0; msg_nbr < 10; msg_nbr++) {
+        Frame frame;
+        frame.recv(*input);
+    }
+    SocketStats stats = output->stats();
+    assert (stats.sent == 10 && stats.bytes_sent == 50);
+    assert (stats.send_time.count() == 10);
+    stats = input->stats();
+    assert (stats.received == 10 && stats.bytes_received == 50);
+
+    QStringList names;
+    foreach (const SocketStats &entry, output->context()->socketStats())
+        names << entry.name;
+    assert (names.contains("output") && names.contains("input"));
+
+    //  Exporter publishes both sockets
+    ActorSocket exporter(qstats, NULL);
+    if (verbose) {
+        exporter.sendx("VERBOSE", NULL);
+        exporter.wait();
+    }
+    exporter.sendx("PUBLISH", "inproc://stats.pub", NULL);
+    int rc = exporter.wait();
+    assert (rc == 0);
+    exporter.sendx("INTERVAL", "10", NULL);
+    exporter.wait();
+
+    Socket *subscriber = Socket::createSub(">inproc://stats.pub", "STATS");
+    assert (subscriber);
+    Messages msg;
+    do {
+        msg.recv(*subscriber);
+        assert (msg.size() == 13);
+        assert (msg.popstr() == "STATS");
+    } while (msg.popstr() != "output");
+    assert (msg.popstr().toInt() == ZMQ_PAIR);
+    assert (msg.popstr() == "10");
+
+    output->setStatsEnabled(false);
+    assert (!output->statsEnabled());
+    assert (output->stats().sent == 0);
+
+    delete subscriber;
+    delete input;
+    delete output;
+#endif
+    //  @end
+    printf ("OK\n");
+}
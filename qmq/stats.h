@@ -0,0 +1,86 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <QString>
+#include <QAtomicInt>
+
+#ifndef QMQ_EXPORT
+#define QMQ_EXPORT
+#endif
+
+//  Histogram layout, after HdrHistogram: values below HIST_SUB_COUNT have
+//  a bucket each, above that every power of two is split in HIST_SUB_COUNT
+//  linear buckets, so a bucket is never wider than 1/16 of its value.
+//  Values are nsecs and clamp at 2^48 (about 78 hours).
+#define HIST_SUB_BITS       4
+#define HIST_SUB_COUNT      (1 << HIST_SUB_BITS)
+#define HIST_MAGNITUDES     44
+#define HIST_BUCKETS        ((HIST_MAGNITUDES + 1) * HIST_SUB_COUNT)
+
+/// Log-linear histogram of positive values, fixed size and allocation free.
+/// There is no lock: a histogram has one writer, the thread that owns the
+/// socket, and copies taken from other threads may miss the latest record.
+class QMQ_EXPORT Histogram
+{
+public:
+    Histogram();
+
+    void record(qint64 value);
+    void add(const Histogram& other);
+    void reset();
+
+    qint64 count() const;
+    qint64 max() const;
+    double mean() const;
+
+    //  --------------------------------------------------------------------------
+    //  Value at or below which the given percent (0..100) of records fall,
+    //  as the highest value of its bucket. Returns 0 on an empty histogram.
+    qint64 percentile(double percent) const;
+
+    static int bucketOf(qint64 value);
+    static qint64 highestOf(int bucket);
+
+private:
+    quint32 m_counts [HIST_BUCKETS];
+    qint64 m_count;
+    qint64 m_sum;
+    qint64 m_max;
+};
+
+/// Counters of one instrumented socket, see SocketBase::setStatsEnabled.
+/// Times are nsecs spent inside zmq send and receive calls, so they show
+/// how long the socket blocked, not how long a message was on the wire.
+/// The owner thread writes under a sequence counter (a seqlock), other
+/// threads read with snapshot() and never see half an update.
+class QMQ_EXPORT SocketStats
+{
+public:
+    SocketStats();
+
+    void reset();
+    void sentMessage(qint64 bytes, qint64 nsecs);
+    void receivedMessage(qint64 bytes, qint64 nsecs);
+
+    //  --------------------------------------------------------------------------
+    //  Consistent copy, safe from any thread while the owner records. Retries
+    //  while an update is in progress, the owner never waits for readers.
+    SocketStats snapshot() const;
+
+    //  Monotonic clock in nsecs, used for all timings
+    static qint64 clock();
+
+    QString name;               //  Socket name given when enabled
+    int type;                   //  Socket type, ZMQ_PUB...
+    qint64 sent;                //  Frames sent
+    qint64 received;            //  Frames received
+    qint64 bytes_sent;          //  Payload bytes sent
+    qint64 bytes_received;      //  Payload bytes received
+    Histogram send_time;        //  Time blocked in send
+    Histogram recv_time;        //  Time blocked in receive
+
+private:
+    mutable QAtomicInt m_sequence;  //  Odd while the owner writes
+};
+
+#endif // STATS_H
@@ -0,0 +1,262 @@
+#include "helper.h"
+
+#include <QDebug>
+
+static const char *s_hop_names [] = {
+    NULL, "client-send", "proxy", "broker-in", "broker-dispatch",
+    "worker-in", "worker-reply", "broker-report", "client-recv"
+};
+
+bool Trace::isTrace(const void *data, int size)
+{
+    const byte *needle = (const byte *) data;
+    return size >= QTRACE_HEADER
+        && memcmp (needle, QTRACE_MAGIC, 4) == 0
+        && needle [4] == QTRACE_VERSION
+        && size == QTRACE_HEADER + needle [5] * QTRACE_HOP_SIZE;
+}
+
+bool Trace::isTraced(Messages &msg)
+{
+    Frame *last = msg.last();
+    return last && isTrace(last->constData(), last->size());
+}
+
+void Trace::begin(Messages &msg, quint32 id, int hop)
+{
+    byte header [QTRACE_HEADER];
+    memcpy (header, QTRACE_MAGIC, 4);
+    header [4] = QTRACE_VERSION;
+    header [5] = 0;
+    header [6] = (byte) ((id >> 24) & 255);
+    header [7] = (byte) ((id >> 16) & 255);
+    header [8] = (byte) ((id >> 8) & 255);
+    header [9] = (byte) (id & 255);
+    QByteArray trace = stamped(header, QTRACE_HEADER, hop);
+    msg.append(new Frame(trace));
+}
+
+QByteArray Trace::stamped(const void *data, int size, int hop)
+{
+    if (!isTrace(data, size) || ((const byte *) data) [5] >= QTRACE_MAX_HOPS)
+        return QByteArray();
+
+    QByteArray trace((const char *) data, size + QTRACE_HOP_SIZE);
+    byte *needle = (byte *) trace.data();
+    needle [5]++;
+    needle += size;
+    quint64 usecs = quint64(clock_usecs());
+    *needle++ = (byte) hop;
+    for (int shift = 56; shift >= 0; shift -= 8)
+        *needle++ = (byte) ((usecs >> shift) & 255);
+    return trace;
+}
+
+bool Trace::stamp(Frame *trace, int hop)
+{
+    QByteArray data = stamped(trace->constData(), trace->size(), hop);
+    if (data.isEmpty())
+        return false;
+    trace->reset(data.constData(), data.size());
+    return true;
+}
+
+//  The trailer is replaced, not reset in place, so msg keeps its
+//  content size right
+
+bool Trace::stamp(Messages &msg, int hop)
+{
+    Frame *last = msg.last();
+    if (!last)
+        return false;
+    QByteArray trace = stamped(last->constData(), last->size(), hop);
+    if (trace.isEmpty())
+        return false;
+    delete msg.remove(msg.size() - 1);
+    msg.append(new Frame(trace));
+    return true;
+}
+
+Frame *Trace::take(Messages &msg)
+{
+    if (!isTraced(msg))
+        return NULL;
+    return msg.remove(msg.size() - 1);
+}
+
+quint32 Trace::id(const QByteArray &trace)
+{
+    if (!isTrace(trace.constData(), trace.size()))
+        return 0;
+    const byte *data = (const byte *) trace.constData();
+    return (quint32(data [6]) << 24) | (data [7] << 16) | (data [8] << 8) | data [9];
+}
+
+QList<QPair<int, qint64> > Trace::hops(const QByteArray &trace)
+{
+    QList<QPair<int, qint64> > list;
+    if (!isTrace(trace.constData(), trace.size()))
+        return list;
+
+    const byte *needle = (const byte *) trace.constData() + QTRACE_HEADER;
+    int count = ((const byte *) trace.constData()) [5];
+    for (int index = 0; index < count; index++) {
+        int hop = *needle++;
+        quint64 usecs = 0;
+        for (int byte_nbr = 0; byte_nbr < 8; byte_nbr++)
+            usecs = (usecs << 8) | *needle++;
+        list.append(qMakePair(hop, qint64(usecs)));
+    }
+    return list;
+}
+
+QString Trace::hopName(int hop)
+{
+    if (hop >= ClientSend && hop <= ClientReceive)
+        return s_hop_names [hop];
+    return QString("hop-%1").arg(hop);
+}
+
+TraceCollector::TraceCollector()
+{
+    m_count = 0;
+}
+
+bool TraceCollector::add(const QByteArray &trace)
+{
+    QList<QPair<int, qint64> > list = Trace::hops(trace);
+    if (list.isEmpty())
+        return false;
+
+    for (int index = 1; index < list.size(); index++) {
+        QString name = Trace::hopName(list [index - 1].first)
+                     + ">" + Trace::hopName(list [index].first);
+        if (!m_segments.contains(name))
+            m_order.append(name);
+        m_segments [name].record(list [index].second - list [index - 1].second);
+    }
+    m_total.record(list.last().second - list.first().second);
+    m_count++;
+    return true;
+}
+
+void TraceCollector::reset()
+{
+    m_segments.clear();
+    m_order.clear();
+    m_total.reset();
+    m_count = 0;
+}
+
+int TraceCollector::count() const
+{
+    return m_count;
+}
+
+QStringList TraceCollector::segments() const
+{
+    return m_order;
+}
+
+Histogram TraceCollector::segment(const QString &name) const
+{
+    return m_segments.value(name);
+}
+
+Histogram TraceCollector::total() const
+{
+    return m_total;
+}
+
+static QString s_line(const QString &name, const Histogram &histogram)
+{
+    return QString("%1 %2 %3 %4 %5").arg(name).arg(histogram.count())
+            .arg(histogram.percentile(50)).arg(histogram.percentile(99))
+            .arg(histogram.max());
+}
+
+QStringList TraceCollector::report() const
+{
+    QStringList lines;
+    foreach (const QString &name, m_order)
+        lines << s_line(name, m_segments [name]);
+    lines << s_line("total", m_total);
+    return lines;
+}
+
+void traceTest(bool verbose)
+{
+    printf (" * trace: ");
+    if (verbose)
+        printf ("\n");
+
+    //  @selftest
+    Messages msg;
+    msg.append(QString("Hello"));
+    assert (!Trace::isTraced(msg));
+    assert (!Trace::stamp(msg, Trace::ProxySwitch));
+    Trace::begin(msg, 42);
+    assert (msg.size() == 2);
+    assert (Trace::stamp(msg, Trace::BrokerDispatch));
+    QByteArray trace = msg.last()->bdata();
+    assert (Trace::id(trace) == 42);
+    QList<QPair<int, qint64> > hops = Trace::hops(trace);
+    assert (hops.size() == 2);
+    assert (hops [0].first == Trace::ClientSend);
+    assert (hops [1].first == Trace::BrokerDispatch);
+    assert (hops [1].second >= hops [0].second);
+
+    //  Proxy stamps the trailer when asked to, body stays as it was
+    ActorSocket proxy(qproxy, NULL);
+    if (verbose) {
+        proxy.sendstr("VERBOSE");
+        proxy.wait();
+    }
+    proxy.sendx("FRONTEND", "PULL", "inproc://trace-frontend", NULL);
+    proxy.wait();
+    proxy.sendx("BACKEND", "PUSH", "inproc://trace-backend", NULL);
+    proxy.wait();
+    proxy.sendx("TRACE", "ON", NULL);
+    proxy.wait();
+
+    Socket *faucet = Socket::createPush(">inproc://trace-frontend");
+    assert (faucet);
+    Socket *sink = Socket::createPull(">inproc://trace-backend");
+    assert (sink);
+
+    msg.send(*faucet);
+    msg.recv(*sink);
+    assert (msg.size() == 2);
+    assert (msg.firstStr() == "Hello");
+    Frame *trailer = Trace::take(msg);
+    assert (trailer);
+    hops = Trace::hops(trailer->bdata());
+    assert (hops.size() == 3);
+    assert (hops [2].first == Trace::ProxySwitch);
+
+    TraceCollector collector;
+    assert (collector.add(trailer->bdata()));
+    assert (!collector.add(QByteArray("Hello")));
+    delete trailer;
+    assert (collector.count() == 1);
+    assert (collector.segments().size() == 2);
+    assert (collector.segments() [1] == "broker-dispatch>proxy");
+    assert (collector.total().count() == 1);
+    if (verbose)
+        qDebug() << collector.report();
+
+    //  Switched off, the trailer goes through as it came
+    proxy.sendx("TRACE", "OFF", NULL);
+    proxy.wait();
+    msg.clear();
+    msg.append(QString("Hello"));
+    Trace::begin(msg, 43);
+    msg.send(*faucet);
+    msg.recv(*sink);
+    assert (Trace::hops(msg.last()->bdata()).size() == 1);
+
+    delete faucet;
+    delete sink;
+    //  @end
+    printf ("OK\n");
+}
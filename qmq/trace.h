@@ -0,0 +1,93 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <QMap>
+#include <QPair>
+#include <QStringList>
+
+#include "stats.h"
+
+#ifndef QMQ_EXPORT
+#define QMQ_EXPORT
+#endif
+
+class Frame;
+class Messages;
+
+//  Trace trailer, an optional last frame that collects a timestamp at
+//  each qmq hop a message goes through:
+//      "QTRC", version (1 byte), hop count (1 byte), trace id (4 bytes)
+//      then per hop: hop kind (1 byte), usecs (8 bytes)
+//  numbers in network order. Times are clock_usecs, monotonic and shared
+//  by all processes of a host, so hops on one host can be compared.
+#define QTRACE_MAGIC        "QTRC"
+#define QTRACE_VERSION      1
+#define QTRACE_HEADER       10
+#define QTRACE_HOP_SIZE     9
+#define QTRACE_MAX_HOPS     32
+
+/// Trace trailers. Hops only rebuild the trailer, a few bytes; the body
+/// frames of a traced message are never copied.
+class QMQ_EXPORT Trace
+{
+public:
+    enum Hop {
+        ClientSend = 1, ProxySwitch, BrokerReceive, BrokerDispatch,
+        WorkerReceive, WorkerReply, BrokerReport, ClientReceive
+    };
+
+    static bool isTrace(const void* data, int size);
+    static bool isTraced(Messages& msg);
+
+    //  Append a new trailer to msg, with its first hop
+    static void begin(Messages& msg, quint32 id, int hop = ClientSend);
+
+    //  --------------------------------------------------------------------------
+    //  Add a hop to the trailer of msg, or to a trailer taken off one.
+    //  Returns false if there is no trailer or it is full.
+    static bool stamp(Messages& msg, int hop);
+    static bool stamp(Frame* trace, int hop);
+
+    //  Trailer data with one more hop, empty if data is not a trailer or
+    //  is full
+    static QByteArray stamped(const void* data, int size, int hop);
+
+    //  Take the trailer off msg, NULL if there is none; caller owns it
+    static Frame* take(Messages& msg);
+
+    static quint32 id(const QByteArray& trace);
+    //  Hops of a trailer in order, kind and usecs
+    static QList<QPair<int, qint64> > hops(const QByteArray& trace);
+    static QString hopName(int hop);
+};
+
+/// Reconstructs per hop latency from trailers: a histogram of usecs for
+/// each pair of hops seen one after other, named "client-send>proxy", and
+/// one for the whole trip.
+class QMQ_EXPORT TraceCollector
+{
+public:
+    TraceCollector();
+
+    //  Returns false if trace is not a trailer
+    bool add(const QByteArray& trace);
+    void reset();
+
+    int count() const;
+    QStringList segments() const;
+    Histogram segment(const QString& name) const;
+    Histogram total() const;
+
+    //  One line per segment and total: name, count, p50, p99, max
+    QStringList report() const;
+
+private:
+    QMap<QString, Histogram> m_segments;
+    QStringList m_order;        //  Segments in order first seen
+    Histogram m_total;
+    int m_count;
+};
+
+extern "C" QMQ_EXPORT void traceTest(bool verbose=false);
+
+#endif // TRACE_H
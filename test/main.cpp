@@ -17,6 +17,7 @@ int main (int argc, char *argv [])
 //    main_ctx.setIoThreads(4);
 
     Context::test();
+    QMNet::test();
     Frame::test();
     GossipFrame::test();
     Messages::test();
@@ -24,8 +25,15 @@ int main (int argc, char *argv [])
     Poller::test();
     ActorSocket::test();
     monitorTest(false);
-    beaconTest(false); // buggy in linux
+    beaconTest(false);
     proxyTest(false);
+    gossipTest(false);
+    replayTest(false);
+    statsTest(false);
+    traceTest(false);
+    MdpBroker::test(false);
+    QHub::test(false);
+    QClient::test(false);
     SockEvent::test(false);
 
     return a.exec();